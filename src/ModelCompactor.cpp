@@ -7,6 +7,7 @@
 #include "compactorreport.hpp"
 #include "ModelCompactor.hpp"
 #include "cellmlutils.hpp"
+#include "modelshards.hpp"
 
 // XML Namespaces
 #define MATHML_NS L"http://www.w3.org/1998/Math/MathML"
@@ -60,15 +61,20 @@ private:
     }
 
 public:
-    ObjRef<iface::cellml_api::Model> CompactModel(iface::cellml_api::Model* modelIn, CompactorReport& report)
+    explicit ModelCompactor(FlatteningContext* context) : mCellml(context)
+    {
+    }
+
+    int CompactModel(iface::cellml_api::Model* modelIn, CompactorReport& report,
+                     const std::set<std::wstring>* components, std::string& output)
     {
         std::wstring modelName = modelIn->name();
         report.setSourceModel(modelIn);
         std::wcout << L"Compacting model " << modelName << L" to a single CellML 1.0 component."
                    << std::endl;
-        // grab a clone of the source model before we do anything that might instantiate imports.
-        mModelIn = QueryInterface(modelIn->clone(true));
-        mModelIn->fullyInstantiateImports();
+        // the source model is used as given: imports are instantiated as the compaction needs them and
+        // uninstantiated again once we're done, so there is no need to work on a clone of the model.
+        mModelIn = modelIn;
 
         // Create the output model
         mModelOut = mCellml.createModel();
@@ -85,17 +91,19 @@ public:
         if (mCellml.setSourceModel(mModelIn) != 0)
         {
             std::wcerr << L"Doh!" << std::endl;
-            return NULL;
+            return -1;
         }
 
         ObjRef<iface::cellml_api::CellMLComponentSet> localComponents = mModelIn->localComponents();
         ObjRef<iface::cellml_api::CellMLComponentIterator> lci = localComponents->iterateComponents();
         std::wstring vname, tmpName;
+        int failedVariables = 0;
         while (true)
         {
             ObjRef<iface::cellml_api::CellMLComponent> lc = lci->nextComponent();
             if (lc == NULL) break;
             cname = lc->name();
+            if (components && (components->count(cname) == 0)) continue;
             std::wcout << L"Adding variables from component: " << cname << L"; to the new model."
                           << std::endl;
             ObjRef<iface::cellml_api::CellMLVariableSet> vs = lc->variables();
@@ -117,25 +125,35 @@ public:
                 {
                     std::wcerr << L"Error mapping local variable: " << v->componentName() << L" / " << vname
                                << std::endl;
-                    return NULL;
+                    // keep going so that the report covers all the variables we can't compact, the failed source
+                    // variables are remembered so their dependencies won't be explored again.
+                    report.setCurrentSourceModelVariableFailed();
+                    ++failedVariables;
                 }
             }
         }
-        // serialise the generated model to a string to catch any special annotations we might
-        // have created.
-        std::wstring modelString = mCellml.modelToString(mModelOut);
-        // and then parse the model back to check its all good
-        ObjRef<iface::cellml_api::Model> newModel = mCellml.createModelFromString(modelString);
-        return newModel;
+        report.setImportCounts(mCellml.importsInstantiated(), mCellml.importsSkipped());
+        std::wcout << L"Instantiated " << mCellml.importsInstantiated() << L" imports, "
+                   << mCellml.importsSkipped() << L" imports were not needed." << std::endl;
+        if (failedVariables > 0)
+        {
+            std::wcerr << L"Unable to compact " << failedVariables << L" of the variables in the model." << std::endl;
+            return -2;
+        }
+        if (components)
+        {
+            // identify the compacted variables by their source variable, for merging with the other shards
+            for (const auto& v: mSourceVariables) v.second->cmetaId(shardVariableId(v.first));
+        }
+        // write out the generated model along with the math we have created for it
+        if (mCellml.writeModel(mModelOut, output) != 0) return -3;
+        return 0;
     }
 };
 
-ObjRef<iface::cellml_api::Model> compactModel(iface::cellml_api::Model* model, CompactorReport& report)
+int compactModel(iface::cellml_api::Model* model, CompactorReport& report, std::string& output,
+                 FlatteningContext* context, const std::set<std::wstring>* components)
 {
-    ObjRef<iface::cellml_api::Model> new_model;
-    {
-        ModelCompactor compactor;
-        new_model = compactor.CompactModel(model, report);
-    }
-    return new_model;
+    ModelCompactor compactor(context);
+    return compactor.CompactModel(model, report, components, output);
 }
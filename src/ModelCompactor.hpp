@@ -1,19 +1,30 @@
 #ifndef MODELCOMPACTOR_HPP
 #define MODELCOMPACTOR_HPP
 
+#include <set>
+#include <string>
+
 #include <IfaceCellML_APISPEC.hxx>
 #include <cellml-api-cxx-support.hpp>
 
 #include "compactorreport.hpp"
 
+class FlatteningContext;
+
 /**
  * Compact the given model into a model which contains just two components. One component will define all
  * variables found in the top-level of the given model, and the other component will contain all the variables
  * and math required to fully define those variables. As a by-product of this compaction, all units will be
  * converted to their cononical representation.
  * @param model The source model to compact (imports will be instantiated when needed).
- * @return If compaction is successful, returns the compacted model. Otherwise NULL on failure.
+ * @param report The report to fill in with details of the compaction.
+ * @param output Will be set to the UTF-8 compacted model.
+ * @param context If given, the shared bootstraps and import cache to use.
+ * @param components If given, only the variables of these top-level components are compacted, and the compacted
+ * variables are given shard ids so that the result can be merged with other shards (see mergeShards).
+ * @return zero on success.
  */
-ObjRef<iface::cellml_api::Model> compactModel(iface::cellml_api::Model* model, CompactorReport& report);
+int compactModel(iface::cellml_api::Model* model, CompactorReport& report, std::string& output,
+                 FlatteningContext* context = NULL, const std::set<std::wstring>* components = NULL);
 
 #endif // MODELCOMPACTOR_HPP
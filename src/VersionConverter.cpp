@@ -10,12 +10,12 @@
  *  * initial_value="variable_name"
  *    (At least to maintain the same semantics.  If the referenced variable
  *     has a numeric initial_value, then we do use that directly.)
+ *  * a component imported under several names which is connected to, or
+ *    encapsulates, other copied components within its own model.  Each
+ *    name gets its own copy, but the other components only have one.
  *
  * Does not handle:
  *  * reaction elements
- *  * different units definitions with the same name
- *    (in fact the units copying is rather dodgy, but likely to work OK in most
- *     cases)
  *  * extension attributes on CellML elements (due to lack of API support)
  *  * re-building the containment hierarchy (since contained components
  *    aren't necessarily needed for simulation)
@@ -32,6 +32,8 @@
 #include <wchar.h>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 
@@ -48,14 +50,19 @@
 // object.
 #include <CellMLBootstrap.hpp>
 
-// For user annotations
-#include <IfaceAnnoTools.hxx>
-#include <AnnoToolsBootstrap.hpp>
-
 // For finding relevant components
 #include <IfaceCeVAS.hxx>
 #include <CeVASBootstrap.hpp>
 
+// For comparing units definitions
+#include <IfaceCUSES.hxx>
+#include <CUSESBootstrap.hpp>
+
+#include "flatteningcontext.hpp"
+#include "uniquenameallocator.hpp"
+#include "utils.hpp"
+#include "VersionConverter.hpp"
+
 // Save typing
 namespace cml = iface::cellml_api;
 namespace cmlsvs = iface::cellml_services;
@@ -148,72 +155,118 @@ bool set_contains(const std::set<T> s, const T& m)
 class VersionConverter
 {
 private:
+    /// Shared bootstraps to use, if any
+    FlatteningContext* mContext;
+
     /// The model we're converting
     cml::Model* mModelIn;
 
     /// The model we're creating
     cml::Model* mModelOut;
 
-    /// Manager for annotations on models
-    iface::cellml_services::AnnotationSet* mAnnoSet;
+    /// The DOM document of the model we're creating
+    ObjRef<dom::Document> mDocOut;
+
+    /// The copy made in the new model of each instance of a source component, keyed on the component naming the
+    /// instance (not owned): its outermost import component if imported, otherwise the source component itself
+    std::unordered_map<cml::CellMLComponent*, ObjRef<cml::CellMLComponent> > mComponentCopies;
+
+    /// The real component of each import component, keyed on the import component (not owned); NULL if the
+    /// real component does not exist
+    std::unordered_map<cml::CellMLComponent*, ObjRef<cml::CellMLComponent> > mRealComponents;
+
+    /// The import components referring to each imported component, keyed on the component referred to (not owned)
+    std::unordered_map<cml::CellMLComponent*, std::vector<ObjRef<cml::ImportComponent> > > mImporters;
+
+    /// Set if a component imported under several names is connected
+    /// or encapsulated within its own model, which isn't supported
+    bool mSharedInstanceUsed;
 
     /// Root group used in the new model
     cml::Group *mRootGroup;
 
-    /// Units we have already copied into the new model
-    std::set<std::pair<std::wstring,std::wstring> > mCopiedUnits;
+    /// Canonical units of the source model, used to spot units with
+    /// the same definition
+    ObjRef<cmlsvs::CUSES> mCuses;
+
+    /// The name in the new model of each source units definition
+    /// copied, keyed on the source units (not owned)
+    std::unordered_map<cml::Units*, std::wstring> mUnitsCopies;
+
+    /// The name in the new model of each units definition copied,
+    /// keyed on the definition (see UnitsDefinitionKey)
+    std::map<std::wstring, std::wstring> mUnitsByDefinition;
+
+    /// Units names used in the new model, to avoid clashes
+    UniqueNameAllocator mUnitsNames;
+
+    /// The source model and every model it imports, directly or
+    /// indirectly, each listed once in the order first reached
+    std::vector<ObjRef<cml::Model> > mModelsPreOrder;
+
+    /// The same models, each listed after all the models it imports
+    std::vector<ObjRef<cml::Model> > mModelsPostOrder;
+
+    /// The variables of the copied source components, keyed on the
+    /// source component (not owned) and variable name
+    std::map<std::pair<cml::CellMLComponent*, std::wstring>, ObjRef<cml::CellMLVariable> > mSourceVariables;
+
+    /// The copied variables whose initial value names a variable,
+    /// with their source variable
+    std::vector<std::pair<ObjRef<cml::CellMLVariable>, ObjRef<cml::CellMLVariable> > > mInitialValueVariables;
+
+    /// The numeric initial value each source variable resolves to
+    /// (empty if it has none), keyed on the source variable (not owned)
+    std::unordered_map<cml::CellMLVariable*, std::wstring> mResolvedInitialValues;
 
     /// Component names used in the new model, to avoid duplicates
-    std::set<std::wstring> mCompNames;
+    UniqueNameAllocator mCompNames;
 
 public:
+    VersionConverter(FlatteningContext* context) : mContext(context)
+    {
+    }
+
     /** Reset member data to convert a new model. */
     void Reset()
     {
         mModelIn = NULL;
         mModelOut = NULL;
-        mAnnoSet = NULL;
+        mDocOut = NULL;
+        mComponentCopies.clear();
+        mRealComponents.clear();
+        mImporters.clear();
+        mSharedInstanceUsed = false;
+        mModelsPreOrder.clear();
+        mModelsPostOrder.clear();
         mRootGroup = NULL;
-        mCopiedUnits.clear();
+        mCuses = NULL;
+        mUnitsCopies.clear();
+        mUnitsByDefinition.clear();
+        mUnitsNames.clear();
+        mSourceVariables.clear();
+        mInitialValueVariables.clear();
+        mResolvedInitialValues.clear();
         mCompNames.clear();
     }
 
     /**
-     * A utility method which employs CeVAS's algorithm to find the
-     * 'real' component for the given component.  That is, if the
-     * component is an ImportComponent, the template CellMLComponent
-     * that it is based on in an imported model.  Otherwise returns
-     * the given component.
-     *
-     * Requires imports to have been fully instantiated.  Returns NULL
-     * if the real component does not exist.
+     * Find the 'real' component for the given component.  That is, if
+     * the component is an ImportComponent, the template
+     * CellMLComponent that it is based on in an imported model.
+     * Otherwise returns the given component.
      *
-     * Also requires that a component is not imported more than once
-     * in the same import element, as then multiple components share
-     * one real component.
+     * Requires ResolveImportComponents to have been called.  Returns
+     * NULL if the real component does not exist.  No reference is
+     * added to the result.
      */
     cml::CellMLComponent* FindRealComponent(cml::CellMLComponent* component)
     {
-        component->add_ref();
-        while (true)
-        {
-            DECLARE_QUERY_INTERFACE_OBJREF(impc, component,
-                                           cellml_api::ImportComponent);
-            if (impc == NULL)
-                break; // Found a non-ImportComponent
-            RETURN_INTO_OBJREF(imp_elt, cml::CellMLElement, impc->parentElement());
-            DECLARE_QUERY_INTERFACE_OBJREF(imp, imp_elt, cellml_api::CellMLImport);
-            RETURN_INTO_OBJREF(model, cml::Model, imp->importedModel());
-            assert(model != NULL);
-            RETURN_INTO_OBJREF(comps, cml::CellMLComponentSet,
-                               model->modelComponents());
-            RETURN_INTO_WSTRING(ref, impc->componentRef());
-            component->release_ref();
-            component = comps->getComponent(ref.c_str());
-            if (component == NULL)
-                break; // Real component does not exist
-        }
-        return component;
+        std::unordered_map<cml::CellMLComponent*, ObjRef<cml::CellMLComponent> >::const_iterator it =
+            mRealComponents.find(component);
+        if (it == mRealComponents.end())
+            return component;
+        return it->second;
     }
 
     /**
@@ -247,78 +300,159 @@ public:
 
 private:
     /**
-     * Annotate all imported components (whether direct or indirect)
-     * with the name they are given by the importing model.
+     * Walk the import graph below the given model, filling in
+     * mModelsPreOrder and mModelsPostOrder.
+     *
+     * The API instantiates a separate model for every import element,
+     * even when several import the same file, so the instances form a
+     * tree and each is reached once.  The walk is done once here and
+     * shared by the passes over the imported models, instead of each
+     * pass walking the imports itself.  The visited set only guards
+     * against an instance being reached twice.
      */
-    void StoreImportRenamings(cml::Model* importingModel)
+    void CollectModels(cml::Model* model,
+                       std::unordered_set<cml::Model*>& visited)
     {
-        ITERATE2(import, Import, cml::CellMLImport, importingModel->imports())
+        if (!visited.insert(model).second)
+            return;
+        mModelsPreOrder.push_back(model);
+        ITERATE2(import, Import, cml::CellMLImport, model->imports())
         {
             assert(import->wasInstantiated());
-            RETURN_INTO_OBJREF(imported_model, cml::Model,
-                               import->importedModel());
-            // Recursively process components imported by the imported
-            // model.  Depth first processing means components renamed
-            // twice end up with the right name.
-            StoreImportRenamings(imported_model);
-
-            ITERATE2(comp, ImportComponent, cml::ImportComponent,
-                     import->components())
+            RETURN_INTO_OBJREF(imp_model, cml::Model, import->importedModel());
+            assert(imp_model != NULL);
+            CollectModels(imp_model, visited);
+        }
+        mModelsPostOrder.push_back(model);
+    }
+
+    /**
+     * Find the real component of every import component, whether
+     * imported directly or indirectly, using the same algorithm as
+     * CeVAS, and record the import components referring to each
+     * component.
+     */
+    void ResolveImportComponents()
+    {
+        // Imported models are processed before the models importing
+        // them, so the components an import component refers to have
+        // already been resolved.
+        for (std::vector<ObjRef<cml::Model> >::const_iterator model = mModelsPostOrder.begin();
+             model != mModelsPostOrder.end(); ++model)
+        {
+            ITERATE2(import, Import, cml::CellMLImport, (*model)->imports())
             {
-                // Now get the component object to annotate, using the
-                // same algorithm as CeVAS.
-                RETURN_INTO_OBJREF(real_comp, cml::CellMLComponent,
-                                   FindRealComponent(comp));
-
-                RETURN_INTO_WSTRING(local_name, comp->name());
-                mAnnoSet->setStringAnnotation(real_comp, L"renamed",
-                                              local_name.c_str());
+                RETURN_INTO_OBJREF(imp_model, cml::Model, import->importedModel());
+                RETURN_INTO_OBJREF(comps, cml::CellMLComponentSet,
+                                   imp_model->modelComponents());
+                ITERATE2(comp, ImportComponent, cml::ImportComponent,
+                         import->components())
+                {
+                    RETURN_INTO_WSTRING(ref, comp->componentRef());
+                    RETURN_INTO_OBJREF(target, cml::CellMLComponent,
+                                       comps->getComponent(ref.c_str()));
+                    cml::CellMLComponent* real_comp = target == NULL ? NULL : FindRealComponent(target);
+                    mRealComponents[comp] = real_comp;
+                    if (real_comp == NULL)
+                        continue; // Real component does not exist
+                    mImporters[target].push_back(comp);
+                }
             }
         }
     }
 
+    /**
+     * Find the instances of the given component in the new model.
+     *
+     * A component imported under several names (e.g. twice by the
+     * same import element) has one instance per name.  Each instance
+     * is named by the outermost import component of a chain of
+     * imports ending at the given component, or by the component
+     * itself if it isn't imported.  The instances are appended to
+     * the given list; no references are added.
+     *
+     * Requires ResolveImportComponents to have been called.
+     */
+    void FindInstances(cml::CellMLComponent* comp,
+                       std::vector<cml::CellMLComponent*>& instances)
+    {
+        std::unordered_map<cml::CellMLComponent*, std::vector<ObjRef<cml::ImportComponent> > >::const_iterator
+            importers = mImporters.find(comp);
+        if (importers == mImporters.end())
+        {
+            instances.push_back(comp);
+            return;
+        }
+        for (std::vector<ObjRef<cml::ImportComponent> >::const_iterator importer = importers->second.begin();
+             importer != importers->second.end(); ++importer)
+        {
+            FindInstances(*importer, instances);
+        }
+    }
+
+    /**
+     * Find the copy made of the given instance of a source component
+     * in the new model.
+     *
+     * Returns NULL if the instance hasn't been copied.  The copy is
+     * owned by the new model, so no reference is added.
+     */
+    cml::CellMLComponent* FindCopy(cml::CellMLComponent* instance)
+    {
+        std::unordered_map<cml::CellMLComponent*, ObjRef<cml::CellMLComponent> >::const_iterator it =
+            mComponentCopies.find(instance);
+        if (it == mComponentCopies.end())
+            return NULL;
+        return it->second;
+    }
+
+    /**
+     * Find the copies made of every instance of the given component,
+     * which may be an import component, in the new model.  The
+     * copies are appended to the given list; no references are added.
+     */
+    void FindCopies(cml::CellMLComponent* comp,
+                    std::vector<cml::CellMLComponent*>& copies)
+    {
+        std::vector<cml::CellMLComponent*> instances;
+        FindInstances(comp, instances);
+        for (std::vector<cml::CellMLComponent*>::const_iterator instance = instances.begin();
+             instance != instances.end(); ++instance)
+        {
+            cml::CellMLComponent* copy = FindCopy(*instance);
+            if (copy != NULL)
+                copies.push_back(copy);
+        }
+    }
+
     /**
      * Ensure that component names in the generated model are unique.
      *
      * If the given name has already been used, it is modified so as
      * to be unique, by appending the string "_n" where n is the least
-     * natural number giving an unused name.
+     * natural number not yet tried for this name.
      */
     void EnsureComponentNameUnique(std::wstring& cname)
     {
-        std::wstring suffix = L"";
-        unsigned n = 0;
-        while (mCompNames.find(cname + suffix) != mCompNames.end())
-        {
-            // Current attempt already used; try the next
-            std::wstringstream _suffix;
-            _suffix << L"_" << (++n);
-            _suffix >> suffix;
-        }
-        cname += suffix;
-        mCompNames.insert(cname);
+        cname = mCompNames.allocate(cname);
     }
 
     /**
      * Copy any relevant connections into the new model.
      *
-     * Copies across any connections defined in the given model
-     * between 2 components which have been copied, and recursively
-     * processes imported models.
+     * Copies across any connections defined in the source model or
+     * the models it imports between 2 components which have been
+     * copied.
      */
-    void CopyConnections(cml::Model* model)
+    void CopyConnections()
     {
-        // Copy local connections
-        ITERATE2(conn, Connection, cml::Connection, model->connections())
+        for (std::vector<ObjRef<cml::Model> >::const_iterator model = mModelsPreOrder.begin();
+             model != mModelsPreOrder.end(); ++model)
         {
-            CopyConnection(conn);
-        }
-        // Process imported models
-        ITERATE2(import, Import, cml::CellMLImport, model->imports())
-        {
-            RETURN_INTO_OBJREF(imp_model, cml::Model, import->importedModel());
-            assert(imp_model != NULL);
-            CopyConnections(imp_model);
+            ITERATE2(conn, Connection, cml::Connection, (*model)->connections())
+            {
+                CopyConnection(conn);
+            }
         }
     }
 
@@ -327,8 +461,11 @@ private:
      * our new model.
      *
      * The connection will only be copied if both components involved
-     * have been copied across first, and hence have a "copy"
-     * annotation.
+     * have been copied across first, and hence have an entry in
+     * mComponentCopies.  Connections made in the importing model name
+     * one instance of a component imported under several names.  A
+     * connection made in the model of such a component can't be
+     * copied, and sets mSharedInstanceUsed.
      */
     void CopyConnection(cml::Connection* conn)
     {
@@ -337,14 +474,40 @@ private:
         RETURN_INTO_OBJREF(c2, cml::CellMLComponent, mc->secondComponent());
 
         // Check we've copied the components involved, and get the
-        // copies.
-        ObjRef<cml::CellMLComponent> newc1 = QueryInterface(mAnnoSet->getObjectAnnotation(c1, L"copy"));
-        if (newc1 == NULL)
+        // copies.  Connections to import components refer to the copy
+        // made under their name.
+        std::vector<cml::CellMLComponent*> copies1, copies2;
+        FindCopies(c1, copies1);
+        FindCopies(c2, copies2);
+        if (copies1.empty() || copies2.empty())
             return;
-        ObjRef<cml::CellMLComponent> newc2 = QueryInterface(mAnnoSet->getObjectAnnotation(c2, L"copy"));
-        if (newc2 == NULL)
+        if (copies1.size() > 1 || copies2.size() > 1)
+        {
+            // A connection made within the model of a component
+            // imported under several names would have to be copied
+            // for each of its copies, giving the variables of the
+            // other component several sources.
+            RETURN_INTO_WSTRING(cname1, mc->firstComponentName());
+            RETURN_INTO_WSTRING(cname2, mc->secondComponentName());
+            RETURN_INTO_OBJREF(model, cml::Model, conn->modelElement());
+            RETURN_INTO_WSTRING(mname, model->name());
+            std::wcerr << "The connection between " << cname1 << " and " << cname2
+                       << " in model " << mname << " involves a component imported"
+                       << " under several names, which is not supported." << std::endl;
+            mSharedInstanceUsed = true;
             return;
+        }
+        CopyConnection(conn, copies1.front(), copies2.front());
+    }
 
+    /**
+     * Copy a connection into our new model, between the given copies
+     * of its components.
+     */
+    void CopyConnection(cml::Connection* conn,
+                        cml::CellMLComponent* newc1,
+                        cml::CellMLComponent* newc2)
+    {
         // Create a new connection
         RETURN_INTO_OBJREF(newconn, cml::Connection,
                            mModelOut->createConnection());
@@ -368,135 +531,253 @@ private:
     }
 
     /**
-     * Copy all the units in the given set into the provided model/component.
+     * Find the units definition a units name refers to.
      *
-     * The target is in a different model to the units, so we can't use clone.
+     * The name is looked up in the given component, if it is one, and
+     * then in its model, following imported units back to their real
+     * definition.  Returns NULL for built-in (or undefined) units.
      */
-    void CopyUnits(cml::UnitsSet* unitset,
-                   cml::CellMLElement* target)
+    ObjRef<cml::Units> FindUnits(cml::CellMLElement* scope,
+                                 const std::wstring& name)
     {
-        RETURN_INTO_OBJREF(model, cml::Model, target->modelElement());
-        // Iterate over the set
-        ITERATE_S(units, Units, Units, cml::Units, unitset)
+        ObjRef<cml::Units> units;
+        DECLARE_QUERY_INTERFACE_OBJREF(comp, scope, cellml_api::CellMLComponent);
+        if (comp != NULL)
         {
-            RETURN_INTO_OBJREF(units_model, cml::Model, units->modelElement());
-            // Don't copy units defined in this model already
-            if (units_model == model)
-                continue;
-            // Don't copy units we've already copied.
-            // This is rather hackish, and probably not spec-compliant.
-            RETURN_INTO_WSTRING(uname, units->name());
-            RETURN_INTO_WSTRING(mname, units_model->name());
-            std::pair<std::wstring, std::wstring> p(uname, mname);
-            if (set_contains(mCopiedUnits, p))
-            {
-                std::wcout << "Skipped duplicate units " << uname << std::endl;
-                continue;
-            }
-            mCopiedUnits.insert(p);
-            RETURN_INTO_WSTRING(our_mname, model->name());
-            std::wcout << "Copying units " << uname << "(" << units << ")"
-                       << " from " << mname << "(" << units_model << ")"
-                       << " to " << our_mname << "(" << model << ")"
-                       << std::endl;
-            RETURN_INTO_OBJREF(new_units, cml::Units, model->createUnits());
-            new_units->name(uname.c_str());
-            new_units->isBaseUnits(units->isBaseUnits());
+            RETURN_INTO_OBJREF(comp_units, cml::UnitsSet, comp->units());
+            units = already_AddRefd<cml::Units>(comp_units->getUnits(name.c_str()));
+        }
+        if (units == NULL)
+        {
+            RETURN_INTO_OBJREF(model, cml::Model, scope->modelElement());
+            RETURN_INTO_OBJREF(model_units, cml::UnitsSet, model->modelUnits());
+            units = already_AddRefd<cml::Units>(model_units->getUnits(name.c_str()));
+        }
+        while (units != NULL)
+        {
+            DECLARE_QUERY_INTERFACE_OBJREF(impu, units, cellml_api::ImportUnits);
+            if (impu == NULL)
+                break; // Found the real definition
+            RETURN_INTO_OBJREF(imp_elt, cml::CellMLElement, impu->parentElement());
+            DECLARE_QUERY_INTERFACE_OBJREF(imp, imp_elt, cellml_api::CellMLImport);
+            RETURN_INTO_OBJREF(model, cml::Model, imp->importedModel());
+            assert(model != NULL);
+            RETURN_INTO_OBJREF(model_units, cml::UnitsSet, model->modelUnits());
+            RETURN_INTO_WSTRING(ref, impu->unitsRef());
+            units = already_AddRefd<cml::Units>(model_units->getUnits(ref.c_str()));
+        }
+        return units;
+    }
 
-            // Copy each unit reference
-            ITERATE2(unit, Unit, cml::Unit, units->unitCollection())
-            {
-                RETURN_INTO_OBJREF(new_unit, cml::Unit, model->createUnit());
-                new_unit->prefix(unit->prefix());
-                new_unit->multiplier(unit->multiplier());
-                new_unit->offset(unit->offset());
-                new_unit->exponent(unit->exponent());
-                COPY_ATTR(new_unit->units, unit->units);
-                // Add
-                new_units->addElement(new_unit);
-            }
+    /**
+     * Build a key identifying the definition of the given units, so
+     * that units defined the same way in different models (or under
+     * different names) are only copied once.
+     *
+     * Base units are identified by their name.  Other units are
+     * identified by their canonical form, or by the definition itself
+     * if that can't be worked out.
+     */
+    std::wstring UnitsDefinitionKey(cml::Units* units)
+    {
+        RETURN_INTO_WSTRING(uname, units->name());
+        if (units->isBaseUnits())
+            return L"base:" + uname;
+        ObjRef<cmlsvs::CanonicalUnitRepresentation> canonical;
+        if (mCuses != NULL)
+        {
+            RETURN_INTO_OBJREF(parent, cml::CellMLElement, units->parentElement());
+            canonical = already_AddRefd<cmlsvs::CanonicalUnitRepresentation>(
+                mCuses->getUnitsByName(parent, uname.c_str()));
+        }
+        std::wostringstream key;
+        key.precision(15);
+        if (canonical == NULL)
+        {
+            key << L"source:" << units;
+            return key.str();
+        }
+        key << L"canonical:" << canonical->siConversionFactor() << L"+"
+            << canonical->offset();
+        for (unsigned long i=0; i<canonical->length(); ++i)
+        {
+            RETURN_INTO_OBJREF(bu, cmlsvs::BaseUnitInstance,
+                               canonical->fetchBaseUnit(i));
+            RETURN_INTO_OBJREF(base, cmlsvs::BaseUnit, bu->unit());
+            RETURN_INTO_WSTRING(bname, base->name());
+            key << L" " << bname << L"*" << bu->prefix() << L"^"
+                << bu->exponent() << L"+" << bu->offset();
+        }
+        return key.str();
+    }
+
+    /**
+     * Get the name in the new model of the units a component refers
+     * to by the given name, copying the units definition (and those
+     * it is built from) into the new model if it hasn't been already.
+     *
+     * All units are defined at the model level of the new model.
+     * Units with the same definition are only copied once, and units
+     * whose name is already taken by a different definition are
+     * renamed.  Only units actually referred to are copied.
+     */
+    std::wstring CopyUnitsFor(cml::CellMLElement* scope,
+                              const std::wstring& name)
+    {
+        if (name.empty())
+            return name;
+        ObjRef<cml::Units> units = FindUnits(scope, name);
+        if (units == NULL)
+        {
+            // Built-in units: make sure no copied units take the name
+            mUnitsNames.reserve(name);
+            return name;
+        }
+        std::unordered_map<cml::Units*, std::wstring>::const_iterator copied =
+            mUnitsCopies.find(units);
+        if (copied != mUnitsCopies.end())
+            return copied->second;
+
+        RETURN_INTO_WSTRING(uname, units->name());
+        RETURN_INTO_OBJREF(units_model, cml::Model, units->modelElement());
+        RETURN_INTO_WSTRING(mname, units_model->name());
+        std::wstring key = UnitsDefinitionKey(units);
+        std::map<std::wstring, std::wstring>::const_iterator same =
+            mUnitsByDefinition.find(key);
+        if (same != mUnitsByDefinition.end())
+        {
+            std::wcout << "Units " << uname << " from " << mname
+                       << " already copied as " << same->second << std::endl;
+            mUnitsCopies[units] = same->second;
+            return same->second;
+        }
+
+        std::wstring new_name = mUnitsNames.allocate(uname);
+        mUnitsCopies[units] = new_name;
+        mUnitsByDefinition[key] = new_name;
+        std::wcout << "Copying units " << uname << "(" << units << ")"
+                   << " from " << mname << "(" << units_model << ")"
+                   << " as " << new_name << std::endl;
+        RETURN_INTO_OBJREF(new_units, cml::Units, mModelOut->createUnits());
+        new_units->name(new_name.c_str());
+        new_units->isBaseUnits(units->isBaseUnits());
+
+        // Copy each unit reference, along with the units it refers to
+        RETURN_INTO_OBJREF(units_parent, cml::CellMLElement, units->parentElement());
+        ITERATE2(unit, Unit, cml::Unit, units->unitCollection())
+        {
+            RETURN_INTO_OBJREF(new_unit, cml::Unit, mModelOut->createUnit());
+            new_unit->prefix(unit->prefix());
+            new_unit->multiplier(unit->multiplier());
+            new_unit->offset(unit->offset());
+            new_unit->exponent(unit->exponent());
+            RETURN_INTO_WSTRING(unit_units, unit->units());
+            new_unit->units(CopyUnitsFor(units_parent, unit_units).c_str());
+            // Add
+            new_units->addElement(new_unit);
+        }
+
+        // And add to the new model
+        mModelOut->addElement(new_units);
+        return new_name;
+    }
 
-            // And add to target
-            target->addElement(new_units);
+    /**
+     * Rename the units of the constants in a copied math element to
+     * the names they were given in the new model.
+     */
+    void CopyMathUnits(cml::CellMLComponent* comp,
+                       iface::mathml_dom::MathMLElement* math)
+    {
+        RETURN_INTO_OBJREF(cns, dom::NodeList,
+                           math->getElementsByTagNameNS(MATHML_NS, L"cn"));
+        for (unsigned long i=0; i<cns->length(); ++i)
+        {
+            RETURN_INTO_OBJREF(node, dom::Node, cns->item(i));
+            DECLARE_QUERY_INTERFACE_OBJREF(cn, node, dom::Element);
+            RETURN_INTO_OBJREF(attr, dom::Attr,
+                               cn->getAttributeNodeNS(CELLML_1_0_NS, L"units"));
+            if (attr == NULL)
+                continue;
+            RETURN_INTO_WSTRING(uname, attr->value());
+            std::wstring new_name = CopyUnitsFor(comp, uname);
+            if (new_name != uname)
+                attr->value(new_name.c_str());
         }
     }
 
     /**
-     * Create and return a (manual) deep copy of the given DOM element.
+     * Create and return a deep copy of the given DOM element.
+     *
+     * The whole subtree, including comments and processing
+     * instructions, is imported into the new model's document in one
+     * operation.  Attributes in the CellML 1.1 namespace are then
+     * moved to the CellML 1.0 namespace.
      *
      * If the element is in the MathML namespace, it will be converted
      * to a cml::MathMLElement instance prior to being returned.
-     *
-     * Note: it appears that when adding a child element or text node,
-     * which we are subsequently going to release_ref ourselves, we
-     * must also release_ref the parent, or its refcount never reaches
-     * zero.
      */
     dom::Element* CopyDomElement(dom::Element* in)
     {
-        std::wstring nsURI = in->namespaceURI();
-        std::wstring qname = in->nodeName();
-        //std::wcout << "Copying DOM element " << qname;
-        // Create a blank copied element
-        dom::Element* out = mModelOut->createExtensionElement(nsURI.c_str(),
-                                                              qname.c_str());
-        ObjRef<dom::Document> doc = out->ownerDocument();
-
-        // Copy attributes
-        ObjRef<dom::NamedNodeMap> attrs = in->attributes();
-        //std::wcout << " (" << attrs->length() << " attrs" << std::endl;
-        for (unsigned long i=0; i<attrs->length(); ++i)
+        RETURN_INTO_OBJREF(copy_node, dom::Node, mDocOut->importNode(in, true));
+        DECLARE_QUERY_INTERFACE_OBJREF(copy, copy_node, dom::Element);
+
+        // Remap CellML attributes, on the copied element and all its
+        // descendant elements
+        RemapCellMLAttributes(copy);
+        RETURN_INTO_OBJREF(descendants, dom::NodeList,
+                           copy->getElementsByTagNameNS(L"*", L"*"));
+        for (unsigned long i=0; i<descendants->length(); ++i)
         {
-            ObjRef<dom::Attr> attr = QueryInterface(attrs->item(i));
-            std::wstring attr_ns = attr->namespaceURI();
-            if (attr_ns == CELLML_1_1_NS)
-                attr_ns = CELLML_1_0_NS;
-            std::wstring attr_name = attr->name();
-            //std::wcout << "qname = " << attr_name.c_str();
-            dom::Attr* copy = doc->createAttributeNS(attr_ns, attr_name);
-            copy->value(attr->value());
-            ObjRef<dom::Attr> tmp = out->setAttributeNodeNS(copy);
-            //std::wcout << " {" << copy->name() << "=" << copy->value() << "}" << std::endl;
-        }
-
-        // Copy child elements & text
-        ObjRef<dom::NodeList> children = in->childNodes();
-        //std::wcout << ", " << children->length() << " children)." << std::endl;
-        for (unsigned long i=0; i<children->length(); ++i)
-        {
-            ObjRef<dom::Node> child = children->item(i);
-            switch (child->nodeType())
-            {
-            case dom::Node::ELEMENT_NODE:
-            {
-                ObjRef<dom::Element> elt = QueryInterface(child);
-                ObjRef<dom::Element> copy = CopyDomElement(elt);
-                ObjRef<dom::Node> tmp = out->appendChild(copy);
-            }
-                break;
-            case dom::Node::TEXT_NODE:
-            {
-                std::wstring text = child->nodeValue();
-                // 		    size_t nonws = text.find_first_not_of(L" \t\n\r");
-                // 		    if (nonws != std::string::npos)
-                // 			std::wcout << "  Text: " << text << std::endl;
-                ObjRef<dom::Text> textNode = doc->createTextNode(text);
-                out->appendChild(textNode)->release_ref();
-            }
-                break;
-            }
+            RETURN_INTO_OBJREF(node, dom::Node, descendants->item(i));
+            DECLARE_QUERY_INTERFACE_OBJREF(elt, node, dom::Element);
+            RemapCellMLAttributes(elt);
         }
 
+        dom::Element* out;
+        RETURN_INTO_WSTRING(nsURI, copy->namespaceURI());
         if (nsURI == MATHML_NS)
         {
             // Cast to MathML
-            ObjRef<iface::mathml_dom::MathMLElement> math_out = QueryInterface(out);
+            ObjRef<iface::mathml_dom::MathMLElement> math_out = QueryInterface(copy);
             out = math_out;
         }
-        // out->release_ref(); // segfaults
+        else
+            out = copy;
+        out->add_ref(); // The caller owns the copy
         return out;
     }
-    
+
+    /**
+     * Move any attributes of the given element in the CellML 1.1
+     * namespace to the CellML 1.0 namespace.
+     */
+    void RemapCellMLAttributes(dom::Element* elt)
+    {
+        if (!elt->hasAttributes())
+            return;
+        RETURN_INTO_OBJREF(attrs, dom::NamedNodeMap, elt->attributes());
+        std::vector<ObjRef<dom::Attr> > cellml_attrs;
+        for (unsigned long i=0; i<attrs->length(); ++i)
+        {
+            RETURN_INTO_OBJREF(node, dom::Node, attrs->item(i));
+            DECLARE_QUERY_INTERFACE_OBJREF(attr, node, dom::Attr);
+            RETURN_INTO_WSTRING(attr_ns, attr->namespaceURI());
+            if (attr_ns == CELLML_1_1_NS)
+                cellml_attrs.push_back(attr);
+        }
+        // The attribute map is live, so change it once we've finished
+        // iterating over it
+        for (std::vector<ObjRef<dom::Attr> >::const_iterator attr = cellml_attrs.begin();
+             attr != cellml_attrs.end(); ++attr)
+        {
+            RETURN_INTO_WSTRING(attr_name, (*attr)->name());
+            RETURN_INTO_WSTRING(value, (*attr)->value());
+            RETURN_INTO_OBJREF(removed, dom::Attr, elt->removeAttributeNode(*attr));
+            elt->setAttributeNS(CELLML_1_0_NS, attr_name.c_str(), value.c_str());
+        }
+    }
+
     /**
      * Create and return a (manual) deep copy of the given MathML element.
      */
@@ -537,22 +818,31 @@ private:
     {
         ITERATE_S(comp, Component, RelevantComponents, cml::CellMLComponent, cevas)
         {
-            CopyComponent(comp, mModelOut);
+            // One copy is made for each name the component is
+            // imported under
+            std::vector<cml::CellMLComponent*> instances;
+            FindInstances(comp, instances);
+            for (std::vector<cml::CellMLComponent*>::const_iterator instance = instances.begin();
+                 instance != instances.end(); ++instance)
+            {
+                CopyComponent(comp, *instance, mModelOut);
+            }
         }
     }
 
     /**
-     * Copy the given component into the given model.
+     * Copy the given instance of a component into the given model.
      *
-     * We create a new component, and manually transfer the content.
+     * We create a new component, named after the instance, and
+     * manually transfer the content.
      */
     void CopyComponent(cml::CellMLComponent* comp,
+                       cml::CellMLComponent* instance,
                        cml::Model* model)
     {
-        RETURN_INTO_WSTRING(cname, comp->name());
+        RETURN_INTO_WSTRING(cname, instance->name());
         // Paranoia: check we haven't already copied it
-        ObjRef<cml::CellMLComponent> copy = QueryInterface(mAnnoSet->getObjectAnnotation(comp, L"copy"));
-        if (copy != NULL)
+        if (FindCopy(instance) != NULL)
         {
             std::wcout << "Duplicate component " << cname << std::endl;
             return;
@@ -564,16 +854,8 @@ private:
                    << std::endl;
 
         // Create the new component and set its name & id
-        copy = already_AddRefd<cml::CellMLComponent>(model->createComponent());
-        mAnnoSet->setObjectAnnotation(comp, L"copy", copy);
-        // Check for a renaming
-        RETURN_INTO_WSTRING(renamed,
-                            mAnnoSet->getStringAnnotation(comp, L"renamed"));
-        if (renamed.length() > 0)
-        {
-            // It was an imported component, and may have been renamed
-            cname = renamed;
-        }
+        RETURN_INTO_OBJREF(copy, cml::CellMLComponent, model->createComponent());
+        mComponentCopies[instance] = copy;
         // Ensure name is unique in the 1.0 model
         EnsureComponentNameUnique(cname);
         copy->name(cname.c_str());
@@ -581,10 +863,6 @@ private:
         if (id.length())
             copy->cmetaId(comp->cmetaId());
 
-        // Copy units
-        RETURN_INTO_OBJREF(units, cml::UnitsSet, comp->units());
-        CopyUnits(units, copy);
-
         // Copy variables
         ITERATE2(var, Variable, cml::CellMLVariable, comp->variables())
         {
@@ -595,10 +873,16 @@ private:
             RETURN_INTO_WSTRING(id, var->cmetaId());
             if (id.length())
                 var_copy->cmetaId(id.c_str());
-            COPY_ATTR(var_copy->initialValue, var->initialValue);
+            RETURN_INTO_WSTRING(init, var->initialValue());
+            var_copy->initialValue(init.c_str());
+            RETURN_INTO_WSTRING(vname, var->name());
+            mSourceVariables[std::make_pair(comp, vname)] = var;
+            if (init.length() > 0 && !isNumber(init))
+                mInitialValueVariables.push_back(std::make_pair(var_copy, var));
             var_copy->privateInterface(var->privateInterface());
             var_copy->publicInterface(var->publicInterface());
-            COPY_ATTR(var_copy->unitsName, var->unitsName);
+            RETURN_INTO_WSTRING(uname, var->unitsName());
+            var_copy->unitsName(CopyUnitsFor(comp, uname).c_str());
             copy->addElement(var_copy);
         }
 
@@ -606,6 +890,7 @@ private:
         ITERATE_MATH(mathnode, comp->math())
         {
             cml::MathMLElement clone = CopyMathElement(mathnode);
+            CopyMathUnits(comp, clone);
             copy->addMath(clone);
             clone->release_ref(); // Relinquish ownership
         }
@@ -619,36 +904,63 @@ private:
 
     /**
      * This method is used to reconstruct the encapsulation hierarchy
-     * in the new model, recursively processing imported models.
+     * in the new model from the source model and the models it
+     * imports.
      *
      * It uses the CopyGroup method to read the encapsulation
      * hierarchy, and if it finds a reference to a component that has
      * been copied over, it creates a new group containing the
      * hierarchy rooted at that point.
      */
-    void CopyGroups(cml::Model* model)
+    void CopyGroups()
     {
-        // Iterate only groups defining the encapsulation hierarchy.
-        RETURN_INTO_OBJREF(groups, cml::GroupSet, model->groups());
-        ITERATE2(group, Group, cml::Group, groups->subsetInvolvingEncapsulation())
+        for (std::vector<ObjRef<cml::Model> >::const_iterator model = mModelsPreOrder.begin();
+             model != mModelsPreOrder.end(); ++model)
         {
-            // Now recurse down this subtree
-            RETURN_INTO_OBJREF(crefs, cml::ComponentRefSet,
-                               group->componentRefs());
-            CopyGroup(model, crefs, NULL);
+            // Iterate only groups defining the encapsulation hierarchy.
+            RETURN_INTO_OBJREF(groups, cml::GroupSet, (*model)->groups());
+            ITERATE2(group, Group, cml::Group, groups->subsetInvolvingEncapsulation())
+            {
+                // Now recurse down this subtree
+                RETURN_INTO_OBJREF(crefs, cml::ComponentRefSet,
+                                   group->componentRefs());
+                CopyGroup(*model, crefs, NULL);
+            }
         }
+    }
 
-        // Now check imported models
-        ITERATE2(import, Import, cml::CellMLImport, model->imports())
+    /**
+     * Check whether any of the given component refs, or the refs
+     * below them, is to a component which has been copied.
+     */
+    bool HasCopiedComponent(cml::Model* model,
+                            cml::ComponentRefSet* crefs)
+    {
+        RETURN_INTO_OBJREF(comps, cml::CellMLComponentSet,
+                           model->modelComponents());
+        ITERATE(cref, ComponentRef, cml::ComponentRef, crefs)
         {
-            RETURN_INTO_OBJREF(imp_model, cml::Model, import->importedModel());
-            assert(imp_model != NULL);
-            CopyGroups(imp_model);
+            RETURN_INTO_WSTRING(cname, cref->componentName());
+            RETURN_INTO_OBJREF(comp, cml::CellMLComponent,
+                               comps->getComponent(cname.c_str()));
+            std::vector<cml::CellMLComponent*> copies;
+            if (comp != NULL)
+                FindCopies(comp, copies);
+            RETURN_INTO_OBJREF(childrefs, cml::ComponentRefSet,
+                               cref->componentRefs());
+            if (!copies.empty() || HasCopiedComponent(model, childrefs))
+                return true;
         }
+        return false;
     }
 
     /**
      * This method does the actual copying of groups.
+     *
+     * A component imported under several names can't be placed in
+     * the hierarchy of its own model if it has a parent or copied
+     * children there, as they only have one copy; this sets
+     * mSharedInstanceUsed.
      */
     void CopyGroup(cml::Model* model,
                    cml::ComponentRefSet* crefs,
@@ -672,12 +984,10 @@ private:
                            << " does not exist." << std::endl;
                 continue;
             }
-            // Find the real component object
-            RETURN_INTO_OBJREF(real_comp, cml::CellMLComponent,
-                               FindRealComponent(comp));
             // Has it been copied?
-            ObjRef<cml::CellMLComponent> copy = QueryInterface(mAnnoSet->getObjectAnnotation(real_comp, L"copy"));
-            if (copy == NULL)
+            std::vector<cml::CellMLComponent*> copies;
+            FindCopies(comp, copies);
+            if (copies.empty())
             {
                 if (copyInto != NULL)
                 {
@@ -688,6 +998,25 @@ private:
                 }
                 continue;
             }
+            RETURN_INTO_OBJREF(childrefs, cml::ComponentRefSet,
+                               cref->componentRefs());
+            if (copies.size() > 1)
+            {
+                // The component is imported under several names, but
+                // its encapsulated components only have one copy, so
+                // the hierarchy can't be rebuilt for each of its
+                // copies.  Without a parent or children it plays no
+                // part in the hierarchy, so can be left out.
+                if (copyInto == NULL && !HasCopiedComponent(model, childrefs))
+                    continue;
+                RETURN_INTO_WSTRING(mname, model->name());
+                std::wcerr << "Component " << cname << " in the encapsulation hierarchy"
+                           << " of model " << mname << " is imported under several"
+                           << " names, which is not supported." << std::endl;
+                mSharedInstanceUsed = true;
+                continue;
+            }
+            cml::CellMLComponent* copy = copies.front();
 
             // Create a component ref for the copy
             RETURN_INTO_OBJREF(newref, cml::ComponentRef,
@@ -719,52 +1048,91 @@ private:
             }
 
             // Copy any children of this component
-            RETURN_INTO_OBJREF(childrefs, cml::ComponentRefSet,
-                               cref->componentRefs());
             CopyGroup(model, childrefs, newref);
         }
     }
 
+    /**
+     * Find the numeric initial value of the given source variable.
+     *
+     * Where the initial value names a variable, the initial value of
+     * that variable's source variable is used, following chains of
+     * such variables.  Returns an empty string if there is no numeric
+     * initial value at the end of the chain, or the chain loops.
+     */
+    std::wstring ResolveInitialValue(cml::CellMLVariable* var)
+    {
+        std::unordered_map<cml::CellMLVariable*, std::wstring>::const_iterator resolved =
+            mResolvedInitialValues.find(var);
+        if (resolved != mResolvedInitialValues.end())
+            return resolved->second;
+        // Mark the variable as in progress, so a loop resolves to
+        // nothing rather than recursing forever
+        mResolvedInitialValues[var] = L"";
+
+        RETURN_INTO_WSTRING(init, var->initialValue());
+        std::wstring value;
+        if (isNumber(init))
+            value = init;
+        else if (init.length() > 0)
+        {
+            // Find the initial variable, in the same component
+            RETURN_INTO_OBJREF(parent, cml::CellMLElement, var->parentElement());
+            DECLARE_QUERY_INTERFACE_OBJREF(comp, parent, cellml_api::CellMLComponent);
+            ObjRef<cml::CellMLVariable> initvar;
+            std::map<std::pair<cml::CellMLComponent*, std::wstring>, ObjRef<cml::CellMLVariable> >::const_iterator
+                indexed = mSourceVariables.find(std::make_pair(comp.getPointer(), init));
+            if (indexed != mSourceVariables.end())
+                initvar = indexed->second;
+            else
+            {
+                // Not a copied component, so not indexed
+                RETURN_INTO_OBJREF(vars, cml::CellMLVariableSet, comp->variables());
+                initvar = already_AddRefd<cml::CellMLVariable>(vars->getVariable(init.c_str()));
+            }
+            if (initvar != NULL)
+            {
+                // Find its source, and its initial value
+                RETURN_INTO_OBJREF(src, cml::CellMLVariable,
+                                   initvar->sourceVariable());
+                if (src != NULL)
+                    value = ResolveInitialValue(src);
+            }
+        }
+        mResolvedInitialValues[var] = value;
+        return value;
+    }
+
     /**
      * Try to make all initial_value attributes valid CellML 1.0.
      *
      * Where a variable is specified, look at its source variable.  If
      * it has a numeric initial value, use that.  If not, it's an
      * unavoidable error condition.
+     *
+     * Only the variables noted by CopyComponent as having a
+     * non-numeric initial value are looked at, and chains of initial
+     * value variables are followed through the source model.
      */
     void PropagateInitialValues()
     {
-        ITERATE2(comp, Component, cml::CellMLComponent,
-                 mModelOut->localComponents())
+        for (std::vector<std::pair<ObjRef<cml::CellMLVariable>, ObjRef<cml::CellMLVariable> > >::const_iterator
+                 it = mInitialValueVariables.begin(); it != mInitialValueVariables.end(); ++it)
         {
-            RETURN_INTO_WSTRING(cname, comp->name());
-            ITERATE2(var, Variable, cml::CellMLVariable, comp->variables())
+            cml::CellMLVariable* var = it->first;
+            RETURN_INTO_WSTRING(cname, var->componentName());
+            RETURN_INTO_WSTRING(vname, var->name());
+            RETURN_INTO_WSTRING(init, var->initialValue());
+            std::wcout << "Var " << cname << ":" << vname
+                       << " has initvar " << init;
+            std::wstring value = ResolveInitialValue(it->second);
+            if (value.empty())
             {
-                RETURN_INTO_WSTRING(init, var->initialValue());
-                if (init.length() == 0)
-                    continue;
-                // Is the initial value a double?
-                std::wstringstream init_(init);
-                double value;
-                init_ >> value;
-                if (init_.fail()) {
-                    RETURN_INTO_WSTRING(vname, var->name());
-                    std::wcout << "Var " << cname << ":" << vname
-                               << " has initvar " << init;
-                    // Find the initial variable
-                    RETURN_INTO_OBJREF(vars, cml::CellMLVariableSet,
-                                       comp->variables());
-                    RETURN_INTO_OBJREF(initvar, cml::CellMLVariable,
-                                       vars->getVariable(init.c_str()));
-                    // Find its source
-                    RETURN_INTO_OBJREF(src, cml::CellMLVariable,
-                                       initvar->sourceVariable());
-                    // And copy the initial value
-                    RETURN_INTO_WSTRING(srcinit, src->initialValue());
-                    var->initialValue(srcinit.c_str());
-                    std::wcout << " value " << srcinit << std::endl;
-                }
+                std::wcout << " with no numeric initial value." << std::endl;
+                continue;
             }
+            var->initialValue(value.c_str());
+            std::wcout << " value " << value << std::endl;
         }
     }
 
@@ -786,9 +1154,13 @@ public:
         mModelIn = modelIn;
 
         // Create the output model
-        RETURN_INTO_OBJREF(cbs, cml::CellMLBootstrap,
-                           CreateCellMLBootstrap());
+        ObjRef<cml::CellMLBootstrap> cbs;
+        if (mContext) cbs = mContext->cellmlBootstrap();
+        else cbs = already_AddRefd<cml::CellMLBootstrap>(CreateCellMLBootstrap());
         mModelOut = cbs->createModel(L"1.0");
+        DECLARE_QUERY_INTERFACE_OBJREF(model_out_elt, mModelOut, cellml_api::CellMLDOMElement);
+        RETURN_INTO_OBJREF(model_out_dom, dom::Element, model_out_elt->domElement());
+        mDocOut = model_out_dom->ownerDocument();
 
         // Set name & id
         mModelOut->name(model_name.c_str());
@@ -796,16 +1168,10 @@ public:
         if (model_id.length() > 0)
             mModelOut->cmetaId(model_id.c_str());
 
-        // Create an annotation set to manage annotations
-        RETURN_INTO_OBJREF(ats, cmlsvs::AnnotationToolService,
-                           CreateAnnotationToolService());
-        RETURN_INTO_OBJREF(annoset, cmlsvs::AnnotationSet,
-                           ats->createAnnotationSet());
-        mAnnoSet = annoset;
-
         // Create a CeVAS to find relevant components
-        RETURN_INTO_OBJREF(cevas_bs, cmlsvs::CeVASBootstrap,
-                           CreateCeVASBootstrap());
+        ObjRef<cmlsvs::CeVASBootstrap> cevas_bs;
+        if (mContext) cevas_bs = mContext->cevasBootstrap();
+        else cevas_bs = already_AddRefd<cmlsvs::CeVASBootstrap>(CreateCeVASBootstrap());
         RETURN_INTO_OBJREF(cevas, cmlsvs::CeVAS,
                            cevas_bs->createCeVASForModel(modelIn));
         RETURN_INTO_WSTRING(err, cevas->modelError());
@@ -815,22 +1181,44 @@ public:
             return NULL;
         }
 
-        // Copy model-level units to the new model, both local and
-        // imported definitions.
-        RETURN_INTO_OBJREF(units, cml::UnitsSet, modelIn->allUnits());
-        CopyUnits(units, mModelOut);
+        // Units are copied as the components using them are copied,
+        // comparing their canonical definitions
+        ObjRef<cmlsvs::CUSESBootstrap> cuses_bs;
+        if (mContext) cuses_bs = mContext->cusesBootstrap();
+        else cuses_bs = already_AddRefd<cmlsvs::CUSESBootstrap>(CreateCUSESBootstrap());
+        mCuses = already_AddRefd<cmlsvs::CUSES>(cuses_bs->createCUSESForModel(modelIn, false));
+        RETURN_INTO_WSTRING(cuses_err, mCuses->modelError());
+        if (cuses_err.length() > 0)
+        {
+            std::wcout << "Only units from the same definition will be merged: " << cuses_err
+                       << std::endl;
+            mCuses = NULL;
+        }
 
-        // Annotate potentially renamed components
-        StoreImportRenamings(modelIn);
+        // Find the imported models, then the real component of each
+        // import component and the import components referring to
+        // each component
+        std::unordered_set<cml::Model*> visited;
+        CollectModels(modelIn, visited);
+        ResolveImportComponents();
 
         // Copy all needed components to the new model
         CopyComponents(cevas);
 
         // Copy connections
-        CopyConnections(modelIn);
+        CopyConnections();
 
         // Copy groups
-        CopyGroups(modelIn);
+        CopyGroups();
+
+        if (mSharedInstanceUsed)
+        {
+            std::wcerr << "Unable to convert a model importing a component "
+                       << "under several names, where that component is "
+                       << "connected or encapsulated within its own model."
+                       << std::endl;
+            return NULL;
+        }
 
         // Deal with 'initial_value="var_name"' occurrences
         PropagateInitialValues();
@@ -840,11 +1228,11 @@ public:
     }
 };
 
-ObjRef<cml::Model> flattenModel(cml::Model* model)
+ObjRef<cml::Model> flattenModel(cml::Model* model, FlatteningContext* context)
 {
     ObjRef<cml::Model> new_model;
     {
-        VersionConverter converter;
+        VersionConverter converter(context);
         new_model = converter.ConvertModel(model);
     }
     return new_model;
@@ -1,6 +1,14 @@
 #ifndef VERSIONCONVERTER_HPP
 #define VERSIONCONVERTER_HPP
 
-ObjRef<iface::cellml_api::Model> flattenModel(iface::cellml_api::Model* model);
+class FlatteningContext;
+
+/**
+ * Flatten the given model into a CellML 1.0 model, keeping its modular structure.
+ * @param model The model to flatten, which must have had all its imports instantiated.
+ * @param context If given, the shared bootstraps to use.
+ * @return The flattened model, or NULL on failure.
+ */
+ObjRef<iface::cellml_api::Model> flattenModel(iface::cellml_api::Model* model, FlatteningContext* context = NULL);
 
 #endif // VERSIONCONVERTER_HPP
@@ -1,33 +1,15 @@
 #include <string>
 #include <iostream>
 #include <sstream>
-#include <iomanip>
+#include <unordered_map>
 
 #include "cellmlutils.hpp"
+#include "cellmlwriter.hpp"
 #include "xmlutils.hpp"
 #include "utils.hpp"
 
 #include <CellMLBootstrap.hpp>
 #include <CUSESBootstrap.hpp>
-#include <AnnoToolsBootstrap.hpp>
-
-#define MATH_ANNOTATION_KEY L"mathml::math"
-
-/**
- * Return a modified version of the base name which should be unique.
- * @param base The base name to use in creating a unique name.
- * @return The unique name.
- */
-static std::wstring uniqueName(const std::wstring& base)
-{
-    static int counter = 0x0;
-    std::wostringstream oss;
-    oss << std::setw(5) << std::setfill(L'0') << std::hex << ++counter;
-    std::wstring un = base;
-    un += L"_";
-    un += oss.str();
-    return un;
-}
 
 /**
  * Compare two canonical CellML units definitions from different models and return true if they match.
@@ -147,24 +129,50 @@ defineMapVariables(iface::cellml_api::Model* model, iface::cellml_api::Connectio
     }
 }
 
-int CellmlUtils::getInitialValue(iface::cellml_api::CellMLVariable* variable, double* value, int level)
+int CellmlUtils::cacheInitialValue(iface::cellml_api::CellMLVariable* variable, int returnCode, double value,
+                                   const std::wstring& unitsName)
+{
+    ResolvedInitialValue& iv = mInitialValues[variable];
+    iv.returnCode = returnCode;
+    iv.value = value;
+    iv.unitsName = unitsName;
+    return returnCode;
+}
+
+int CellmlUtils::getInitialValue(iface::cellml_api::CellMLVariable* variable, double* value, std::wstring& unitsName,
+                                 int level)
 {
     int returnCode = 0;
+    if (level > 0)
+    {
+        // variables used as initial values are often shared, so check if we have already been here.
+        auto cached = mInitialValues.find(variable);
+        if (cached != mInitialValues.end())
+        {
+            *value = cached->second.value;
+            unitsName = cached->second.unitsName;
+            return cached->second.returnCode;
+        }
+        // and guard against circular initial_value definitions while resolving this one.
+        cacheInitialValue(variable, -1, 0.0, L"");
+    }
     if (variable->initialValue() != L"")
     {
         // an initial value is present
         if (variable->initialValueFromVariable())
         {
-            ObjRef<iface::cellml_api::CellMLVariable> ivSource =
-                    variable->initialValueVariable()->sourceVariable();
-            return getInitialValue(ivSource, value, ++level);
+            ObjRef<iface::cellml_api::CellMLVariable> ivVariable = variable->initialValueVariable();
+            instantiateImportsFor(ivVariable);
+            ObjRef<iface::cellml_api::CellMLVariable> ivSource = ivVariable->sourceVariable();
+            returnCode = getInitialValue(ivSource, value, unitsName, level + 1);
         }
         else
         {
             /// @todo Need to ensure unit conversion happens.
             // numerical initial_value
             *value = variable->initialValueValue();
-            return 1;
+            unitsName = variable->unitsName();
+            returnCode = 1;
         }
     }
     else if (level > 0)
@@ -173,45 +181,55 @@ int CellmlUtils::getInitialValue(iface::cellml_api::CellMLVariable* variable, do
         // initial_value attribute - so it is probably defined in an equation. Check for the easy case
         // we can handle
         SourceVariableType vt;
-        std::wstring mathml = determineSourceVariableType(variable, vt);
+        const EquationDefinition* equation = determineSourceVariableType(variable, vt);
         if (vt == CONSTANT_PARAMETER_EQUATION)
         {
             std::wcout << L"getInitialValue: Found a constant parameter equation for "
                        << variable->componentName() << L"/" << variable->name() << std::endl;
-            XmlUtils xutils;
-            xutils.parseString(mathml);
-            std::wstring unitsName;
-            returnCode = xutils.numericalAssignmentGetValue(value, unitsName);
+            *value = equation->value;
+            unitsName = equation->unitsName;
             /// @todo Need to match units.
             std::wcout << L"Getting value for: " << variable->componentName() << L"/"
                        << variable->name() << std::endl;
             std::wcout << L"units = \"" << unitsName << L"\"" << std::endl;
-            return 1;
+            returnCode = 1;
         }
         else
         {
             std::wcerr << L"ERROR: initial value set by variable (" << variable->componentName() << L"/"
                        << variable->name() << L"which isn't defined in a way we can use for a initial_value."
                        << std::endl;
-            return -1;
+            returnCode = -1;
         }
     }
+    if (level > 0) cacheInitialValue(variable, returnCode, (returnCode == 1) ? *value : 0.0, unitsName);
     return returnCode;
 }
 
-CellmlUtils::CellmlUtils()
+CellmlUtils::CellmlUtils(FlatteningContext* context)
 {
-    mBootstrap = CreateCellMLBootstrap();
-    mCusesBootstrap = CreateCUSESBootstrap();
-    ObjRef<iface::cellml_services::AnnotationToolService> ats =  CreateAnnotationToolService();
-    // create one annotation set to use for our annotations.
-    mAnnotations = ats->createAnnotationSet();
+    if (context)
+    {
+        mBootstrap = context->cellmlBootstrap();
+        mCusesBootstrap = context->cusesBootstrap();
+        mImportCache = &(context->importCache());
+        mThreadPool = &(context->threadPool());
+    }
+    else
+    {
+        mBootstrap = CreateCellMLBootstrap();
+        mCusesBootstrap = CreateCUSESBootstrap();
+        mImportCache = NULL;
+        mOwnThreadPool.reset(new ThreadPool(ThreadPool::defaultThreads()));
+        mThreadPool = mOwnThreadPool.get();
+    }
+    mSourceCusesOutdated = false;
     mVariableOfIntegration = NULL;
 }
 
 CellmlUtils::~CellmlUtils()
 {
-    // nothing to do
+    releaseSourceModel();
 }
 
 ObjRef<iface::cellml_api::Model> CellmlUtils::createModel()
@@ -239,9 +257,10 @@ CellmlUtils::createVariable(iface::cellml_api::CellMLComponent *component, const
     return variable;
 }
 
-std::wstring CellmlUtils::defineUnits(iface::cellml_api::Model *model, iface::cellml_api::Units *sourceUnits) const
+std::wstring CellmlUtils::defineUnits(iface::cellml_api::Model *model, iface::cellml_api::Units *sourceUnits)
 {
     std::wstring unitsName;
+    refreshSourceCuses();
     // generate the canonical units representation for the source units
     ObjRef<iface::cellml_services::CanonicalUnitRepresentation>
             cur = mSourceCuses->getUnitsByName(sourceUnits->parentElement(), sourceUnits->name());
@@ -252,7 +271,7 @@ std::wstring CellmlUtils::defineUnits(iface::cellml_api::Model *model, iface::ce
     if (unitsName.empty())
     {
         // need to create the units definition
-        std::wstring newUnitsName = uniqueSetName(model->localUnits(), sourceUnits->name());
+        std::wstring newUnitsName = uniqueSetName(model, model->localUnits(), sourceUnits->name());
         std::wcout << L"\t\tCreating new units for: " << sourceUnits->name() << L"; as "
                    << newUnitsName << std::endl;
         unitsName = createUnitsFromCanonical(model, cur, newUnitsName);
@@ -264,8 +283,19 @@ std::wstring CellmlUtils::defineUnits(iface::cellml_api::Model *model, iface::ce
 int CellmlUtils::setSourceModel(iface::cellml_api::Model *model)
 {
     mSourceModel = model;
+    instantiateUnitsImports(mSourceModel);
+    // all the variables in the source model will be compacted, so get the thread pool started on their math.
+    ObjRef<iface::cellml_api::CellMLComponentSet> localComponents = mSourceModel->localComponents();
+    ObjRef<iface::cellml_api::CellMLComponentIterator> lci = localComponents->iterateComponents();
+    while (true)
+    {
+        ObjRef<iface::cellml_api::CellMLComponent> component = lci->nextComponent();
+        if (component == NULL) break;
+        classifyComponentMath(mSourceModel, component->name());
+    }
     // since we compare units across models, we don't care about the strictness of comparisons...
     mSourceCuses = mCusesBootstrap->createCUSESForModel(mSourceModel, true);
+    mSourceCusesOutdated = false;
     if (mSourceCuses->modelError() != L"")
     {
         std::wcerr << L"Error creating the CUSES for the source model: " << std::endl;
@@ -275,17 +305,207 @@ int CellmlUtils::setSourceModel(iface::cellml_api::Model *model)
     return 0;
 }
 
-std::wstring CellmlUtils::uniqueSetName(iface::cellml_api::NamedCellMLElementSet *namedSet, const std::wstring &name) const
+void CellmlUtils::releaseSourceModel()
+{
+    // drop everything referring into the imported models before handing them back.
+    mSourceCuses = NULL;
+    mConnectionIndex.clear();
+    mImportedAs.clear();
+    mImportSearchedVariables.clear();
+    mComponentEquations.clear();
+    // nested imports were instantiated after the import containing them, so undo in reverse order.
+    for (auto i = mInstantiatedImports.rbegin(); i != mInstantiatedImports.rend(); ++i) (*i)->uninstantiate();
+    mInstantiatedImports.clear();
+    mSourceModel = NULL;
+}
+
+void CellmlUtils::refreshSourceCuses()
+{
+    if (! mSourceCusesOutdated) return;
+    mSourceCuses = mCusesBootstrap->createCUSESForModel(mSourceModel, true);
+    mSourceCusesOutdated = false;
+    if (mSourceCuses->modelError() != L"")
+    {
+        std::wcerr << L"Error updating the CUSES for the source model: " << std::endl;
+        std::wcerr << mSourceCuses->modelError() << std::endl;
+    }
+}
+
+int CellmlUtils::instantiateImport(iface::cellml_api::CellMLImport* import)
+{
+    if (import->wasInstantiated()) return 0;
+    std::wstring href = import->xlinkHref()->asText();
+    if (mImportCache)
+    {
+        if (mImportCache->instantiate(import) != 0) return -1;
+    }
+    else
+    {
+        try
+        {
+            import->instantiate();
+        }
+        catch (...)
+        {
+            std::wcerr << L"ERROR: unable to instantiate the import: " << href << std::endl;
+            return -1;
+        }
+    }
+    std::wcout << L"Instantiated import: " << href << std::endl;
+    mInstantiatedImports.push_back(import);
+    mSourceCusesOutdated = true;
+    ObjRef<iface::cellml_api::Model> importedModel = import->importedModel();
+    return instantiateUnitsImports(importedModel);
+}
+
+int CellmlUtils::instantiateUnitsImports(iface::cellml_api::Model* model)
 {
-    std::wstring uname = name;
-    ObjRef<iface::cellml_api::NamedCellMLElement> el = namedSet->get(uname);
-    if (el) uname = uniqueName(uname);
-    return uname;
+    int returnCode = 0;
+    ObjRef<iface::cellml_api::CellMLImportSet> imports = model->imports();
+    ObjRef<iface::cellml_api::CellMLImportIterator> ii = imports->iterateImports();
+    while (true)
+    {
+        ObjRef<iface::cellml_api::CellMLImport> import = ii->nextImport();
+        if (import == NULL) break;
+        ObjRef<iface::cellml_api::ImportUnitsSet> units = import->units();
+        if ((units->length() > 0) && (instantiateImport(import) != 0)) returnCode = -1;
+    }
+    return returnCode;
+}
+
+const CellmlUtils::ConnectionIndex& CellmlUtils::connectionIndex(iface::cellml_api::Model* model)
+{
+    auto existing = mConnectionIndex.find(model);
+    if (existing != mConnectionIndex.end()) return existing->second;
+    ConnectionIndex& index = mConnectionIndex[model];
+    ObjRef<iface::cellml_api::ConnectionSet> connections = model->connections();
+    ObjRef<iface::cellml_api::ConnectionIterator> ci = connections->iterateConnections();
+    while (true)
+    {
+        ObjRef<iface::cellml_api::Connection> connection = ci->nextConnection();
+        if (connection == NULL) break;
+        ObjRef<iface::cellml_api::MapComponents> cmap = connection->componentMapping();
+        std::wstring c1 = cmap->firstComponentName();
+        std::wstring c2 = cmap->secondComponentName();
+        ObjRef<iface::cellml_api::MapVariablesSet> mvs = connection->variableMappings();
+        ObjRef<iface::cellml_api::MapVariablesIterator> mvi = mvs->iterateMapVariables();
+        while (true)
+        {
+            ObjRef<iface::cellml_api::MapVariables> vmap = mvi->nextMapVariable();
+            if (vmap == NULL) break;
+            std::pair<std::wstring, std::wstring> v1(c1, vmap->firstVariableName());
+            std::pair<std::wstring, std::wstring> v2(c2, vmap->secondVariableName());
+            index.insert(std::make_pair(v1, v2));
+            index.insert(std::make_pair(v2, v1));
+        }
+    }
+    return index;
+}
+
+void CellmlUtils::instantiateImportsFor(iface::cellml_api::CellMLVariable* variable)
+{
+    ObjRef<iface::cellml_api::CellMLComponent> component = QueryInterface(variable->parentElement());
+    if (component == NULL) return;
+    std::vector<VariableLocation> toVisit;
+    VariableLocation start;
+    start.model = component->modelElement();
+    start.component = component->name();
+    start.variable = variable->name();
+    toVisit.push_back(start);
+    // follow every connection the variable could be involved in, crossing into imports as we find them.
+    while (! toVisit.empty())
+    {
+        VariableLocation location = toVisit.back();
+        toVisit.pop_back();
+        if (! mImportSearchedVariables.insert(location).second) continue;
+        // the source variable could be in this component, so have its math ready
+        classifyComponentMath(location.model, location.component);
+        // connected variables in this model
+        const ConnectionIndex& index = connectionIndex(location.model);
+        auto connected = index.equal_range(std::make_pair(location.component, location.variable));
+        for (auto c = connected.first; c != connected.second; ++c)
+        {
+            VariableLocation next = location;
+            next.component = c->second.first;
+            next.variable = c->second.second;
+            toVisit.push_back(next);
+        }
+        // the same variable in the importing model(s)
+        VariableLocation componentLocation = location;
+        componentLocation.variable = L"";
+        auto importers = mImportedAs.find(componentLocation);
+        if (importers != mImportedAs.end())
+        {
+            for (const auto& i: importers->second)
+            {
+                VariableLocation next = i;
+                next.variable = location.variable;
+                toVisit.push_back(next);
+            }
+        }
+        // the same variable in the imported model
+        ObjRef<iface::cellml_api::CellMLComponentSet> components = location.model->modelComponents();
+        ObjRef<iface::cellml_api::CellMLComponent> c = components->getComponent(location.component);
+        ObjRef<iface::cellml_api::ImportComponent> importComponent = QueryInterface(c);
+        if (importComponent == NULL) continue;
+        ObjRef<iface::cellml_api::CellMLImport> import = QueryInterface(importComponent->parentElement());
+        if ((import == NULL) || (instantiateImport(import) != 0)) continue;
+        VariableLocation next;
+        next.model = import->importedModel();
+        next.component = importComponent->componentRef();
+        mImportedAs[next].insert(componentLocation);
+        next.variable = location.variable;
+        toVisit.push_back(next);
+    }
+}
+
+static int countSkippedImports(iface::cellml_api::Model* model)
+{
+    int skipped = 0;
+    ObjRef<iface::cellml_api::CellMLImportSet> imports = model->imports();
+    ObjRef<iface::cellml_api::CellMLImportIterator> ii = imports->iterateImports();
+    while (true)
+    {
+        ObjRef<iface::cellml_api::CellMLImport> import = ii->nextImport();
+        if (import == NULL) break;
+        if (import->wasInstantiated())
+        {
+            ObjRef<iface::cellml_api::Model> importedModel = import->importedModel();
+            skipped += countSkippedImports(importedModel);
+        }
+        else ++skipped;
+    }
+    return skipped;
+}
+
+int CellmlUtils::importsSkipped() const
+{
+    if (mSourceModel == NULL) return 0;
+    return countSkippedImports(mSourceModel);
+}
+
+std::wstring CellmlUtils::uniqueSetName(iface::cellml_api::CellMLElement* parent,
+                                        iface::cellml_api::NamedCellMLElementSet *namedSet, const std::wstring &name)
+{
+    auto allocator = mNameAllocators.find(parent);
+    if (allocator == mNameAllocators.end())
+    {
+        // first name for this set, so start with the names already in it
+        allocator = mNameAllocators.insert(std::make_pair(parent, UniqueNameAllocator())).first;
+        ObjRef<iface::cellml_api::CellMLElementIterator> it = namedSet->iterate();
+        for (ObjRef<iface::cellml_api::CellMLElement> el = it->next(); el != NULL; el = it->next())
+        {
+            ObjRef<iface::cellml_api::NamedCellMLElement> named = QueryInterface(el);
+            if (named) allocator->second.reserve(named->name());
+        }
+    }
+    return allocator->second.allocate(name);
 }
 
 bool CellmlUtils::builtinUnits(const std::wstring &name)
 {
     bool match = false;
+    refreshSourceCuses();
     ObjRef<iface::cellml_services::CanonicalUnitRepresentation> cur = mSourceCuses->getUnitsByName(mSourceModel, name);
     if (cur) match = true;
     return match;
@@ -319,7 +539,7 @@ CellmlUtils::createVariableWithMatchingUnits(iface::cellml_api::CellMLComponent*
                                              iface::cellml_api::CellMLVariable* sourceVariable)
 {
     std::wstring s = uniqueVariableName(sourceVariable->componentName(), sourceVariable->name());
-    s = uniqueSetName(component->variables(), s);
+    s = uniqueSetName(component, component->variables(), s);
     ObjRef<iface::cellml_api::CellMLVariable> variable = createVariable(component, s);
     try
     {
@@ -374,6 +594,7 @@ CellmlUtils::createCompactedVariable(iface::cellml_api::CellMLComponent* compact
         std::map<ObjRef<iface::cellml_api::CellMLVariable>,
         ObjRef<iface::cellml_api::CellMLVariable> >& compactedVariables, CompactorReport& report)
 {
+    instantiateImportsFor(sourceModelVariable);
     ObjRef<iface::cellml_api::CellMLVariable> sourceVariable = sourceModelVariable->sourceVariable();
     if (sourceVariable == NULL)
     {
@@ -381,6 +602,12 @@ CellmlUtils::createCompactedVariable(iface::cellml_api::CellMLComponent* compact
                    << L" / " << sourceModelVariable->name();
         return NULL;
     }
+    // have we already failed to compact this variable? No need to explore it all again.
+    if (mFailedVariables.count(sourceVariable) == 1)
+    {
+        report.addCompactionFailureReferrer(sourceVariable, sourceModelVariable);
+        return NULL;
+    }
     report.setVariableForCompaction(sourceModelVariable, sourceVariable);
     // does the variable already exist?
     if (compactedVariables.count(sourceVariable) == 1)
@@ -398,6 +625,7 @@ CellmlUtils::createCompactedVariable(iface::cellml_api::CellMLComponent* compact
         report.setCompactedVariable(compactedVariables[sourceVariable]);
         return compactedVariables[sourceVariable];
     }
+    report.addCompactionFailureReferrer(sourceVariable, sourceModelVariable);
     return NULL;
 }
 
@@ -408,6 +636,7 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
                                  CompactorReport& report)
 {
     int returnCode = 0;
+    std::wstring errorMessage;
 
     // add the variable to the compacted variable list so that we don't try to work on in multiple times
     // need to be sure to remove it if any error occurs.
@@ -415,26 +644,23 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
 
     // determine what sort of source variable we are dealing with
     SourceVariableType vt;
-    std::wstring mathml = determineSourceVariableType(sourceVariable, vt);
     /// @todo This might be useful?
     //report.setSourceVariableType(vt);
-    if (! mathml.empty())
+    const EquationDefinition* equation = determineSourceVariableType(sourceVariable, vt);
+    if (equation)
     {
         std::wcout << L"Source variable: " << sourceVariable->componentName() << L" / " << sourceVariable->name()
                    << L"; is of type: " << variableTypeToString(vt) << std::endl;
-        XmlUtils xutils;
-        xutils.parseString(mathml);
         switch (vt)
         {
         case DIFFERENTIAL:
         case ALGEBRACIC_LHS:
         {
-            //std::wcout << L"Found a diff or equation: " << mathml << std::endl;
-            std::vector<std::wstring> ciList = xutils.getCiList();
+            const std::vector<std::wstring>& ciList = equation->ciList;
             ObjRef<iface::cellml_api::CellMLComponent> sourceComponent(QueryInterface(sourceVariable->parentElement()));
             ObjRef<iface::cellml_api::CellMLComponent> component(QueryInterface(variable->parentElement()));
             // keep track of the variable name mappings
-            std::map<std::wstring, std::wstring> variableMappings;
+            std::unordered_map<std::wstring, std::wstring> variableMappings;
             for (const auto& n: ciList)
             {
                 std::wcout << L"compacting variable: " << n << L"; from the equation..." << std::endl;
@@ -447,8 +673,8 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
                     if (ciCompacted) variableMappings[n] = ciCompacted->name();
                     else
                     {
-                        report.setErrorMessage(
-                                    L"ERROR: something went wrong compacting a ci variable");
+                        errorMessage = L"ERROR: something went wrong compacting a ci variable";
+                        report.setErrorMessage(errorMessage);
                         std::wcerr << L"ERROR: something went wrong compacting the source "
                                    << L"variable of a ci variable" << std::endl;
                         returnCode = -7;
@@ -457,32 +683,26 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
                 }
                 else
                 {
-                    report.setErrorMessage(L"ERROR: unable to get the ci variable in the source component.");
-                    std::wcerr << L"ERROR: unable to get the ci variable in the source component." << std::endl;
+                    errorMessage = L"ERROR: unable to get the ci variable in the source component.";
+                    report.setErrorMessage(errorMessage);
+                    std::wcerr << errorMessage << std::endl;
                     returnCode = -6;
                     break;
                 }
             }
             if (returnCode == 0)
             {
-                //std::wcout << L"Math before the update of names: " << mathml << std::endl;
-                // rename the variables in the equation
-                mathml = xutils.updateCiElements(variableMappings);
-                //std::wcout << L"Math after the update of names: " << mathml << std::endl;
-                // and add the equation to the math for this component
-                returnCode = addMathToComponent(component, mathml);
+                // rename the variables in the equation and add it to the math for this component
+                returnCode = addMathToComponent(component, *equation, variableMappings);
             }
         } break;
         case CONSTANT_PARAMETER_EQUATION:
         {
             // simply copy across the equation
             /// @todo Need to make sure units are defined?
-            std::wstring unitsName;
-            double value;
-            returnCode = xutils.numericalAssignmentGetValue(&value, unitsName);
             ObjRef<iface::cellml_api::CellMLComponent> component(QueryInterface(variable->parentElement()));
-            returnCode = defineConstantParameterEquation(component, variable->name(), value,
-                                                         unitsName);
+            returnCode = defineConstantParameterEquation(component, variable->name(), equation->value,
+                                                         equation->unitsName);
         } break;
         case CONSTANT_PARAMETER:
             // will never happen?
@@ -498,6 +718,7 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
                                << mVariableOfIntegration->componentName() << L" / " << mVariableOfIntegration->name()
                                << L"; which is not the current source variable: " << sourceVariable->componentName()
                                << L" / " << sourceVariable->name() << std::endl;
+                    errorMessage = L"ERROR: we already have a different variable of integration.";
                     returnCode = -11;
                 }
             }
@@ -507,27 +728,29 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
         {
             // we can replace the current source variable with the equal variable
             /// @todo Need to check units?
-            std::pair<std::wstring, std::wstring> vnames = xutils.simpleEqualityGetVariableNames();
+            const std::pair<std::wstring, std::wstring>& vnames = equation->equality;
             std::wcout << L"Variable equality: " << vnames.first << L" = " << vnames.second << std::endl;
             ObjRef<iface::cellml_api::CellMLComponent> component(QueryInterface(sourceVariable->parentElement()));
             ObjRef<iface::cellml_api::CellMLVariable> equalVariable = component->variables()->getVariable(vnames.second);
             if (equalVariable)
             {
-                ObjRef<iface::cellml_api::CellMLVariable> equalSourceVariable =
-                        component->variables()->getVariable(vnames.second)->sourceVariable();
+                instantiateImportsFor(equalVariable);
+                ObjRef<iface::cellml_api::CellMLVariable> equalSourceVariable = equalVariable->sourceVariable();
                 if (equalSourceVariable)
                 {
                     returnCode = compactVariable(variable, equalSourceVariable, compactedVariables, report);
                 }
                 else
                 {
-                    std::wcerr << L"ERROR: unable to get the source variable for an equal variable" << std::endl;
+                    errorMessage = L"ERROR: unable to get the source variable for an equal variable";
+                    std::wcerr << errorMessage << std::endl;
                     returnCode = -3;
                 }
             }
             else
             {
-                std::wcerr << L"ERROR: unable to get the equal variable." << std::endl;
+                errorMessage = L"ERROR: unable to get the equal variable.";
+                std::wcerr << errorMessage << std::endl;
                 returnCode = -4;
             }
         } break;
@@ -540,14 +763,15 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
     {
         std::wcerr << L"ERROR: CellmlUtils::compactVariable: Something went wrong compacting the source variable: "
                    << sourceVariable->componentName() << L" / " << sourceVariable->name() << std::endl;
+        if (errorMessage.empty()) errorMessage = L"ERROR: unable to compact the equation defining the variable.";
         // unsuccessfully compacted, so remove it to the list of compacted source variables.
-        compactedVariables.erase(sourceVariable);
-        return returnCode;
+        return compactionFailed(sourceVariable, returnCode, errorMessage, compactedVariables, report);
     }
 
     // handle the initial value attribute
     double iv;
-    returnCode = getInitialValue(sourceVariable, &iv, 0);
+    std::wstring ivUnits;
+    returnCode = getInitialValue(sourceVariable, &iv, ivUnits, 0);
     if (returnCode == 1) variable->initialValueValue(iv);
     else if (returnCode != 0)
     {
@@ -555,8 +779,8 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
                       L"to a specified value "
                    << sourceVariable->componentName() << L" / " << sourceVariable->name() << std::endl;
         // unsuccessfully compacted, so remove it to the list of compacted source variables.
-        compactedVariables.erase(sourceVariable);
-        return -1;
+        return compactionFailed(sourceVariable, -1, L"ERROR: unable to resolve the initial_value to a value.",
+                                compactedVariables, report);
     }
     else if (vt == UNKNOWN)
     {
@@ -580,145 +804,217 @@ int CellmlUtils::compactVariable(iface::cellml_api::CellMLVariable* variable,
         std::wcerr << L"Current assumed variable of integration: " << mVariableOfIntegration->componentName() << L" / "
                    << mVariableOfIntegration->name() << std::endl;
         // unsuccessfully compacted, so remove it to the list of compacted source variables.
-        compactedVariables.erase(sourceVariable);
-        return -10;
+        return compactionFailed(sourceVariable, -10, L"ERROR: the source variable appears to be undefined.",
+                                compactedVariables, report);
     }
     return 0;
 }
 
-std::wstring CellmlUtils::determineSourceVariableType(iface::cellml_api::CellMLVariable *variable,
-                                                      CellmlUtils::SourceVariableType& variableType)
+int CellmlUtils::compactionFailed(iface::cellml_api::CellMLVariable* sourceVariable, int returnCode,
+                                  const std::wstring& message,
+                                  std::map<ObjRef<iface::cellml_api::CellMLVariable>,
+                                           ObjRef<iface::cellml_api::CellMLVariable> >& compactedVariables,
+                                  CompactorReport& report)
 {
-    std::wstring mathString = L"";
-    variableType = UNKNOWN;
-    ObjRef<iface::cellml_api::CellMLComponent> component = QueryInterface(variable->parentElement());
-    ObjRef<iface::cellml_api::MathList> mathList = component->math();
-    ObjRef<iface::cellml_api::MathMLElementIterator> iter = mathList->iterate();
+    compactedVariables.erase(sourceVariable);
+    mFailedVariables.insert(sourceVariable);
+    report.setCompactionFailure(sourceVariable, returnCode, message);
+    return returnCode;
+}
+
+const PoolResult<CellmlUtils::ComponentEquations>&
+CellmlUtils::classifyComponentMath(iface::cellml_api::Model* model, const std::wstring& componentName)
+{
+    VariableLocation location;
+    location.model = model;
+    location.component = componentName;
+    auto existing = mComponentEquations.find(location);
+    if (existing != mComponentEquations.end()) return existing->second;
+    std::vector<std::wstring> mathBlocks, variableNames;
+    ObjRef<iface::cellml_api::CellMLComponentSet> components = model->modelComponents();
+    ObjRef<iface::cellml_api::CellMLComponent> component = components->getComponent(componentName);
+    if (component)
+    {
+        ObjRef<iface::cellml_api::MathList> mathList = component->math();
+        ObjRef<iface::cellml_api::MathMLElementIterator> iter = mathList->iterate();
+        while (true)
+        {
+            ObjRef<iface::mathml_dom::MathMLElement> mathElement = iter->next();
+            if (mathElement == NULL) break;
+            // make sure its a mathml:math element?
+            ObjRef<iface::mathml_dom::MathMLMathElement> math = QueryInterface(mathElement);
+            if (math) mathBlocks.push_back(mBootstrap->serialiseNode(math));
+        }
+        ObjRef<iface::cellml_api::CellMLVariableSet> variables = component->variables();
+        ObjRef<iface::cellml_api::CellMLVariableIterator> vi = variables->iterateVariables();
+        while (true)
+        {
+            ObjRef<iface::cellml_api::CellMLVariable> v = vi->nextVariable();
+            if (v == NULL) break;
+            variableNames.push_back(v->name());
+        }
+    }
+    PoolResult<ComponentEquations>& result = mComponentEquations[location];
+    result = mThreadPool->submit([mathBlocks, variableNames]() {
+        return classifyEquations(mathBlocks, variableNames);
+    });
+    return result;
+}
+
+CellmlUtils::ComponentEquations CellmlUtils::classifyEquations(const std::vector<std::wstring>& mathBlocks,
+                                                               const std::vector<std::wstring>& variableNames)
+{
+    // the order in which the equation types are looked for in each math block
+    static const SourceVariableType types[] = {
+        CONSTANT_PARAMETER_EQUATION, SIMPLE_EQUALITY, ALGEBRACIC_LHS, DIFFERENTIAL, VARIABLE_OF_INTEGRATION
+    };
+    ComponentEquations equations;
     XmlUtils xmlUtils;
-    while (true)
+    for (const auto& block: mathBlocks)
     {
-        ObjRef<iface::mathml_dom::MathMLElement> mathElement = iter->next();
-        if (mathElement == NULL) break;
-        // make sure its a mathml:math element?
-        ObjRef<iface::mathml_dom::MathMLMathElement> math = QueryInterface(mathElement);
-        if (math)
+        bool parsed = false;
+        for (const auto& vname: variableNames)
         {
-            std::wstring str = mBootstrap->serialiseNode(math);
-            // str = L"<?xml version=\"1.0\"?>\n" + str;
-            // std::wcout << L"Math block: " << str << std::endl;
-            xmlUtils.parseString(str);
-            mathString = xmlUtils.matchConstantParameterEquation(variable->name());
-            if (! mathString.empty())
-            {
-                //std::wcout << L"Math is a constant parameter equation: **" << mathString << L"**" << std::endl;
-                variableType = CONSTANT_PARAMETER_EQUATION;
-                break;
-            }
-            mathString = xmlUtils.matchSimpleEquality(variable->name());
-            if (! mathString.empty())
-            {
-                std::wcout << L"Math is a simple equality: **" << mathString << L"**" << std::endl;
-                variableType = SIMPLE_EQUALITY;
-                break;
-            }
-            mathString = xmlUtils.matchAlgebraicLhs(variable->name());
-            if (! mathString.empty())
+            // a variable can't be matched by a block which doesn't mention it
+            if (equations.count(vname) || (block.find(vname) == std::wstring::npos)) continue;
+            if (! parsed)
             {
-                variableType = ALGEBRACIC_LHS;
-                break;
+                if (xmlUtils.parseString(block) != 0) break;
+                parsed = true;
             }
-            mathString = xmlUtils.matchDifferential(variable->name());
-            if (! mathString.empty())
+            for (auto type: types)
             {
-                variableType = DIFFERENTIAL;
-                break;
-            }
-            /// @todo This will only work if there is math in the VoI's source component. Not the case when
-            /// defining "time" in its own component.
-            if (xmlUtils.matchVariableOfIntegration(variable->name()))
-            {
-                variableType = VARIABLE_OF_INTEGRATION;
+                if (! selectEquation(xmlUtils, type, vname)) continue;
+                EquationDefinition& equation = equations[vname];
+                equation.type = type;
+                equation.value = 0.0;
+                if ((type == DIFFERENTIAL) || (type == ALGEBRACIC_LHS))
+                {
+                    // only these equations are rewritten, so only they need a copy. The ci elements are found in
+                    // the copy, so the rewrite can rename them without looking for them again.
+                    equation.equation = std::make_shared<XmlUtils>();
+                    if (xmlUtils.copyCurrentNode(*equation.equation) == 0)
+                    {
+                        equation.ciList = equation.equation->getCiList();
+                    }
+                    else equation.equation.reset();
+                }
+                else if (type == CONSTANT_PARAMETER_EQUATION)
+                {
+                    xmlUtils.numericalAssignmentGetValue(&equation.value, equation.unitsName);
+                }
+                else if (type == SIMPLE_EQUALITY) equation.equality = xmlUtils.simpleEqualityGetVariableNames();
                 break;
             }
         }
     }
-    return mathString;
+    return equations;
 }
 
-int CellmlUtils::addMathToComponent(iface::cellml_api::CellMLComponent* component, const std::wstring& math)
+bool CellmlUtils::selectEquation(XmlUtils& math, SourceVariableType type, const std::wstring& vname)
 {
-    int returnCode = 0;
-    std::wstring mathml = math;
-    // make sure we add in any existing annotations...
-    mathml += mAnnotations->getStringAnnotation(component, MATH_ANNOTATION_KEY);
-    mAnnotations->setStringAnnotation(component, MATH_ANNOTATION_KEY, mathml);
-    return returnCode;
+    switch (type)
+    {
+    case CONSTANT_PARAMETER_EQUATION:
+        return math.matchConstantParameterEquation(vname);
+    case SIMPLE_EQUALITY:
+        return math.matchSimpleEquality(vname);
+    case ALGEBRACIC_LHS:
+        return math.matchAlgebraicLhs(vname);
+    case DIFFERENTIAL:
+        return math.matchDifferential(vname);
+    /// @todo This will only work if there is math in the VoI's source component. Not the case when
+    /// defining "time" in its own component.
+    case VARIABLE_OF_INTEGRATION:
+        return math.matchVariableOfIntegration(vname);
+    default:
+        return false;
+    }
+}
+
+const CellmlUtils::EquationDefinition*
+CellmlUtils::determineSourceVariableType(iface::cellml_api::CellMLVariable *variable,
+                                         CellmlUtils::SourceVariableType& variableType)
+{
+    variableType = UNKNOWN;
+    ObjRef<iface::cellml_api::CellMLComponent> component = QueryInterface(variable->parentElement());
+    ObjRef<iface::cellml_api::Model> model = component->modelElement();
+    const ComponentEquations& equations = classifyComponentMath(model, component->name()).get();
+    auto equation = equations.find(variable->name());
+    if (equation == equations.end()) return NULL;
+    variableType = equation->second.type;
+    if (variableType == SIMPLE_EQUALITY)
+    {
+        std::wcout << L"Math is a simple equality for: " << variable->name() << std::endl;
+    }
+    // the variable of integration isn't defined by its equation
+    if (variableType == VARIABLE_OF_INTEGRATION) return NULL;
+    return &(equation->second);
+}
+
+std::shared_ptr<XmlUtils>
+CellmlUtils::rewriteEquation(const std::shared_ptr<XmlUtils>& equation,
+                             const std::unordered_map<std::wstring, std::wstring>& nameMapping)
+{
+    if ((equation == NULL) || (equation->updateCiElements(nameMapping) != 0)) return NULL;
+    return equation;
+}
+
+int CellmlUtils::addMathToComponent(iface::cellml_api::CellMLComponent* component, const EquationDefinition& equation,
+                                    const std::unordered_map<std::wstring, std::wstring>& nameMapping)
+{
+    PendingEquation pending;
+    pending.value = 0.0;
+    std::shared_ptr<XmlUtils> math = equation.equation;
+    pending.equation = mThreadPool->submit([math, nameMapping]() {
+        return rewriteEquation(math, nameMapping);
+    });
+    mComponentMath[component->name()].push_back(pending);
+    return 0;
 }
 
 int CellmlUtils::defineConstantParameterEquation(iface::cellml_api::CellMLComponent* component,
                                                  const std::wstring& vname, double value,
                                                  const std::wstring& unitsName)
 {
-    std::wstring mathml = L"<apply><eq/><ci>";
-    mathml += vname;
-    mathml += L"</ci><cn cellml:units=\"";
-    mathml += unitsName;
-    mathml += L"\">";
-    mathml += formatNumber(value);
-    mathml += L"</cn></apply>";
-    return addMathToComponent(component, mathml);
+    PendingEquation pending;
+    pending.vname = vname;
+    pending.value = value;
+    pending.unitsName = unitsName;
+    mComponentMath[component->name()].push_back(pending);
+    return 0;
 }
 
-std::wstring CellmlUtils::modelToString(iface::cellml_api::Model *model)
+int CellmlUtils::writeModel(iface::cellml_api::Model *model, std::string& output)
 {
-    std::wstring modelString = model->serialisedText();
-    // dirty hack to get the math into the model since its too hard to do this directly in the CellML API.
-    ObjRef<iface::cellml_api::CellMLComponentSet> components = model->localComponents();
-    ObjRef<iface::cellml_api::CellMLComponentIterator> iter = components->iterateComponents();
-    while (true)
+    // collect the equations rewritten on the thread pool, in the order they were generated.
+    std::map<std::wstring, XmlUtils> componentMath;
+    for (const auto& cm: mComponentMath)
     {
-        ObjRef<iface::cellml_api::CellMLComponent> component = iter->nextComponent();
-        if (component == NULL) break;
-        std::wstring cname = component->name();
-        std::wstring mathBlock = mAnnotations->getStringAnnotation(component, MATH_ANNOTATION_KEY);
-        if (mathBlock.length() > 1)
+        XmlUtils& math = componentMath[cm.first];
+        for (const auto& pending: cm.second)
         {
-            mathBlock = L"<math xmlns=\"http://www.w3.org/1998/Math/MathML\">" + mathBlock;
-            mathBlock += L"</math>";
-            //std::wcout << L"Adding math block to component: " << mathBlock << std::endl;
-            std::wstring nameAttr = L"name=\"" + cname + L"\"";
-            size_t componentNameLocation = modelString.find(nameAttr);
-            size_t componentEndLocation = modelString.find(L"</component>", componentNameLocation);
-            modelString.insert(componentEndLocation, mathBlock);
+            if (pending.equation.valid())
+            {
+                const std::shared_ptr<XmlUtils>& equation = pending.equation.get();
+                if ((equation == NULL) || (math.addEquation(*equation) != 0))
+                {
+                    std::wcerr << L"ERROR: unable to rewrite an equation for the component: " << cm.first
+                               << std::endl;
+                    return -1;
+                }
+            }
+            else math.addConstantParameterEquation(pending.vname, pending.value, pending.unitsName);
         }
     }
-    // seems we need to make sure the cellml namespace prefix is defined
-    if (modelString.find(L"xmlns:cellml") == modelString.npos)
+    mComponentMath.clear();
+    // the math is too hard to add directly in the CellML API, so the math trees we have built up are written
+    // into their components as the model is written out.
+    CellmlWriter writer(output);
+    if (writer.writeModel(model, &componentMath) != 0)
     {
-        std::size_t pos1 = modelString.find(L"xmlns=\"");
-        pos1 += 7;
-        std::size_t pos2 = modelString.find(L'"', pos1);
-        std::wstring nsUri = modelString.substr(pos1, (pos2-pos1));
-        modelString.insert(++pos2, L" xmlns:cellml=\"");
-        pos2 += 15;
-        modelString.insert(pos2, nsUri);
-        pos2 += nsUri.length();
-        modelString.insert(pos2, L"\"");
+        std::wcerr << L"ERROR: unable to write the model: " << model->name() << std::endl;
+        return -2;
     }
-    return modelString;
-}
-
-ObjRef<iface::cellml_api::Model> CellmlUtils::createModelFromString(const std::wstring &modelString)
-{
-    ObjRef<iface::cellml_api::Model> newModel = NULL;
-    ObjRef<iface::cellml_api::DOMModelLoader> modelLoader = mBootstrap->modelLoader();
-    try
-    {
-        newModel = modelLoader->createFromText(modelString);
-    }
-    catch (...)
-    {
-        std::wcerr << L"ERROR creating model from the string: " << modelString << std::endl;
-    }
-    return newModel;
+    return 0;
 }
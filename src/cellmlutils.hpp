@@ -2,18 +2,30 @@
 #define CELLMLUTILS_HPP
 
 #include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 
 #include <cellml-api-cxx-support.hpp>
 #include <IfaceCellML_APISPEC.hxx>
 #include <IfaceCUSES.hxx>
-#include <IfaceAnnoTools.hxx>
 
 #include "compactorreport.hpp"
+#include "xmlutils.hpp"
+#include "importcache.hpp"
+#include "flatteningcontext.hpp"
+#include "threadpool.hpp"
+#include "uniquenameallocator.hpp"
 
 class CellmlUtils
 {
 public:
-    CellmlUtils();
+    /**
+     * @param context If given, the shared bootstraps, import cache and thread pool to use. Otherwise new bootstraps
+     * and a thread pool are created, and imports are instantiated directly by the CellML API.
+     */
+    explicit CellmlUtils(FlatteningContext* context = NULL);
     ~CellmlUtils();
 
     /**
@@ -22,13 +34,6 @@ public:
      */
     ObjRef<iface::cellml_api::Model> createModel();
 
-    /**
-     * Create a new model from the given model definition string.
-     * @param modelString A string containing the model definition.
-     * @return The model created from the given string; or NULL on error.
-     */
-    ObjRef<iface::cellml_api::Model> createModelFromString(const std::wstring& modelString);
-
     ObjRef<iface::cellml_api::CellMLComponent>
     createComponent(iface::cellml_api::Model* model, const std::wstring& name,
                     const std::wstring& cmetaId) const;
@@ -56,7 +61,7 @@ public:
      * @param sourceUnits The units to "copy" into the given model.
      * @return The name of the units created in the given model (may or may not be the same as the source units).
      */
-    std::wstring defineUnits(iface::cellml_api::Model* model, iface::cellml_api::Units* sourceUnits) const;
+    std::wstring defineUnits(iface::cellml_api::Model* model, iface::cellml_api::Units* sourceUnits);
 
     /**
      * Create a new units in the given model with the provided name, defined by the specified canonical
@@ -73,11 +78,41 @@ public:
 
     /**
      * Grab hold of the source model, will trigger the building of any extra stuff we might need from the model.
+     * Imports of the source model are not instantiated up front (except those importing units), they will be
+     * instantiated when compaction first needs to look into them. The source model is otherwise not modified, and
+     * the imports instantiated here are uninstantiated again by releaseSourceModel.
      * @param model The model that will be the source for model compaction.
      * @return zero on success.
      */
     int setSourceModel(iface::cellml_api::Model* model);
 
+    /**
+     * Make sure that all the imports which the given variable might be connected through have been instantiated,
+     * so that its source variable can be found. Imports are instantiated the first time they are needed.
+     * @param variable The variable whose source variable is about to be looked up.
+     */
+    void instantiateImportsFor(iface::cellml_api::CellMLVariable* variable);
+
+    /**
+     * Uninstantiate all the imports instantiated while compacting the source model, leaving the source model as it
+     * was given to setSourceModel, and let go of the source model.
+     */
+    void releaseSourceModel();
+
+    /**
+     * @return The number of imports which have been instantiated for the compaction of the source model.
+     */
+    int importsInstantiated() const
+    {
+        return mInstantiatedImports.size();
+    }
+
+    /**
+     * @return The number of imports in the source model which have not been instantiated, as they are not needed
+     * by the variables compacted so far. Imports of imports which have not been instantiated are not included.
+     */
+    int importsSkipped() const;
+
     std::wstring uniqueVariableName(const std::wstring& cname, const std::wstring& vname) const
     {
         std::wstring name = cname;
@@ -87,12 +122,15 @@ public:
     }
 
     /**
-     * Create a unique name within the given named element set based on the specified baseName.
+     * Create a unique name within the given named element set based on the specified baseName. The name is
+     * reserved, so the caller must add an element with this name to the set.
+     * @param parent The element owning the named element set.
      * @param namedSet The named element set in which to ensure a unique name.
      * @param name The preferred name.
      * @return A unique name for use in the given named element set. Will return <name> if it is unique.
      */
-    std::wstring uniqueSetName(iface::cellml_api::NamedCellMLElementSet* namedSet, const std::wstring& name) const;
+    std::wstring uniqueSetName(iface::cellml_api::CellMLElement* parent,
+                               iface::cellml_api::NamedCellMLElementSet* namedSet, const std::wstring& name);
 
     /**
      * Determine if the given units name is a valid "built-in" units name in CellML.
@@ -120,7 +158,7 @@ public:
      * @param report The compactor report object to keep track of the model compaction report.
      * @return An existing variable in the compacted model component if one already exists for the given (source) variable,
      * or a newly created variable representing the compacted version of the (source) variable. If an error occurs, NULL is
-     * returned.
+     * returned. Source variables which have already failed to compact are not attempted again.
      */
     ObjRef<iface::cellml_api::CellMLVariable> createCompactedVariable(
             iface::cellml_api::CellMLComponent* compactedModelComponent,
@@ -148,20 +186,73 @@ public:
                         CompactorReport& report);
 
     /**
-     * Generate a serialised version of the given model, with any annotations we know about
-     * added in to the model serialisation.
-     * @param model The model to serialise.
-     * @return A string containing the serialised model. Will be an empty string if an error occurs.
+     * Write out the given model as CellML 1.0, with any math we have generated for its components added in to
+     * the components as they are written.
+     * @param model The model to write.
+     * @param output The UTF-8 model is appended to this string.
+     * @return zero on success.
      */
-    std::wstring modelToString(iface::cellml_api::Model* model);
+    int writeModel(iface::cellml_api::Model* model, std::string& output);
 
 private:
     ObjRef<iface::cellml_api::CellMLBootstrap> mBootstrap;
     ObjRef<iface::cellml_api::Model> mSourceModel;
     ObjRef<iface::cellml_services::CUSESBootstrap> mCusesBootstrap;
     ObjRef<iface::cellml_services::CUSES> mSourceCuses;
-    ObjRef<iface::cellml_services::AnnotationSet> mAnnotations;
+    bool mSourceCusesOutdated;
+    // the imports we have instantiated in the source model, in the order they were instantiated.
+    std::vector<ObjRef<iface::cellml_api::CellMLImport> > mInstantiatedImports;
+    ImportCache* mImportCache;
+    // the names taken in each named element set we generate names for, keyed on the element owning the set. Kept
+    // per instance so that the same model always compacts to the same output.
+    std::map<ObjRef<iface::cellml_api::CellMLElement>, UniqueNameAllocator> mNameAllocators;
+    // the location of a variable, or a component if the variable name is empty, in a model's namespace.
+    struct VariableLocation
+    {
+        ObjRef<iface::cellml_api::Model> model;
+        std::wstring component;
+        std::wstring variable;
+        bool operator<(const VariableLocation& other) const
+        {
+            if (model != other.model) return model < other.model;
+            if (component != other.component) return component < other.component;
+            return variable < other.variable;
+        }
+    };
+    typedef std::multimap<std::pair<std::wstring, std::wstring>, std::pair<std::wstring, std::wstring> >
+        ConnectionIndex;
+    // the variable connections of each model we have looked at, in both directions.
+    std::map<ObjRef<iface::cellml_api::Model>, ConnectionIndex> mConnectionIndex;
+    // the import components (and their model) that each component in an instantiated import is imported as.
+    std::map<VariableLocation, std::set<VariableLocation> > mImportedAs;
+    // the variables whose connections have already been followed looking for imports to instantiate.
+    std::set<VariableLocation> mImportSearchedVariables;
+    // an equation waiting to be added to the math of a component in the compacted model: either an equation being
+    // rewritten by the thread pool, or a constant parameter equation.
+    struct PendingEquation
+    {
+        PoolResult<std::shared_ptr<XmlUtils> > equation;
+        std::wstring vname;
+        double value;
+        std::wstring unitsName;
+    };
+    // the math generated for the components of the compacted model, keyed by component name, in the order the
+    // equations were generated.
+    std::map<std::wstring, std::vector<PendingEquation> > mComponentMath;
+    // runs the libxml work on the math, which doesn't need the CellML API, alongside the compaction.
+    ThreadPool* mThreadPool;
+    std::unique_ptr<ThreadPool> mOwnThreadPool;
     ObjRef<iface::cellml_api::CellMLVariable> mVariableOfIntegration;
+    struct ResolvedInitialValue
+    {
+        int returnCode;
+        double value;
+        std::wstring unitsName;
+    };
+    // the resolved initial values of variables used as the initial_value of other variables.
+    std::map<ObjRef<iface::cellml_api::CellMLVariable>, ResolvedInitialValue> mInitialValues;
+    // the source variables we have failed to compact, so we don't keep trying. Their failures are in the report.
+    std::set<ObjRef<iface::cellml_api::CellMLVariable> > mFailedVariables;
     enum SourceVariableType
     {
         UNKNOWN = 0,
@@ -193,31 +284,146 @@ private:
         }
     }
 
+    // how a variable is defined by the math of its component.
+    struct EquationDefinition
+    {
+        SourceVariableType type;
+        // the equation in a document of its own, copied when the math is classified (see XmlUtils::copyCurrentNode).
+        // For DIFFERENTIAL and ALGEBRACIC_LHS its ci elements are recorded then too. It is renamed in place and
+        // moved into the compacted math, so it is only used once: each equation defines one variable, and each
+        // variable is only compacted once.
+        std::shared_ptr<XmlUtils> equation;
+        // DIFFERENTIAL, ALGEBRACIC_LHS: the names of the variables used in the equation.
+        std::vector<std::wstring> ciList;
+        // CONSTANT_PARAMETER_EQUATION: the value assigned.
+        double value;
+        std::wstring unitsName;
+        // SIMPLE_EQUALITY: the two variables.
+        std::pair<std::wstring, std::wstring> equality;
+    };
+    // the equations defining the variables of a component, keyed by variable name.
+    typedef std::map<std::wstring, EquationDefinition> ComponentEquations;
+    // the classification of the math of each component we might compact variables from, done on the thread pool.
+    std::map<VariableLocation, PoolResult<ComponentEquations> > mComponentEquations;
+
+    /**
+     * Hand the math of the given component to the thread pool to be classified, if it hasn't been already. The
+     * math is serialised here as the CellML API can only be used from this thread.
+     * @param model The model containing the component.
+     * @param componentName The name of the component.
+     * @return The (future) equations defining the variables of the component.
+     */
+    const PoolResult<ComponentEquations>& classifyComponentMath(iface::cellml_api::Model* model,
+                                                                const std::wstring& componentName);
+
+    /**
+     * Find the equation defining each of the given variables in the given math blocks. Run on the thread pool, so
+     * it must not touch anything but its arguments.
+     * @param mathBlocks The serialised math blocks of a component, in document order.
+     * @param variableNames The names of the variables in the component.
+     * @return The definitions found. As with a search for a single variable, the first math block with a match for
+     * a variable is used.
+     */
+    static ComponentEquations classifyEquations(const std::vector<std::wstring>& mathBlocks,
+                                                const std::vector<std::wstring>& variableNames);
+
+    /**
+     * Make the equation defining the given variable the current node of the given math.
+     * @param math The parsed math block.
+     * @param type The type of the equation to look for.
+     * @param vname The name of the variable.
+     * @return true if a matching equation was found.
+     */
+    static bool selectEquation(XmlUtils& math, SourceVariableType type, const std::wstring& vname);
+
+    /**
+     * Rename the variables of the given equation, using the ci elements recorded when it was classified. Run on
+     * the thread pool.
+     * @param equation The equation, as the current node of its own document. It is renamed in place.
+     * @param nameMapping The mapping from existing name to a new name.
+     * @return The given equation, or NULL on error.
+     */
+    static std::shared_ptr<XmlUtils> rewriteEquation(const std::shared_ptr<XmlUtils>& equation,
+                                                     const std::unordered_map<std::wstring, std::wstring>& nameMapping);
+
+    /**
+     * Instantiate the given import, if it hasn't already been instantiated.
+     * @param import The import to instantiate.
+     * @return zero on success.
+     */
+    int instantiateImport(iface::cellml_api::CellMLImport* import);
+
+    /**
+     * Instantiate any imports in the given model which import units, so that the units used in the model can
+     * always be resolved.
+     * @param model The model whose units imports should be instantiated.
+     * @return zero on success.
+     */
+    int instantiateUnitsImports(iface::cellml_api::Model* model);
+
+    /**
+     * Get the index of the variable connections in the given model, building it if needed.
+     * @param model The model of interest.
+     * @return The connection index for the model.
+     */
+    const ConnectionIndex& connectionIndex(iface::cellml_api::Model* model);
+
+    /**
+     * Make sure the CUSES for the source model covers all the imports instantiated so far.
+     */
+    void refreshSourceCuses();
+
+    /**
+     * Record that the given source variable could not be compacted, so that later references to it fail straight
+     * away rather than exploring the variable's dependencies all over again, and add the failure to the report so
+     * that those references can be attached to it.
+     * @param sourceVariable The source variable which failed to compact.
+     * @param returnCode The error code of the failure.
+     * @param message A description of the failure.
+     * @param compactedVariables The map of compacted variables, the source variable will be removed from it.
+     * @param report The compactor report.
+     * @return The given return code.
+     */
+    int compactionFailed(iface::cellml_api::CellMLVariable* sourceVariable, int returnCode,
+                         const std::wstring& message,
+                         std::map<ObjRef<iface::cellml_api::CellMLVariable>,
+                                  ObjRef<iface::cellml_api::CellMLVariable> >& compactedVariables,
+                         CompactorReport& report);
+
     /**
      * Attempt to determine the type of the given source variable.
      * @param variable The variable of interest.
      * @param variableType The type of the variable, if it can be determined.
-     * @return If the variable is of a type defined by MathML, a string containing the serialised MathML will be
-     * returned. Otherwise an empty string is returned.
+     * @return The definition of the variable if it is of a type defined by a MathML equation; NULL otherwise.
      */
-    std::wstring determineSourceVariableType(iface::cellml_api::CellMLVariable* variable,
-                                             SourceVariableType& variableType);
+    const EquationDefinition* determineSourceVariableType(iface::cellml_api::CellMLVariable* variable,
+                                                          SourceVariableType& variableType);
 
     /**
      * Attempt to get the initial_value for the given variable. Will trace back through the model if the initial_value
      * is set to be defined by a variable. Will also attempt to get the numerical value if the initial_value of the given
-     * variable is set to a variable which has a simple numerical assignment.
+     * variable is set to a variable which has a simple numerical assignment. Values resolved through a variable are
+     * cached, including failures, so shared initial_value sources are only resolved once.
      * @param variable The variable to get an initial_value from.
      * @param value The numerical value of the initial value.
+     * @param unitsName The name of the units the numerical value is given in.
      * @param level Used in the case where we recurse through the model.
      * @return 1 if an initial value was successfully found and value was set; zero on other success (i.e., no initial value attribute
      * found); other non-zero values if we are unable to determine the initial_value (e.g., if the linked variable
      * is defined by an algebraic expression).
      */
-    int getInitialValue(iface::cellml_api::CellMLVariable* variable, double* value, int level);
+    int getInitialValue(iface::cellml_api::CellMLVariable* variable, double* value, std::wstring& unitsName,
+                        int level);
+
+    /**
+     * Remember the outcome of resolving the initial value of a variable used as the initial_value of another variable.
+     * @return The given return code.
+     */
+    int cacheInitialValue(iface::cellml_api::CellMLVariable* variable, int returnCode, double value,
+                          const std::wstring& unitsName);
 
     /**
-     * Define the mathematics annotation for the given constant parameter equation.
+     * Define the mathematics for the given constant parameter equation.
      * @param component The component in which to create the equation.
      * @param vname The name of the constant parameter variable in the given component.
      * @param value The value to set in the equation.
@@ -229,12 +435,15 @@ private:
                                         const std::wstring& unitsName);
 
     /**
-     * Add the given math to the MathML annotation for the given component.
-     * @param component The component to which the MathML annotation should be added.
-     * @param math The block of MathML to add.
+     * Add the given equation to the math for the given component. The variables in the equation are renamed on the
+     * thread pool, and the equation is added when the model is serialised.
+     * @param component The component to which the equation should be added.
+     * @param equation The definition of the equation to add.
+     * @param nameMapping The mapping from the variable names in the equation to their names in the component.
      * @return zero on success.
      */
-    int addMathToComponent(iface::cellml_api::CellMLComponent* component, const std::wstring& math);
+    int addMathToComponent(iface::cellml_api::CellMLComponent* component, const EquationDefinition& equation,
+                           const std::unordered_map<std::wstring, std::wstring>& nameMapping);
 };
 
 #endif // CELLMLUTILS_HPP
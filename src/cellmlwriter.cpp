@@ -0,0 +1,280 @@
+#include <iostream>
+
+#include <IfaceDOM_APISPEC.hxx>
+
+#include "cellmlwriter.hpp"
+#include "xmlutils.hpp"
+#include "utils.hpp"
+
+#define CELLML_1_0_NS "http://www.cellml.org/cellml/1.0#"
+#define XMLNS_NS "http://www.w3.org/2000/xmlns/"
+#define XML_NS "http://www.w3.org/XML/1998/namespace"
+
+static int appendToString(void* context, const char* buffer, int len)
+{
+    static_cast<std::string*>(context)->append(buffer, len);
+    return len;
+}
+
+static std::string xmlString(const xmlChar* s)
+{
+    return s ? std::string((const char*)s) : std::string();
+}
+
+CellmlWriter::CellmlWriter(std::string& output) : mWriter(NULL), mRootElement(true)
+{
+    initialiseLibXml();
+    xmlOutputBufferPtr out = xmlOutputBufferCreateIO(appendToString, NULL, &output, NULL);
+    if (out == NULL) return;
+    // the writer owns the output buffer from now on, unless it can't be created
+    mWriter = xmlNewTextWriter(out);
+    if (mWriter == NULL) xmlOutputBufferClose(out);
+}
+
+CellmlWriter::~CellmlWriter()
+{
+    if (mWriter) xmlFreeTextWriter(mWriter);
+}
+
+int CellmlWriter::writeModel(iface::cellml_api::Model* model, std::map<std::wstring, XmlUtils>* componentMath)
+{
+    if (mWriter == NULL) return -1;
+    DECLARE_QUERY_INTERFACE_OBJREF(modelElement, model, cellml_api::CellMLDOMElement);
+    if (modelElement == NULL) return -2;
+    ObjRef<iface::dom::Element> root = modelElement->domElement();
+    // the xml prefix is bound without being declared
+    mBindings.assign(1, Binding{"xml", XML_NS});
+    mScopes.clear();
+    mRootElement = true;
+    if (xmlTextWriterStartDocument(mWriter, NULL, "UTF-8", NULL) < 0) return -3;
+    int rc = writeDomNode(root, componentMath);
+    if (rc != 0) return rc;
+    if (xmlTextWriterEndDocument(mWriter) < 0) return -3;
+    if (xmlTextWriterFlush(mWriter) < 0) return -3;
+    return 0;
+}
+
+int CellmlWriter::writeDomNode(iface::dom::Node* node, std::map<std::wstring, XmlUtils>* componentMath)
+{
+    switch (node->nodeType())
+    {
+    case iface::dom::Node::ELEMENT_NODE:
+        break;
+    case iface::dom::Node::TEXT_NODE:
+        return xmlTextWriterWriteString(mWriter, BAD_CAST wstring2string(node->nodeValue()).c_str()) < 0 ? -3 : 0;
+    case iface::dom::Node::CDATA_SECTION_NODE:
+        return xmlTextWriterWriteCDATA(mWriter, BAD_CAST wstring2string(node->nodeValue()).c_str()) < 0 ? -3 : 0;
+    case iface::dom::Node::COMMENT_NODE:
+        return xmlTextWriterWriteComment(mWriter, BAD_CAST wstring2string(node->nodeValue()).c_str()) < 0 ? -3 : 0;
+    case iface::dom::Node::PROCESSING_INSTRUCTION_NODE:
+        return xmlTextWriterWritePI(mWriter, BAD_CAST wstring2string(node->nodeName()).c_str(),
+                                    BAD_CAST wstring2string(node->nodeValue()).c_str()) < 0 ? -3 : 0;
+    default:
+        // nothing else can be found in a model's elements
+        return 0;
+    }
+    Name element;
+    element.prefix = wstring2string(node->prefix());
+    element.uri = wstring2string(node->namespaceURI());
+    element.local = wstring2string(node->localName());
+    if (element.local.empty()) element.local = wstring2string(node->nodeName());
+    std::vector<Binding> declarations;
+    if (mRootElement)
+    {
+        // always declare the cellml prefix, as the metadata and extension elements may use it in their content
+        declarations.push_back(Binding{"", CELLML_1_0_NS});
+        declarations.push_back(Binding{"cellml", CELLML_1_0_NS});
+        mRootElement = false;
+    }
+    std::vector<Attribute> attributes;
+    std::string componentName;
+    ObjRef<iface::dom::NamedNodeMap> attributeMap = node->attributes();
+    uint32_t n = attributeMap ? attributeMap->length() : 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        ObjRef<iface::dom::Node> a = attributeMap->item(i);
+        std::string name = wstring2string(a->nodeName());
+        std::string uri = wstring2string(a->namespaceURI());
+        if ((uri == XMLNS_NS) || (name == "xmlns") || (name.compare(0, 6, "xmlns:") == 0))
+        {
+            declarations.push_back(Binding{name.size() > 6 ? name.substr(6) : "", wstring2string(a->nodeValue())});
+            continue;
+        }
+        Attribute attribute;
+        attribute.name.prefix = wstring2string(a->prefix());
+        attribute.name.uri = uri;
+        attribute.name.local = wstring2string(a->localName());
+        if (attribute.name.local.empty()) attribute.name.local = name;
+        attribute.value = wstring2string(a->nodeValue());
+        if (uri.empty() && (attribute.name.local == "name")) componentName = attribute.value;
+        attributes.push_back(attribute);
+    }
+    int rc = startElement(element, declarations, attributes);
+    if (rc != 0) return rc;
+    ObjRef<iface::dom::Node> child = node->firstChild();
+    while (child)
+    {
+        rc = writeDomNode(child, componentMath);
+        if (rc != 0) return rc;
+        child = child->nextSibling();
+    }
+    if (componentMath && (element.uri == CELLML_1_0_NS) && (element.local == "component"))
+    {
+        auto cm = componentMath->find(string2wstring(componentName));
+        if (cm != componentMath->end())
+        {
+            xmlNodePtr math = static_cast<xmlNodePtr>(cm->second.rootElement());
+            if (math && math->children)
+            {
+                rc = writeXmlNode(math);
+                if (rc != 0) return rc;
+            }
+        }
+    }
+    return endElement();
+}
+
+int CellmlWriter::writeXmlNode(xmlNodePtr node)
+{
+    switch (node->type)
+    {
+    case XML_ELEMENT_NODE:
+        break;
+    case XML_TEXT_NODE:
+        return xmlTextWriterWriteString(mWriter, node->content) < 0 ? -3 : 0;
+    case XML_CDATA_SECTION_NODE:
+        return xmlTextWriterWriteCDATA(mWriter, node->content) < 0 ? -3 : 0;
+    case XML_COMMENT_NODE:
+        return xmlTextWriterWriteComment(mWriter, node->content) < 0 ? -3 : 0;
+    case XML_PI_NODE:
+        return xmlTextWriterWritePI(mWriter, node->name, node->content) < 0 ? -3 : 0;
+    default:
+        return 0;
+    }
+    Name element;
+    element.local = xmlString(node->name);
+    if (node->ns)
+    {
+        element.prefix = xmlString(node->ns->prefix);
+        element.uri = xmlString(node->ns->href);
+    }
+    std::vector<Binding> declarations;
+    for (xmlNsPtr ns = node->nsDef; ns; ns = ns->next)
+    {
+        declarations.push_back(Binding{xmlString(ns->prefix), xmlString(ns->href)});
+    }
+    std::vector<Attribute> attributes;
+    for (xmlAttrPtr a = node->properties; a; a = a->next)
+    {
+        Attribute attribute;
+        attribute.name.local = xmlString(a->name);
+        if (a->ns)
+        {
+            attribute.name.prefix = xmlString(a->ns->prefix);
+            attribute.name.uri = xmlString(a->ns->href);
+        }
+        xmlChar* value = xmlNodeListGetString(node->doc, a->children, 1);
+        attribute.value = xmlString(value);
+        if (value) xmlFree(value);
+        attributes.push_back(attribute);
+    }
+    int rc = startElement(element, declarations, attributes);
+    if (rc != 0) return rc;
+    for (xmlNodePtr child = node->children; child; child = child->next)
+    {
+        rc = writeXmlNode(child);
+        if (rc != 0) return rc;
+    }
+    return endElement();
+}
+
+int CellmlWriter::startElement(const Name& element, const std::vector<Binding>& declarations,
+                               const std::vector<Attribute>& attributes)
+{
+    std::string qname = element.prefix.empty() ? element.local : element.prefix + ":" + element.local;
+    if (xmlTextWriterStartElement(mWriter, BAD_CAST qname.c_str()) < 0) return -3;
+    mScopes.push_back(mBindings.size());
+    // the declarations from the source, where they change what is in scope. The first declaration of a prefix
+    // wins, so the declarations we add for the model element take precedence.
+    for (const auto& d: declarations)
+    {
+        if (boundHere(d.prefix)) continue;
+        const std::string* uri = lookup(d.prefix);
+        if ((uri ? *uri : std::string()) == d.uri) continue;
+        if (declare(d.prefix, d.uri) != 0) return -3;
+    }
+    const std::string* uri = lookup(element.prefix);
+    if ((uri ? *uri : std::string()) != element.uri)
+    {
+        if (declare(element.prefix, element.uri) != 0) return -3;
+    }
+    for (const auto& a: attributes)
+    {
+        std::string prefix;
+        if (! a.name.uri.empty())
+        {
+            // attributes don't use the default namespace, so need a prefix bound to their namespace
+            prefix = a.name.prefix;
+            uri = prefix.empty() ? NULL : lookup(prefix);
+            if ((uri == NULL) || (*uri != a.name.uri))
+            {
+                prefix = prefixFor(a.name.uri);
+                if (prefix.empty())
+                {
+                    prefix = a.name.prefix;
+                    for (int i = 1; prefix.empty() || boundHere(prefix); ++i) prefix = "ns" + std::to_string(i);
+                    if (declare(prefix, a.name.uri) != 0) return -3;
+                }
+            }
+        }
+        std::string aname = prefix.empty() ? a.name.local : prefix + ":" + a.name.local;
+        if (xmlTextWriterWriteAttribute(mWriter, BAD_CAST aname.c_str(), BAD_CAST a.value.c_str()) < 0)
+        {
+            return -3;
+        }
+    }
+    return 0;
+}
+
+int CellmlWriter::endElement()
+{
+    mBindings.resize(mScopes.back());
+    mScopes.pop_back();
+    return xmlTextWriterEndElement(mWriter) < 0 ? -3 : 0;
+}
+
+int CellmlWriter::declare(const std::string& prefix, const std::string& uri)
+{
+    std::string name = prefix.empty() ? "xmlns" : "xmlns:" + prefix;
+    if (xmlTextWriterWriteAttribute(mWriter, BAD_CAST name.c_str(), BAD_CAST uri.c_str()) < 0) return -1;
+    mBindings.push_back(Binding{prefix, uri});
+    return 0;
+}
+
+const std::string* CellmlWriter::lookup(const std::string& prefix) const
+{
+    for (auto b = mBindings.rbegin(); b != mBindings.rend(); ++b)
+    {
+        if (b->prefix == prefix) return &b->uri;
+    }
+    return NULL;
+}
+
+bool CellmlWriter::boundHere(const std::string& prefix) const
+{
+    for (size_t i = mScopes.back(); i < mBindings.size(); ++i)
+    {
+        if (mBindings[i].prefix == prefix) return true;
+    }
+    return false;
+}
+
+std::string CellmlWriter::prefixFor(const std::string& uri) const
+{
+    for (auto b = mBindings.rbegin(); b != mBindings.rend(); ++b)
+    {
+        // the binding mustn't have been hidden by a later declaration of the same prefix
+        if (!b->prefix.empty() && (b->uri == uri) && (*lookup(b->prefix) == uri)) return b->prefix;
+    }
+    return "";
+}
@@ -0,0 +1,80 @@
+#ifndef CELLMLWRITER_HPP
+#define CELLMLWRITER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libxml/tree.h>
+#include <libxml/xmlwriter.h>
+
+#include <cellml-api-cxx-support.hpp>
+#include <IfaceCellML_APISPEC.hxx>
+
+class XmlUtils;
+
+/**
+ * Writes a CellML 1.0 model built with the CellML API as UTF-8 text, using libxml2's xmlTextWriter. The model's
+ * DOM is walked node by node and written out as it goes, so no serialised copy of the whole document is built.
+ * Namespace declarations are worked out while writing: each namespace is declared where it is first needed, the
+ * declarations found in the model are kept, and the cellml prefix is always declared on the model element.
+ */
+class CellmlWriter
+{
+public:
+    /**
+     * @param output The string the model will be appended to.
+     */
+    explicit CellmlWriter(std::string& output);
+    ~CellmlWriter();
+
+    CellmlWriter(const CellmlWriter&) = delete;
+    CellmlWriter& operator=(const CellmlWriter&) = delete;
+
+    /**
+     * Write the given model.
+     * @param model The CellML 1.0 model to write.
+     * @param componentMath If given, math documents to write at the end of the component with the matching name,
+     * in addition to the math the component already has.
+     * @return zero on success.
+     */
+    int writeModel(iface::cellml_api::Model* model, std::map<std::wstring, XmlUtils>* componentMath = NULL);
+
+private:
+    struct Name
+    {
+        std::string prefix;
+        std::string uri;
+        std::string local;
+    };
+
+    struct Attribute
+    {
+        Name name;
+        std::string value;
+    };
+
+    struct Binding
+    {
+        std::string prefix;
+        std::string uri;
+    };
+
+    int writeDomNode(iface::dom::Node* node, std::map<std::wstring, XmlUtils>* componentMath);
+    int writeXmlNode(xmlNodePtr node);
+    int startElement(const Name& element, const std::vector<Binding>& declarations,
+                     const std::vector<Attribute>& attributes);
+    int endElement();
+    int declare(const std::string& prefix, const std::string& uri);
+    const std::string* lookup(const std::string& prefix) const;
+    bool boundHere(const std::string& prefix) const;
+    std::string prefixFor(const std::string& uri) const;
+
+    xmlTextWriterPtr mWriter;
+    // the namespaces in scope, innermost last, and where the bindings of each open element start.
+    std::vector<Binding> mBindings;
+    std::vector<size_t> mScopes;
+    bool mRootElement;
+};
+
+#endif // CELLMLWRITER_HPP
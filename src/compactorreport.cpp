@@ -1,8 +1,9 @@
 #include <sstream>
 
 #include "compactorreport.hpp"
+#include "utils.hpp"
 
-CompactorReport::CompactorReport()
+CompactorReport::CompactorReport() : mImportsInstantiated(0), mImportsSkipped(0)
 {
 }
 
@@ -39,21 +40,74 @@ void CompactorReport::setCompactedVariable(iface::cellml_api::CellMLVariable* va
     }
 }
 
+void CompactorReport::setCompactionFailure(iface::cellml_api::CellMLVariable* sourceVariable, int returnCode,
+                                           const std::wstring& message)
+{
+    for (const auto& f: mCompactionFailures)
+    {
+        if (f.sourceVariable == sourceVariable) return;
+    }
+    CompactionFailure failure;
+    failure.sourceVariable = sourceVariable;
+    failure.returnCode = returnCode;
+    failure.message = message;
+    mCompactionFailures.push_back(failure);
+}
+
+void CompactorReport::addCompactionFailureReferrer(iface::cellml_api::CellMLVariable* sourceVariable,
+                                                   iface::cellml_api::CellMLVariable* referrer)
+{
+    for (auto& f: mCompactionFailures)
+    {
+        if (f.sourceVariable == sourceVariable)
+        {
+            f.referrers.push_back(referrer);
+            return;
+        }
+    }
+}
+
+void CompactorReport::setCurrentSourceModelVariableFailed()
+{
+    if (mVariableForCompaction.size() > 0) mUncompactedVariables.push_back(mVariableForCompaction);
+    mVariableForCompaction.clear();
+}
+
+static std::wstring variableLabel(iface::cellml_api::CellMLVariable* variable)
+{
+    std::wstring label = variable->modelElement()->base_uri()->asText();
+    label += L" # ";
+    label += variable->componentName();
+    label += L" / ";
+    label += variable->name();
+    return label;
+}
+
 std::wstring CompactorReport::getReport() const
 {
     std::wstringstream report;
     report << L"Model Compaction Report\n"
            << L"=======================\n\n";
     if (! mErrorMessage.empty()) report << L"Error message: " << mErrorMessage << L"\n\n";
-    std::wstring indent = L"";
-    if (mVariableForCompaction.size() > 0)
+    if ((mImportsInstantiated + mImportsSkipped) > 0)
+    {
+        report << L"Imports instantiated: " << mImportsInstantiated << L"; imports not needed: "
+               << mImportsSkipped << L"\n\n";
+    }
+    std::vector<VariablePairVector> uncompacted = mUncompactedVariables;
+    if (mVariableForCompaction.size() > 0) uncompacted.push_back(mVariableForCompaction);
+    if (uncompacted.size() > 0)
     {
         report << L"Some variables have not been compacted.\n"
                << L"Uncompacted variables are given below.\n\n";
-        for (size_t i=0; i<mVariableForCompaction.size(); ++i)
+    }
+    for (const auto& variables: uncompacted)
+    {
+        std::wstring indent = L"";
+        for (size_t i=0; i<variables.size(); ++i)
         {
-            ObjRef<iface::cellml_api::CellMLVariable> variable = mVariableForCompaction[i].first;
-            ObjRef<iface::cellml_api::CellMLVariable> srcVariable = mVariableForCompaction[i].second;
+            ObjRef<iface::cellml_api::CellMLVariable> variable = variables[i].first;
+            ObjRef<iface::cellml_api::CellMLVariable> srcVariable = variables[i].second;
             std::wstring modelUri = variable->modelElement()->base_uri()->asText();
             std::wstring srcModelUri = srcVariable->modelElement()->base_uri()->asText();
             for (size_t j=0;j<i;++j) indent += L"\t";
@@ -62,7 +116,46 @@ std::wstring CompactorReport::getReport() const
                    << variable->name() << L";\n" << indent << L"with the actual source variable being: "
                    << srcModelUri << L" # " << srcVariable->componentName() << L" / " << srcVariable->name() << L"\n";
         }
+        report << L"\n";
+    }
+    if (mCompactionFailures.size() > 0)
+    {
+        report << L"Source variables which could not be compacted:\n\n";
+        for (const auto& f: mCompactionFailures)
+        {
+            report << variableLabel(f.sourceVariable) << L"\n\t" << f.message << L" (" << f.returnCode << L")\n";
+            report << L"\trequired by:\n";
+            for (const auto& r: f.referrers) report << L"\t\t" << variableLabel(r) << L"\n";
+        }
+        report << L"\n";
     }
     report.flush();
     return report.str();
 }
+
+static flattencellml::VariableReference variableReference(iface::cellml_api::CellMLVariable* variable)
+{
+    flattencellml::VariableReference reference;
+    reference.modelUri = wstring2string(variable->modelElement()->base_uri()->asText());
+    reference.component = wstring2string(variable->componentName());
+    reference.variable = wstring2string(variable->name());
+    return reference;
+}
+
+void CompactorReport::fillReport(flattencellml::Report& report) const
+{
+    report.errorMessage = wstring2string(mErrorMessage);
+    report.importsInstantiated = mImportsInstantiated;
+    report.importsSkipped = mImportsSkipped;
+    report.compactionFailures.clear();
+    for (const auto& f: mCompactionFailures)
+    {
+        flattencellml::CompactionFailure failure;
+        failure.sourceVariable = variableReference(f.sourceVariable);
+        failure.returnCode = f.returnCode;
+        failure.message = wstring2string(f.message);
+        for (const auto& r: f.referrers) failure.requiredBy.push_back(variableReference(r));
+        report.compactionFailures.push_back(failure);
+    }
+    report.text = wstring2string(getReport());
+}
@@ -7,6 +7,8 @@
 #include <IfaceCellML_APISPEC.hxx>
 #include <cellml-api-cxx-support.hpp>
 
+#include "flattencellml.hpp"
+
 typedef std::pair<ObjRef<iface::cellml_api::CellMLVariable>, ObjRef<iface::cellml_api::CellMLVariable> > VariablePair;
 typedef std::vector<ObjRef<iface::cellml_api::CellMLVariable> > VariableVector;
 typedef std::vector<VariablePair> VariablePairVector;
@@ -30,15 +32,67 @@ public:
         mErrorMessage = msg;
     }
 
+    /**
+     * Record that the given source variable could not be compacted. Only the first failure of a given source
+     * variable is recorded.
+     * @param sourceVariable The source variable that failed to compact.
+     * @param returnCode The error code of the failure.
+     * @param message A description of the failure.
+     */
+    void setCompactionFailure(iface::cellml_api::CellMLVariable* sourceVariable, int returnCode,
+                              const std::wstring& message);
+
+    /**
+     * Record that the given variable required the compaction of a source variable which failed to compact.
+     * @param sourceVariable The source variable that failed to compact.
+     * @param referrer The variable whose compaction needed the failed source variable.
+     */
+    void addCompactionFailureReferrer(iface::cellml_api::CellMLVariable* sourceVariable,
+                                      iface::cellml_api::CellMLVariable* referrer);
+
+    /**
+     * The compaction of the current source model variable has been abandoned, so set aside the variables that
+     * were waiting on it and start afresh with the next source model variable.
+     */
+    void setCurrentSourceModelVariableFailed();
+
+    /**
+     * Record how many of the source model's imports were needed for the compaction.
+     * @param instantiated The number of imports instantiated while compacting the model.
+     * @param skipped The number of imports that were never instantiated.
+     */
+    void setImportCounts(int instantiated, int skipped)
+    {
+        mImportsInstantiated = instantiated;
+        mImportsSkipped = skipped;
+    }
+
     std::wstring getReport() const;
 
+    /**
+     * Fill in the structured form of this report.
+     * @param report The report to fill in.
+     */
+    void fillReport(flattencellml::Report& report) const;
+
 private:
     ObjRef<iface::cellml_api::Model> mSourceModel;
     ObjRef<iface::cellml_api::CellMLVariable> mCurrentSourceModelVariable;
     VariablePairVector mVariableForCompaction; // first = variable requested, second = its source variable being compacted.
+    std::vector<VariablePairVector> mUncompactedVariables; // the abandoned mVariableForCompaction of failed variables.
+    struct CompactionFailure
+    {
+        ObjRef<iface::cellml_api::CellMLVariable> sourceVariable;
+        int returnCode;
+        std::wstring message;
+        VariableVector referrers;
+    };
+    std::vector<CompactionFailure> mCompactionFailures;
     VariablePairVectorMap mCompactedVariables;
     VariableVectorMap mCompactedDependencies;
     std::wstring mErrorMessage;
+    int mImportsInstantiated;
+    int mImportsSkipped;
 };
 
 #endif // COMPACTORREPORT_HPP
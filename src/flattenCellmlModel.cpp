@@ -2,110 +2,475 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <cstdlib>
+#include <sys/stat.h>
 
-#include <IfaceCellML_APISPEC.hxx>
-#include <cellml-api-cxx-support.hpp>
-#include <CellMLBootstrap.hpp>
-
+#include "flattencellml.hpp"
 #include "utils.hpp"
-#include "VersionConverter.hpp"
-#include "ModelCompactor.hpp"
-#include "compactorreport.hpp"
-
-// Save typing
-namespace cml = iface::cellml_api;
+#include "outputcache.hpp"
+#include "workerpool.hpp"
+#include "flatteningserver.hpp"
 
 static void usage(const char* progName)
 {
-    std::cerr << "Usage: " << progName << " <model | variables> <modelURL> [output file]" << std::endl;
+    std::cerr << "Usage: " << progName << " [options] <model | variables> <modelURL> [output file]" << std::endl;
+    std::cerr << "       " << progName << " [options] batch <manifest file>" << std::endl;
+    std::cerr << "       " << progName << " [options] serve <socket path>" << std::endl;
     std::cerr << "The first argument defines the flattening mode.\n";
     std::cerr << "  model:      flattens the model maintaining the modular structure.\n";
     std::cerr << "  variables:  create a single component defining all the variables\n"
                  "              specified in the top level of the given model.\n";
+    std::cerr << "  batch:      flatten all the models listed in the manifest file, one model per line\n"
+                 "              given as: <model | variables> <modelURL> <output file>\n"
+                 "              Blank lines and lines starting with # are ignored.\n";
+    std::cerr << "  serve:      listen for flattening requests on the given Unix domain socket, keeping\n"
+                 "              loaded imports between requests.\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  --import-cache <directory>  keep the documents used by imports in the given directory\n"
+                 "                              so that they don't need to be fetched again.\n";
+    std::cerr << "  --compress-import-cache     store new import cache entries zlib compressed.\n";
+    std::cerr << "  --import-cache-max-age <s>  fetch cached remote documents again once they are <s> seconds\n"
+                 "                              old, 0 to refresh them all. Defaults to one day.\n";
+    std::cerr << "  --output-cache <directory>  keep flattened models in the given directory, and reuse them\n"
+                 "                              when the model and its imports have not changed.\n";
+    std::cerr << "  --jobs <n>                  flatten the models in a batch, or compact the shards of a\n"
+                 "                              model, using <n> worker processes.\n";
+    std::cerr << "  --shards <n>                variables mode: split the model into <n> shards, compact them\n"
+                 "                              in the worker processes and merge the results.\n";
+    std::cerr << "  --threads <n>               use <n> threads, in addition to the main thread, to work on\n"
+                 "                              the math when compacting a model. Defaults to one less than\n"
+                 "                              the number of cores, or none when running several jobs.\n";
     std::cerr << std::endl;
 }
 
-int main(int argc, char* argv[])
+/**
+ * Write out the flattened model and the report.
+ * @param content The UTF-8 flattened model.
+ * @param reportString The UTF-8 flattening report.
+ * @param outputFileName The file to write the model to, or NULL to write it to standard output.
+ * @return zero on success.
+ */
+static int writeOutput(const std::string& content, const std::string& reportString, const char* outputFileName)
 {
-    // We should have a model URI in argv[2]
-    if (argc < 3)
+    int returnCode = 0;
+    if (outputFileName != NULL)
     {
-        usage(argv[0]);
-        return -1;
+        std::ofstream out(outputFileName, std::ios::out | std::ios::binary);
+        out << content;
+        if (out.fail())
+        {
+            std::wcerr << "Failed to write to given output file" << std::endl;
+            returnCode = 3;
+        }
+        out.close();
     }
-    std::string mode(argv[1]);
-    std::wstring model_url = string2wstring(argv[2]);
-    const char* output_file_name = NULL;
-    if (argc == 4)
+    else
     {
-        output_file_name = argv[3];
+        // Write to stdout
+        std::wcout << string2wstring(content);
     }
+    if (! reportString.empty()) std::wcout << string2wstring(reportString) << std::endl;
+    return returnCode;
+}
+
+/**
+ * The options given on the command line which apply to every model flattened.
+ */
+struct FlatteningOptions
+{
+    std::string importCacheDirectory;
+    bool compressImportCache;
+    int64_t importCacheMaxAge; // negative for the default
+    std::string outputCacheDirectory;
+    int jobs;
+    int threads; // negative for the default
+    int shards;
+};
+
+/**
+ * Create the flattener used by this process.
+ * @param options The command line options.
+ * @param flattener Will be set to the new flattener.
+ * @return zero on success.
+ */
+static int createFlattener(const FlatteningOptions& options, std::unique_ptr<flattencellml::Flattener>& flattener)
+{
+    flattener.reset(new flattencellml::Flattener());
+    if (! options.importCacheDirectory.empty())
+    {
+        if (flattener->setImportCacheDirectory(options.importCacheDirectory, options.compressImportCache) != 0)
+        {
+            flattener.reset();
+            return -3;
+        }
+        if (options.importCacheMaxAge >= 0) flattener->setImportCacheMaxAge(options.importCacheMaxAge);
+    }
+    // worker processes already keep the cores busy
+    if (options.threads >= 0) flattener->setThreads(options.threads);
+    else if ((options.jobs > 1) || (options.shards > 1)) flattener->setThreads(0);
+    return 0;
+}
+
+/**
+ * Flatten a single model.
+ * @param options The command line options.
+ * @param flattener The shared flattener. It will be created if needed, which is only when the model is not found in
+ * the output cache.
+ * @param mode The flattening mode.
+ * @param modelUrl The URL of the model to flatten, or the base URI of the model text.
+ * @param modelText If not empty, the model to flatten instead of loading it from the URL.
+ * @param content Will be set to the UTF-8 flattened model.
+ * @param reportString Will be set to the UTF-8 flattening report, which is also given when flattening fails.
+ * @param fromCache Will be set to true if the flattened model came from the output cache.
+ * @return zero on success.
+ */
+static int flattenToString(const FlatteningOptions& options, std::unique_ptr<flattencellml::Flattener>& flattener,
+                           const std::string& mode, const std::string& modelUrl, const std::string& modelText,
+                           std::string& content, std::string& reportString, bool* fromCache)
+{
+    *fromCache = false;
     if (!((mode == "model") || (mode == "variables")))
     {
         std::cerr << "A flattening mode of either \"model\" or \"variables\" is required." << std::endl;
-        usage(argv[0]);
         return -2;
     }
-    // Bootstrap the API
-    ObjRef<cml::CellMLBootstrap> cbs = CreateCellMLBootstrap();
-    // Get a model loader
-    ObjRef<cml::DOMModelLoader> ml = cbs->modelLoader();
-    // Load the model
-    ObjRef<cml::Model> model;
-    try
-    {
-        model = ml->loadFromURL(model_url.c_str());
-        if (mode == "model") model->fullyInstantiateImports(); // Make sure we have all of it
-    }
-    catch (cml::CellMLException& e)
-    {
-        // Work around CORBA deficiencies to get the error message
-        std::wstring msg = ml->lastErrorMessage();
-        printf("Error loading model: %S\n", msg.c_str());
-        return 1;
-    }
-    // Print the model's name & id to indicate successful load
-    std::wstring model_id = model->cmetaId();
-    std::wstring model_name = model->name();
-    std::wcout << "Loaded model '" << model_name.c_str() << "' id '" << model_id.c_str();
-    if (mode == "model") std::wcout << "' with all imports." << std::endl;
-    else std::wcout << "'." << std::endl;
+    // check for an up to date flattened model before going anywhere near the CellML API
+    OutputCache outputCache;
+    if ((! options.outputCacheDirectory.empty()) && modelText.empty())
+    {
+        if (outputCache.setCacheDirectory(options.outputCacheDirectory) != 0) return -3;
+        if ((outputCache.computeKey(modelUrl, mode) == 0) && (outputCache.lookup(content, reportString) == 0))
+        {
+            std::wcout << L"Using the cached flattened model." << std::endl;
+            *fromCache = true;
+            return 0;
+        }
+    }
+    if ((! flattener) && (createFlattener(options, flattener) != 0)) return -3;
+    flattencellml::Report report;
+    int returnCode = flattener->flatten(mode == "model" ? flattencellml::Mode::Model : flattencellml::Mode::Variables,
+                                        modelText, modelUrl, content, report);
+    reportString = report.text;
+    if (returnCode != 0)
+    {
+        if (! report.errorMessage.empty()) std::cerr << report.errorMessage << std::endl;
+        if (returnCode == 2) std::cerr << "Something went wrong!" << std::endl;
+        return returnCode;
+    }
+    outputCache.store(content, reportString);
+    return 0;
+}
 
-    // Now we can do stuff
-    CompactorReport report;
-    ObjRef<cml::Model> new_model;
-    if (mode == "model") new_model = flattenModel(model);
-    else new_model = compactModel(model, report);
+/**
+ * Flatten a single model and write out the result.
+ * @param options The command line options.
+ * @param flattener The shared flattener, created if needed.
+ * @param mode The flattening mode.
+ * @param modelUrl The URL of the model to flatten.
+ * @param outputFileName The file to write the flattened model to, or NULL to write it to standard output.
+ * @param fromCache Will be set to true if the flattened model came from the output cache.
+ * @return zero on success.
+ */
+static int flattenCellmlModel(const FlatteningOptions& options, std::unique_ptr<flattencellml::Flattener>& flattener,
+                              const std::string& mode, const std::string& modelUrl, const char* outputFileName,
+                              bool* fromCache)
+{
+    std::string content, reportString;
+    int returnCode = flattenToString(options, flattener, mode, modelUrl, "", content, reportString, fromCache);
+    if (returnCode == 0) return writeOutput(content, reportString, outputFileName);
+    if (! reportString.empty()) std::wcout << string2wstring(reportString) << std::endl;
+    return returnCode;
+}
 
-    if (new_model == NULL)
+/**
+ * Compact a single model in shards, each shard compacted by its own worker process, and merge the compacted
+ * shards into the compacted model.
+ * @param options The command line options.
+ * @param modelUrl The URL of the model to compact.
+ * @param outputFileName The file to write the compacted model to, or NULL to write it to standard output.
+ * @return zero on success.
+ */
+static int compactInShards(const FlatteningOptions& options, const std::string& modelUrl, const char* outputFileName)
+{
+    // sharded output is put together differently, and depends on the number of shards, so is cached separately
+    const std::string cacheMode = "variables shards=" + std::to_string(options.shards);
+    std::string content, reportString;
+    OutputCache outputCache;
+    if (! options.outputCacheDirectory.empty())
+    {
+        if (outputCache.setCacheDirectory(options.outputCacheDirectory) != 0) return -3;
+        if ((outputCache.computeKey(modelUrl, cacheMode) == 0) && (outputCache.lookup(content, reportString) == 0))
+        {
+            std::wcout << L"Using the cached flattened model." << std::endl;
+            return writeOutput(content, reportString, outputFileName);
+        }
+    }
+    // only the top-level model is needed to plan the shards, so this is quick
+    std::unique_ptr<flattencellml::Flattener> planner;
+    if (createFlattener(options, planner) != 0) return -3;
+    flattencellml::Report report;
+    std::vector<std::vector<std::string> > shards;
+    if (planner->planShards("", modelUrl, options.shards, shards, report) != 0)
+    {
+        std::cerr << report.errorMessage << std::endl;
+        return report.returnCode;
+    }
+    std::wcout << L"Compacting the model in " << shards.size() << L" shards." << std::endl;
+    // hand out the biggest shards first
+    std::vector<size_t> order(shards.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&shards](size_t a, size_t b) {
+        return shards[a].size() > shards[b].size();
+    });
+    // runs in the worker processes, each of which creates its own flattener
+    std::unique_ptr<flattencellml::Flattener> flattener;
+    auto work = [&](size_t job) {
+        WorkerResult result;
+        auto start = std::chrono::steady_clock::now();
+        result.fromCache = false;
+        result.returnCode = flattener ? 0 : createFlattener(options, flattener);
+        if (result.returnCode == 0)
+        {
+            flattencellml::Report shardReport;
+            result.returnCode = flattener->compactShard("", modelUrl, shards[job], result.content, shardReport);
+            result.report = shardReport.text;
+            if (! shardReport.errorMessage.empty()) result.report = shardReport.errorMessage + "\n" + result.report;
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    };
+    // runs in this process as the shards are compacted
+    std::vector<std::string> shardOutputs(shards.size());
+    std::vector<std::string> shardReports(shards.size());
+    int failures = 0;
+    auto collect = [&](size_t job, const WorkerResult& result) {
+        std::wcout << L"Shard " << (job + 1) << L" of " << shards.size() << L" (" << shards[job].size()
+                   << L" components) ";
+        if (result.returnCode == 0) std::wcout << L"compacted in " << result.seconds << L"s." << std::endl;
+        else
+        {
+            std::wcout << L"failed (error " << result.returnCode << L")." << std::endl;
+            ++failures;
+        }
+        shardOutputs[job] = result.content;
+        shardReports[job] = result.report;
+    };
+    if (runWorkerPool(std::min(options.jobs, (int)shards.size()), order, work, collect) != 0) return -5;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        std::ostringstream header;
+        header << "Shard " << (i + 1) << " of " << shards.size() << "\n\n";
+        reportString += header.str() + shardReports[i];
+    }
+    if (failures > 0)
+    {
+        std::wcout << string2wstring(reportString) << std::endl;
+        std::cerr << "Unable to compact " << failures << " of the shards." << std::endl;
+        return 2;
+    }
+    if (flattencellml::mergeShards(shardOutputs, content) != 0)
     {
-        std::cerr << "Something went wrong!" << std::endl;
-        std::wstring reportString = report.getReport();
-        if (! reportString.empty()) std::wcout << reportString << std::endl;
+        std::cerr << "Unable to merge the compacted shards." << std::endl;
         return 2;
     }
+    if (! options.outputCacheDirectory.empty()) outputCache.store(content, reportString);
+    return writeOutput(content, reportString, outputFileName);
+}
+
+/**
+ * @param modelUrl The URL of a model.
+ * @return The size of the model's document if it is a local file, otherwise zero.
+ */
+static long modelSize(const std::string& modelUrl)
+{
+    std::string fileName;
+    if (urlToFileName(modelUrl, fileName) != 0) return 0;
+    struct stat info;
+    if (stat(fileName.c_str(), &info) != 0) return 0;
+    return info.st_size;
+}
 
-    // Print the model to file
-    std::wstring content = new_model->serialisedText();
-    if (output_file_name != NULL)
+/**
+ * Flatten all the models listed in the given manifest, sharing a single flattener. If more than one job is
+ * requested, the models are shared out between a pool of worker processes, each with its own flattener.
+ * @param options The command line options.
+ * @param manifestFileName The manifest file.
+ * @return zero if all the models were flattened successfully.
+ */
+static int flattenBatch(const FlatteningOptions& options, const char* manifestFileName)
+{
+    std::ifstream manifest(manifestFileName);
+    if (! manifest)
     {
-        std::wofstream out(output_file_name);
-        out << content.c_str();
-        if (out.fail())
+        std::cerr << "Unable to read the manifest file: " << manifestFileName << std::endl;
+        return -4;
+    }
+    struct BatchEntry
+    {
+        std::string mode, modelUrl, outputFileName;
+        int returnCode;
+        bool fromCache;
+        double seconds;
+    };
+    std::vector<BatchEntry> entries;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(manifest, line))
+    {
+        ++lineNumber;
+        std::istringstream fields(line);
+        BatchEntry entry;
+        entry.returnCode = -5;
+        entry.fromCache = false;
+        entry.seconds = 0.0;
+        if (!(fields >> entry.mode) || (entry.mode[0] == '#')) continue;
+        if (!(fields >> entry.modelUrl >> entry.outputFileName))
         {
-            std::wcerr << "Failed to write to given output file" << std::endl;
+            std::cerr << manifestFileName << ":" << lineNumber
+                      << ": expected <model | variables> <modelURL> <output file>" << std::endl;
+            return -4;
         }
-        out.close();
+        entries.push_back(entry);
+    }
+
+    std::unique_ptr<flattencellml::Flattener> flattener;
+    auto batchStart = std::chrono::steady_clock::now();
+    if (options.jobs > 1)
+    {
+        // hand out the largest models first, so a big model started last doesn't hold up the whole batch
+        std::vector<size_t> order(entries.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<long> sizes;
+        for (const auto& entry: entries) sizes.push_back(modelSize(entry.modelUrl));
+        std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+        // runs in the worker processes, each of which creates its own flattener on first use
+        auto work = [&](size_t job) {
+            const BatchEntry& entry = entries[job];
+            WorkerResult result;
+            auto start = std::chrono::steady_clock::now();
+            result.returnCode = flattenToString(options, flattener, entry.mode, entry.modelUrl, "", result.content,
+                                                result.report, &result.fromCache);
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        };
+        // runs in this process as the results come back
+        auto collect = [&](size_t job, const WorkerResult& result) {
+            BatchEntry& entry = entries[job];
+            entry.returnCode = result.returnCode;
+            entry.fromCache = result.fromCache;
+            entry.seconds = result.seconds;
+            if (entry.returnCode == 0)
+            {
+                entry.returnCode = writeOutput(result.content, result.report, entry.outputFileName.c_str());
+            }
+            else if (! result.report.empty()) std::wcout << string2wstring(result.report) << std::endl;
+        };
+        runWorkerPool(options.jobs, order, work, collect);
     }
     else
     {
-        // Write to stdout
-        std::wcout << content.c_str();
+        for (auto& entry: entries)
+        {
+            auto start = std::chrono::steady_clock::now();
+            entry.returnCode = flattenCellmlModel(options, flattener, entry.mode, entry.modelUrl,
+                                                  entry.outputFileName.c_str(), &entry.fromCache);
+            entry.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
     }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
 
-    std::wstring reportString = report.getReport();
-    if (! reportString.empty()) std::wcout << reportString << std::endl;
+    int failures = 0;
+    double totalSeconds = 0.0;
+    std::wcout << L"\nBatch Summary\n"
+               << L"=============\n\n";
+    for (const auto& entry: entries)
+    {
+        totalSeconds += entry.seconds;
+        if (entry.returnCode != 0) ++failures;
+        std::wstring status = entry.returnCode != 0 ? L"FAILED" : (entry.fromCache ? L"CACHED" : L"OK");
+        std::wcout << std::left << std::setw(8) << status << std::right << std::fixed << std::setprecision(3)
+                   << std::setw(10) << entry.seconds << L"s  " << string2wstring(entry.modelUrl);
+        if (entry.returnCode != 0) std::wcout << L" (error " << entry.returnCode << L")";
+        std::wcout << std::endl;
+    }
+    std::wcout << L"\n" << entries.size() << L" models, " << failures << L" failed, in "
+               << totalSeconds << L"s (" << wallSeconds << L"s elapsed)." << std::endl;
+    if (flattener) std::wcout << string2wstring(flattener->importReport()) << std::endl;
+    return failures > 0 ? 2 : 0;
+}
 
-    // and exit
-    return 0;
+/**
+ * Serve flattening requests on the given socket, sharing a single flattener across all requests.
+ * @param options The command line options.
+ * @param socketPath The Unix domain socket to listen on.
+ * @return zero when the server is shut down cleanly.
+ */
+static int flattenServer(const FlatteningOptions& options, const char* socketPath)
+{
+    std::unique_ptr<flattencellml::Flattener> flattener;
+    auto handler = [&](const FlatteningRequest& request, std::string& output, std::string& report) {
+        bool fromCache;
+        return flattenToString(options, flattener, request.mode, request.modelUrl, request.modelText, output,
+                               report, &fromCache);
+    };
+    return runFlatteningServer(socketPath, handler);
+}
+
+int main(int argc, char* argv[])
+{
+    int argi = 1;
+    FlatteningOptions options;
+    options.compressImportCache = false;
+    options.importCacheMaxAge = -1;
+    options.jobs = 1;
+    options.threads = -1;
+    options.shards = 1;
+    while ((argi < argc) && (strncmp(argv[argi], "--", 2) == 0))
+    {
+        std::string option(argv[argi++]);
+        if ((option == "--import-cache") && (argi < argc)) options.importCacheDirectory = argv[argi++];
+        else if (option == "--compress-import-cache") options.compressImportCache = true;
+        else if ((option == "--import-cache-max-age") && (argi < argc))
+        {
+            options.importCacheMaxAge = std::max(0LL, atoll(argv[argi++]));
+        }
+        else if ((option == "--output-cache") && (argi < argc)) options.outputCacheDirectory = argv[argi++];
+        else if ((option == "--jobs") && (argi < argc)) options.jobs = std::max(1, atoi(argv[argi++]));
+        else if ((option == "--shards") && (argi < argc)) options.shards = std::max(1, atoi(argv[argi++]));
+        else if ((option == "--threads") && (argi < argc)) options.threads = std::max(0, atoi(argv[argi++]));
+        else
+        {
+            std::cerr << "Unknown option: " << option << std::endl;
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    // We should have a mode and model URI (or manifest) left
+    if ((argc - argi) < 2)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    std::string mode(argv[argi]);
+    if (mode == "batch") return flattenBatch(options, argv[argi+1]);
+    if (mode == "serve") return flattenServer(options, argv[argi+1]);
+    const char* output_file_name = NULL;
+    if ((argc - argi) == 3)
+    {
+        output_file_name = argv[argi+2];
+    }
+    if ((mode == "variables") && (options.shards > 1)) return compactInShards(options, argv[argi+1], output_file_name);
+    std::unique_ptr<flattencellml::Flattener> flattener;
+    bool fromCache;
+    int returnCode = flattenCellmlModel(options, flattener, mode, argv[argi+1], output_file_name, &fromCache);
+    if (returnCode == -2) usage(argv[0]);
+    return returnCode;
 }
@@ -0,0 +1,197 @@
+#include <set>
+
+#include <IfaceCellML_APISPEC.hxx>
+#include <cellml-api-cxx-support.hpp>
+
+#include "flattencellml.hpp"
+#include "flatteningcontext.hpp"
+#include "VersionConverter.hpp"
+#include "cellmlwriter.hpp"
+#include "ModelCompactor.hpp"
+#include "compactorreport.hpp"
+#include "modelshards.hpp"
+#include "nativemodel.hpp"
+#include "streamconverter.hpp"
+#include "utils.hpp"
+
+// Save typing
+namespace cml = iface::cellml_api;
+
+namespace flattencellml
+{
+
+Flattener::Flattener(const ImportResolver& resolver) : mContext(new FlatteningContext())
+{
+    if (resolver) mContext->importCache().setResolver(resolver);
+}
+
+Flattener::~Flattener()
+{
+}
+
+int Flattener::setImportCacheDirectory(const std::string& directory, bool compress)
+{
+    return mContext->importCache().setCacheDirectory(directory, compress);
+}
+
+void Flattener::setImportCacheMaxAge(int64_t seconds)
+{
+    mContext->importCache().setMaxAge(seconds);
+}
+
+void Flattener::setThreads(int threads)
+{
+    mContext->setThreads(threads);
+}
+
+std::string Flattener::importReport() const
+{
+    return wstring2string(mContext->importCache().getReport());
+}
+
+/**
+ * Load the given model.
+ * @return The model, or NULL with the report filled in.
+ */
+static ObjRef<cml::Model> loadModel(FlatteningContext* context, const std::string& modelText,
+                                    const std::string& baseUri, Report& report)
+{
+    // Get a model loader
+    ObjRef<cml::DOMModelLoader> ml = context->cellmlBootstrap()->modelLoader();
+    // Load the model
+    ObjRef<cml::Model> model;
+    try
+    {
+        if (modelText.empty()) model = ml->loadFromURL(string2wstring(baseUri));
+        else
+        {
+            model = ml->createFromText(string2wstring(modelText));
+            ObjRef<cml::URI> modelBaseUri = model->base_uri();
+            modelBaseUri->asText(string2wstring(baseUri));
+        }
+    }
+    catch (cml::CellMLException& e)
+    {
+        // Work around CORBA deficiencies to get the error message
+        report.returnCode = 1;
+        report.errorMessage = "Error loading model: " + wstring2string(ml->lastErrorMessage());
+        return NULL;
+    }
+    return model;
+}
+
+int Flattener::flatten(Mode mode, const std::string& modelText, const std::string& baseUri, std::string& output,
+                       Report& report)
+{
+    return run(mode, modelText, baseUri, NULL, output, report);
+}
+
+int Flattener::planShards(const std::string& modelText, const std::string& baseUri, int shards,
+                          std::vector<std::vector<std::string> >& componentShards, Report& report)
+{
+    report = Report();
+    componentShards.clear();
+    mContext->importCache().startRun();
+    // only the structure of the model itself is needed, so there's no need for the CellML API
+    NativeModel model;
+    if (model.load(mContext->importCache(), modelText, baseUri) != 0)
+    {
+        report.returnCode = 1;
+        report.errorMessage = "Error loading model: " + baseUri;
+        return report.returnCode;
+    }
+    if (::planShards(model, shards, componentShards) != 0)
+    {
+        report.returnCode = 2;
+        report.errorMessage = "Unable to split the model into shards.";
+        return report.returnCode;
+    }
+    return 0;
+}
+
+int Flattener::compactShard(const std::string& modelText, const std::string& baseUri,
+                            const std::vector<std::string>& components, std::string& output, Report& report)
+{
+    return run(Mode::Variables, modelText, baseUri, &components, output, report);
+}
+
+int Flattener::run(Mode mode, const std::string& modelText, const std::string& baseUri,
+                   const std::vector<std::string>* components, std::string& output, Report& report)
+{
+    report = Report();
+    output.clear();
+    mContext->importCache().startRun();
+    // Models without imports only need their namespace changing, which doesn't need the CellML API
+    if ((mode == Mode::Model) && (streamConvertModel(modelText, baseUri, output) == 0))
+    {
+        report.text = "Converted model without imports to CellML 1.0 by streaming.\n";
+        return 0;
+    }
+    ObjRef<cml::Model> model = loadModel(mContext.get(), modelText, baseUri, report);
+    if (model == NULL) return report.returnCode;
+    // Report the model's name & id to indicate successful load
+    std::wstring model_id = model->cmetaId();
+    std::wstring model_name = model->name();
+    if ((mode == Mode::Model) && (mContext->importCache().instantiateAll(model) != 0)) // Make sure we have all of it
+    {
+        report.returnCode = 1;
+        report.errorMessage = "Error instantiating the imports of the model.";
+        return report.returnCode;
+    }
+    std::wstring loaded = L"Loaded model '" + model_name + L"' id '" + model_id;
+    loaded += (mode == Mode::Model) ? L"' with all imports.\n" : L"'.\n";
+
+    // Now we can do stuff
+    CompactorReport compactorReport;
+    int rc;
+    if (mode == Mode::Model)
+    {
+        ObjRef<cml::Model> new_model = ::flattenModel(model, mContext.get());
+        if (new_model == NULL) rc = -1;
+        else
+        {
+            CellmlWriter writer(output);
+            rc = writer.writeModel(new_model);
+        }
+    }
+    else if (components)
+    {
+        std::set<std::wstring> shardComponents;
+        for (const auto& c: *components) shardComponents.insert(string2wstring(c));
+        rc = ::compactModel(model, compactorReport, output, mContext.get(), &shardComponents);
+    }
+    else rc = ::compactModel(model, compactorReport, output, mContext.get());
+
+    // the library doesn't print anything, the messages go in the report for the caller to show
+    compactorReport.fillReport(report);
+    report.text = wstring2string(loaded) + report.text + wstring2string(mContext->importCache().getReport()) + "\n";
+    if (rc != 0)
+    {
+        output.clear();
+        report.returnCode = 2;
+        if (report.errorMessage.empty()) report.errorMessage = "Unable to flatten the model.";
+        return report.returnCode;
+    }
+    return 0;
+}
+
+int flattenModel(const std::string& modelText, const std::string& baseUri, const ImportResolver& resolver,
+                 std::string& output, Report& report)
+{
+    Flattener flattener(resolver);
+    return flattener.flatten(Mode::Model, modelText, baseUri, output, report);
+}
+
+int compactModel(const std::string& modelText, const std::string& baseUri, const ImportResolver& resolver,
+                 std::string& output, Report& report)
+{
+    Flattener flattener(resolver);
+    return flattener.flatten(Mode::Variables, modelText, baseUri, output, report);
+}
+
+int mergeShards(const std::vector<std::string>& shardOutputs, std::string& output)
+{
+    return ::mergeShards(shardOutputs, output);
+}
+
+} // namespace flattencellml
@@ -0,0 +1,193 @@
+#ifndef FLATTENCELLML_HPP
+#define FLATTENCELLML_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+class FlatteningContext;
+
+/**
+ * The public interface of the flattencellml library: flatten CellML 1.1 models held in memory into CellML 1.0.
+ * All text passed to and returned from the library is UTF-8.
+ */
+namespace flattencellml
+{
+
+/**
+ * Fetch the document needed by an import.
+ * @param url The absolute URL of the imported document (resolved against the importing model's base URI).
+ * @param content Should be set to the UTF-8 content of the document.
+ * @return true if the document was found.
+ */
+typedef std::function<bool(const std::string& url, std::string& content)> ImportResolver;
+
+enum class Mode
+{
+    Model,     ///< flatten the model, keeping its modular structure
+    Variables  ///< compact the model into a single component defining all the top-level variables
+};
+
+/**
+ * A variable in one of the source models.
+ */
+struct VariableReference
+{
+    std::string modelUri;
+    std::string component;
+    std::string variable;
+};
+
+/**
+ * A source variable which could not be compacted.
+ */
+struct CompactionFailure
+{
+    VariableReference sourceVariable;
+    int returnCode;
+    std::string message;
+    std::vector<VariableReference> requiredBy;
+};
+
+/**
+ * What happened while flattening a model.
+ */
+struct Report
+{
+    int returnCode = 0;          ///< zero on success
+    std::string errorMessage;    ///< set if the model could not be loaded or flattened
+    int importsInstantiated = 0; ///< variables mode: the imports needed by the compaction
+    int importsSkipped = 0;      ///< variables mode: the imports the compaction did not need
+    std::vector<CompactionFailure> compactionFailures;
+    std::string text;            ///< the human readable report, including the messages logged while flattening
+};
+
+/**
+ * Flattens models, keeping the CellML API bootstraps and the loaded import documents between models. A
+ * Flattener must only be used by one thread at a time, but Flatteners share no state with each other, so models
+ * can be flattened concurrently by giving each thread its own Flattener.
+ */
+class Flattener
+{
+public:
+    /**
+     * @param resolver If given, used to fetch all imported documents. Otherwise imports are loaded from their URLs.
+     */
+    explicit Flattener(const ImportResolver& resolver = ImportResolver());
+    ~Flattener();
+
+    Flattener(const Flattener&) = delete;
+    Flattener& operator=(const Flattener&) = delete;
+
+    /**
+     * Keep the imported documents fetched from remote URLs in the given directory between runs.
+     * @param directory The cache directory.
+     * @param compress If true, new cache entries are stored zlib compressed.
+     * @return zero on success.
+     */
+    int setImportCacheDirectory(const std::string& directory, bool compress);
+
+    /**
+     * Set how long documents fetched from remote URLs are kept in the import cache directory before they are
+     * fetched again. If fetching a document again fails, the expired copy is used.
+     * @param seconds The maximum age, zero to always fetch documents again (refreshing the cache), negative for
+     * documents to never expire. Defaults to one day.
+     */
+    void setImportCacheMaxAge(int64_t seconds);
+
+    /**
+     * Set the number of threads used to work on the math of a model while it is being compacted, in addition to
+     * the calling thread. By default there is one thread less than the number of cores.
+     * @param threads The number of threads, zero to do all the work on the calling thread.
+     */
+    void setThreads(int threads);
+
+    /**
+     * Flatten the given model.
+     * @param mode The flattening mode.
+     * @param modelText The model to flatten. If empty, the model is loaded from baseUri instead.
+     * @param baseUri The URI of the model, used to resolve its imports.
+     * @param output Will be set to the flattened model.
+     * @param report Will be filled in with the details of the flattening, including on failure.
+     * @return zero on success.
+     */
+    int flatten(Mode mode, const std::string& modelText, const std::string& baseUri, std::string& output,
+                Report& report);
+
+    /**
+     * Split the top-level components of the given model into shards which can be compacted independently, keeping
+     * connected components together where possible.
+     * @param modelText The model to split. If empty, the model is loaded from baseUri instead.
+     * @param baseUri The URI of the model.
+     * @param shards The number of shards wanted.
+     * @param componentShards Will be set to the names of the components in each shard, there may be fewer shards
+     * than asked for.
+     * @param report Will be filled in with the details of any failure.
+     * @return zero on success.
+     */
+    int planShards(const std::string& modelText, const std::string& baseUri, int shards,
+                   std::vector<std::vector<std::string> >& componentShards, Report& report);
+
+    /**
+     * Compact the variables of the given top-level components of a model. The compacted shards of a model are
+     * combined with mergeShards.
+     * @param modelText The model to compact. If empty, the model is loaded from baseUri instead.
+     * @param baseUri The URI of the model, used to resolve its imports.
+     * @param components The names of the components in the shard.
+     * @param output Will be set to the compacted shard.
+     * @param report Will be filled in with the details of the compaction, including on failure.
+     * @return zero on success.
+     */
+    int compactShard(const std::string& modelText, const std::string& baseUri,
+                     const std::vector<std::string>& components, std::string& output, Report& report);
+
+    /**
+     * @return A summary of how the imported documents were obtained.
+     */
+    std::string importReport() const;
+
+private:
+    int run(Mode mode, const std::string& modelText, const std::string& baseUri,
+            const std::vector<std::string>* components, std::string& output, Report& report);
+
+    std::unique_ptr<FlatteningContext> mContext;
+};
+
+/**
+ * Flatten the given model into a CellML 1.0 model, keeping its modular structure.
+ * @param modelText The model to flatten.
+ * @param baseUri The URI of the model, used to resolve its imports.
+ * @param resolver If given, used to fetch all imported documents.
+ * @param output Will be set to the flattened model.
+ * @param report Will be filled in with the details of the flattening.
+ * @return zero on success.
+ */
+int flattenModel(const std::string& modelText, const std::string& baseUri, const ImportResolver& resolver,
+                 std::string& output, Report& report);
+
+/**
+ * Compact the given model into a CellML 1.0 model defining all its top-level variables in a single component.
+ * @param modelText The model to compact.
+ * @param baseUri The URI of the model, used to resolve its imports.
+ * @param resolver If given, used to fetch all imported documents.
+ * @param output Will be set to the compacted model.
+ * @param report Will be filled in with the details of the compaction.
+ * @return zero on success.
+ */
+int compactModel(const std::string& modelText, const std::string& baseUri, const ImportResolver& resolver,
+                 std::string& output, Report& report);
+
+/**
+ * Merge the compacted shards of a model into a single compacted model, keeping only one copy of the variables,
+ * units and equations compacted in more than one shard.
+ * @param shardOutputs The compacted shards, from Flattener::compactShard.
+ * @param output Will be set to the compacted model.
+ * @return zero on success.
+ */
+int mergeShards(const std::vector<std::string>& shardOutputs, std::string& output);
+
+} // namespace flattencellml
+
+#endif // FLATTENCELLML_HPP
@@ -0,0 +1,12 @@
+#include <CellMLBootstrap.hpp>
+#include <CUSESBootstrap.hpp>
+#include <CeVASBootstrap.hpp>
+
+#include "flatteningcontext.hpp"
+
+FlatteningContext::FlatteningContext() :
+    mCellmlBootstrap(CreateCellMLBootstrap()), mCusesBootstrap(CreateCUSESBootstrap()),
+    mCevasBootstrap(CreateCeVASBootstrap()), mImportCache(mCellmlBootstrap),
+    mThreadPool(new ThreadPool(ThreadPool::defaultThreads()))
+{
+}
@@ -0,0 +1,66 @@
+#ifndef FLATTENINGCONTEXT_HPP
+#define FLATTENINGCONTEXT_HPP
+
+#include <cellml-api-cxx-support.hpp>
+#include <IfaceCellML_APISPEC.hxx>
+#include <IfaceCUSES.hxx>
+#include <IfaceCeVAS.hxx>
+
+#include <memory>
+
+#include "importcache.hpp"
+#include "threadpool.hpp"
+
+/**
+ * The services shared by all the models flattened by one Flattener: the CellML API bootstraps, the import document
+ * cache and the threads used to work on the math while compacting. Each Flattener owns its context, so flattening
+ * several models with the same Flattener doesn't re-create the bootstraps or re-load shared imports.
+ */
+class FlatteningContext
+{
+public:
+    FlatteningContext();
+
+    iface::cellml_api::CellMLBootstrap* cellmlBootstrap()
+    {
+        return mCellmlBootstrap;
+    }
+
+    iface::cellml_services::CUSESBootstrap* cusesBootstrap()
+    {
+        return mCusesBootstrap;
+    }
+
+    iface::cellml_services::CeVASBootstrap* cevasBootstrap()
+    {
+        return mCevasBootstrap;
+    }
+
+    ImportCache& importCache()
+    {
+        return mImportCache;
+    }
+
+    ThreadPool& threadPool()
+    {
+        return *mThreadPool;
+    }
+
+    /**
+     * Replace the thread pool with one using the given number of threads.
+     * @param threads The number of threads, zero to do all the work on the calling thread.
+     */
+    void setThreads(int threads)
+    {
+        mThreadPool.reset(new ThreadPool(threads));
+    }
+
+private:
+    ObjRef<iface::cellml_api::CellMLBootstrap> mCellmlBootstrap;
+    ObjRef<iface::cellml_services::CUSESBootstrap> mCusesBootstrap;
+    ObjRef<iface::cellml_services::CeVASBootstrap> mCevasBootstrap;
+    ImportCache mImportCache;
+    std::unique_ptr<ThreadPool> mThreadPool;
+};
+
+#endif // FLATTENINGCONTEXT_HPP
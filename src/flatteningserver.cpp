@@ -0,0 +1,245 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#  include <signal.h>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/time.h>
+#  include <sys/un.h>
+#endif
+
+#include "flatteningserver.hpp"
+#include "utils.hpp"
+
+#ifndef _WIN32
+
+// how long a client can leave the server waiting, and the largest lines and model text accepted from it
+static const int CLIENT_TIMEOUT_SECONDS = 30;
+static const size_t MAX_LINE_SIZE = 64 * 1024;
+static const size_t MAX_MODEL_TEXT_SIZE = 256 * 1024 * 1024;
+
+/**
+ * Buffered reading of lines and byte blocks from a client connection.
+ */
+class Connection
+{
+public:
+    explicit Connection(int fd) : mFd(fd)
+    {
+    }
+
+    bool readLine(std::string& line)
+    {
+        while (true)
+        {
+            size_t eol = mBuffer.find('\n');
+            if (eol != std::string::npos)
+            {
+                line = mBuffer.substr(0, eol);
+                mBuffer.erase(0, eol + 1);
+                return true;
+            }
+            if (mBuffer.size() > MAX_LINE_SIZE) return false;
+            if (! fill()) return false;
+        }
+    }
+
+    bool readBytes(size_t size, std::string& bytes)
+    {
+        while (mBuffer.size() < size)
+        {
+            if (! fill()) return false;
+        }
+        bytes = mBuffer.substr(0, size);
+        mBuffer.erase(0, size);
+        return true;
+    }
+
+    bool write(const std::string& data)
+    {
+        const char* p = data.data();
+        size_t size = data.size();
+        while (size > 0)
+        {
+            ssize_t n = ::write(mFd, p, size);
+            if (n < 0)
+            {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+private:
+    bool fill()
+    {
+        char buffer[65536];
+        while (true)
+        {
+            ssize_t n = read(mFd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            // includes the client timing out
+            if (n <= 0) return false;
+            mBuffer.append(buffer, n);
+            return true;
+        }
+    }
+
+    int mFd;
+    std::string mBuffer;
+};
+
+/**
+ * Handle the requests on a client connection until the client goes away.
+ * @return true if the client asked for the server to shut down.
+ */
+static bool serveClient(int fd, const FlatteningHandler& handler)
+{
+    Connection connection(fd);
+    FlatteningRequest request;
+    std::string line;
+    while (connection.readLine(line))
+    {
+        std::string keyword = line.substr(0, line.find(' '));
+        std::string value = (line.size() > keyword.size()) ? line.substr(keyword.size() + 1) : "";
+        if (keyword == "mode") request.mode = value;
+        else if (keyword == "url") request.modelUrl = value;
+        else if (keyword == "text")
+        {
+            size_t size = strtoul(value.c_str(), NULL, 10);
+            if (size > MAX_MODEL_TEXT_SIZE)
+            {
+                std::cerr << "Model text too large in flattening request: " << size << " bytes" << std::endl;
+                return false;
+            }
+            if (! connection.readBytes(size, request.modelText)) return false;
+        }
+        else if (keyword == "shutdown") return true;
+        else if (keyword == "end")
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::string output, report;
+            int returnCode = handler(request, output, report);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::wcout << L"Flattened " << string2wstring(request.modelUrl) << L" (" << string2wstring(request.mode)
+                       << L"): status " << returnCode << L" in " << ms << L" ms" << std::endl;
+            std::ostringstream response;
+            response << "status " << returnCode << "\n"
+                     << "output " << output.size() << "\n" << output
+                     << "report " << report.size() << "\n" << report;
+            if (! connection.write(response.str())) return false;
+            request = FlatteningRequest();
+        }
+        else
+        {
+            std::cerr << "Unexpected line in flattening request: " << line << std::endl;
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Only serve clients running as the same user as the server, and don't let them keep the server waiting.
+ * @return true if the client can be served.
+ */
+static bool acceptClient(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) || (credentials.uid != geteuid()))
+    {
+        return false;
+    }
+#else
+    uid_t uid;
+    gid_t gid;
+    if ((getpeereid(fd, &uid, &gid) != 0) || (uid != geteuid())) return false;
+#endif
+    struct timeval timeout;
+    timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    return (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0)
+            && (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0);
+}
+
+int runFlatteningServer(const std::string& socketPath, const FlatteningHandler& handler)
+{
+    // a client going away mid-response should not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "The socket path is too long: " << socketPath << std::endl;
+        return -1;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0)
+    {
+        std::cerr << "Unable to create the server socket." << std::endl;
+        return -2;
+    }
+    // only replace a socket left behind by an earlier server, never any other kind of file
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0)
+    {
+        if (! S_ISSOCK(existing.st_mode))
+        {
+            std::cerr << "Not replacing a file which is not a socket: " << socketPath << std::endl;
+            close(server);
+            return -3;
+        }
+        unlink(socketPath.c_str());
+    }
+    // the socket is only accessible to this user from the moment it is created
+    mode_t mask = umask(0077);
+    int bound = bind(server, (struct sockaddr*)&address, sizeof(address));
+    umask(mask);
+    if ((bound != 0) || (chmod(socketPath.c_str(), 0600) != 0) || (listen(server, 16) != 0))
+    {
+        std::cerr << "Unable to listen on the socket: " << socketPath << std::endl;
+        close(server);
+        return -3;
+    }
+    std::wcout << L"Listening for flattening requests on " << string2wstring(socketPath) << std::endl;
+    bool shutdown = false;
+    while (! shutdown)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+            std::cerr << "Unable to accept connections on the socket." << std::endl;
+            break;
+        }
+        if (acceptClient(client)) shutdown = serveClient(client, handler);
+        else std::cerr << "Refused a connection from a client of another user." << std::endl;
+        close(client);
+    }
+    close(server);
+    unlink(socketPath.c_str());
+    return shutdown ? 0 : -4;
+}
+
+#else
+
+int runFlatteningServer(const std::string&, const FlatteningHandler&)
+{
+    std::cerr << "The flattening server is not available on Windows." << std::endl;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef FLATTENINGSERVER_HPP
+#define FLATTENINGSERVER_HPP
+
+#include <string>
+#include <functional>
+
+/**
+ * A request to flatten a model, as received by the flattening server.
+ */
+struct FlatteningRequest
+{
+    std::string mode;      // model or variables
+    std::string modelUrl;  // the model to load, or the base URI of modelText
+    std::string modelText; // if not empty, the model itself
+};
+
+typedef std::function<int(const FlatteningRequest& request, std::string& output, std::string& report)>
+    FlatteningHandler;
+
+/**
+ * Listen for flattening requests on a Unix domain socket, handling them one at a time with the given handler.
+ * Each connection may send any number of requests, each made up of lines:
+ *
+ *     mode <model | variables>
+ *     url <model URL, or the base URI for inline text>
+ *     text <byte count>          (optional, followed by exactly that many bytes of model text)
+ *     end
+ *
+ * and each request is answered with:
+ *
+ *     status <return code>
+ *     output <byte count>
+ *     <the flattened model>
+ *     report <byte count>
+ *     <the report>
+ *
+ * A line "shutdown" stops the server. The socket is only accessible to the user running the server, and
+ * connections from other users are refused. A client which sends nothing for 30 seconds, a line longer than 64 KiB
+ * or model text larger than 256 MiB is disconnected. Not available on Windows.
+ * @param socketPath The path of the socket to listen on. A socket left at that path is replaced, but any other
+ * kind of file there stops the server from starting.
+ * @param handler The function which flattens a model, returning zero on success.
+ * @return zero when the server is shut down, non-zero if it could not be started.
+ */
+int runFlatteningServer(const std::string& socketPath, const FlatteningHandler& handler);
+
+#endif // FLATTENINGSERVER_HPP
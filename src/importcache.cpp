@@ -0,0 +1,261 @@
+#include <iostream>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <ctime>
+
+#include <zlib.h>
+
+#include "importcache.hpp"
+#include "utils.hpp"
+
+static std::wstring normaliseUrl(const std::wstring& url)
+{
+    // the fragment identifier doesn't change the document
+    return url.substr(0, url.find(L'#'));
+}
+
+static bool isLocalUrl(const std::wstring& url)
+{
+    return url.compare(0, 5, L"file:") == 0;
+}
+
+// the largest document the cache will hold, and the best ratio zlib can compress to
+static const uLongf MAX_DOCUMENT_SIZE = 256 * 1024 * 1024;
+static const uLongf MAX_COMPRESSION_RATIO = 1032;
+
+ImportCache::ImportCache(iface::cellml_api::CellMLBootstrap* bootstrap) :
+    mBootstrap(bootstrap), mCompress(false), mMaxAge(DEFAULT_MAX_AGE), mRun(0), mMemoryHits(0), mDiskHits(0),
+    mMisses(0)
+{
+}
+
+int ImportCache::setCacheDirectory(const std::string& directory, bool compress)
+{
+    if (makeDirectory(directory) != 0)
+    {
+        std::cerr << "Unable to create the import cache directory: " << directory << std::endl;
+        return -1;
+    }
+    mDirectory = directory;
+    mCompress = compress;
+    return 0;
+}
+
+int ImportCache::instantiate(iface::cellml_api::CellMLImport* import)
+{
+    if (import->wasInstantiated()) return 0;
+    ObjRef<iface::cellml_api::Model> model = import->modelElement();
+    ObjRef<iface::cellml_api::URI> baseUri = model->base_uri();
+    ObjRef<iface::cellml_api::URI> href = import->xlinkHref();
+    std::wstring url = normaliseUrl(mBootstrap->makeURLAbsolute(baseUri->asText(), href->asText()));
+    std::string content;
+    if (getDocument(url, content) != 0) return -1;
+    try
+    {
+        import->instantiateFromText(string2wstring(content));
+    }
+    catch (...)
+    {
+        std::wcerr << L"ERROR: unable to instantiate the import from the document: " << url << std::endl;
+        return -2;
+    }
+    // make sure relative imports in the imported model are resolved against its own location
+    ObjRef<iface::cellml_api::Model> importedModel = import->importedModel();
+    ObjRef<iface::cellml_api::URI> importedBaseUri = importedModel->base_uri();
+    importedBaseUri->asText(url);
+    return 0;
+}
+
+int ImportCache::instantiateAll(iface::cellml_api::Model* model)
+{
+    ObjRef<iface::cellml_api::CellMLImportSet> imports = model->imports();
+    ObjRef<iface::cellml_api::CellMLImportIterator> ii = imports->iterateImports();
+    while (true)
+    {
+        ObjRef<iface::cellml_api::CellMLImport> import = ii->nextImport();
+        if (import == NULL) break;
+        if (instantiate(import) != 0) return -1;
+        ObjRef<iface::cellml_api::Model> importedModel = import->importedModel();
+        if (instantiateAll(importedModel) != 0) return -1;
+    }
+    return 0;
+}
+
+int ImportCache::getDocument(const std::wstring& url, std::string& content)
+{
+    bool local = isLocalUrl(url);
+    uint64_t stamp = 0;
+    std::string fileName;
+    if (local && (urlToFileName(wstring2string(url), fileName) == 0)) stamp = fileStamp(fileName);
+    auto document = mDocuments.find(url);
+    if (document != mDocuments.end())
+    {
+        Document& d = document->second;
+        bool current = local ? (d.stamp == stamp) : ((d.run == mRun) || !isExpired(d.fetched));
+        if (current)
+        {
+            ++mMemoryHits;
+            d.run = mRun;
+            content = d.content;
+            return 0;
+        }
+    }
+    bool useDisk = !(mDirectory.empty() || local);
+    // an expired copy, from memory or disk, to fall back on if the document can't be fetched again
+    bool expired = false;
+    std::string cached;
+    int64_t fetchTime = 0;
+    if ((document != mDocuments.end()) && !local)
+    {
+        expired = true;
+        cached = document->second.content;
+        fetchTime = document->second.fetched;
+    }
+    std::string diskContent;
+    int64_t diskFetchTime = 0;
+    bool onDisk = useDisk && (readCachedDocument(url, diskContent, diskFetchTime) == 0);
+    if (onDisk && !isExpired(diskFetchTime))
+    {
+        ++mDiskHits;
+        content = diskContent;
+        fetchTime = diskFetchTime;
+    }
+    else
+    {
+        // another process may have fetched the document again since we did
+        if (onDisk && (! expired || (diskFetchTime > fetchTime)))
+        {
+            expired = true;
+            cached = diskContent;
+            fetchTime = diskFetchTime;
+        }
+        ++mMisses;
+        bool fetched = true;
+        if (mResolver)
+        {
+            fetched = mResolver(wstring2string(url), content);
+        }
+        else
+        {
+            try
+            {
+                content = wstring2string(mBootstrap->getURLContent(url));
+            }
+            catch (...)
+            {
+                fetched = false;
+            }
+        }
+        if (! fetched)
+        {
+            if (! expired)
+            {
+                std::wcerr << L"ERROR: unable to fetch the document: " << url << std::endl;
+                return -1;
+            }
+            std::wcerr << L"WARNING: unable to fetch the document again, using the expired cached copy: " << url
+                       << std::endl;
+            // keep the time the copy was fetched, so the next run tries again
+            content = cached;
+        }
+        else
+        {
+            fetchTime = std::time(NULL);
+            if (useDisk && (writeCachedDocument(url, content) != 0))
+            {
+                std::wcerr << L"WARNING: unable to add the document to the import cache: " << url << std::endl;
+            }
+        }
+    }
+    Document& d = mDocuments[url];
+    d.content = content;
+    d.stamp = stamp;
+    d.fetched = fetchTime;
+    d.run = mRun;
+    return 0;
+}
+
+bool ImportCache::isExpired(int64_t fetched) const
+{
+    return (mMaxAge >= 0) && (((int64_t)std::time(NULL) - fetched) >= mMaxAge);
+}
+
+std::wstring ImportCache::getReport() const
+{
+    std::wstringstream report;
+    report << L"Import documents: " << mMisses << L" fetched; " << mDiskHits << L" from the import cache; "
+           << mMemoryHits << L" reused in memory.";
+    return report.str();
+}
+
+std::string ImportCache::referenceFileName(const std::wstring& url) const
+{
+    return mDirectory + "/" + hashToString(hashBytes(wstring2string(url))) + ".ref";
+}
+
+std::string ImportCache::contentFileName(const std::string& contentHash) const
+{
+    return mDirectory + "/" + contentHash + (mCompress ? ".xml.z" : ".xml");
+}
+
+int ImportCache::readCachedDocument(const std::wstring& url, std::string& content, int64_t& fetched) const
+{
+    // the reference file gives the URL (to guard against hash collisions), the digest of its content and when it
+    // was fetched
+    std::string reference;
+    if (readFile(referenceFileName(url), reference) != 0) return -1;
+    std::istringstream referenceStream(reference);
+    std::string referenceUrl, contentHash, fetchTime;
+    std::getline(referenceStream, referenceUrl);
+    std::getline(referenceStream, contentHash);
+    std::getline(referenceStream, fetchTime);
+    if ((referenceUrl != wstring2string(url)) || contentHash.empty()) return -2;
+    // entries from before fetch times were recorded have expired
+    fetched = fetchTime.empty() ? 0 : std::strtoll(fetchTime.c_str(), NULL, 10);
+    std::string raw;
+    if (readFile(mDirectory + "/" + contentHash + ".xml", raw) == 0)
+    {
+        content = raw;
+    }
+    else if (readFile(mDirectory + "/" + contentHash + ".xml.z", raw) == 0)
+    {
+        // the uncompressed size is given on the first line
+        size_t headerEnd = raw.find('\n');
+        if (headerEnd == std::string::npos) return -3;
+        uLongf length = std::strtoul(raw.substr(0, headerEnd).c_str(), NULL, 10);
+        uLongf compressedLength = raw.size() - headerEnd - 1;
+        // don't trust a damaged header with a huge allocation
+        if ((length > MAX_DOCUMENT_SIZE) || (length > compressedLength * MAX_COMPRESSION_RATIO)) return -7;
+        std::vector<Bytef> buffer(length + 1);
+        if (uncompress(buffer.data(), &length, (const Bytef*)raw.data() + headerEnd + 1,
+                       raw.size() - headerEnd - 1) != Z_OK) return -4;
+        content.assign((const char*)buffer.data(), length);
+    }
+    else return -5;
+    // make sure the entry hasn't been damaged. Entries from before content was addressed by its SHA-256 digest
+    // fail this check, so are fetched again.
+    if (sha256(content) != contentHash) return -6;
+    return 0;
+}
+
+int ImportCache::writeCachedDocument(const std::wstring& url, const std::string& content) const
+{
+    std::string contentHash = sha256(content);
+    std::string data = content;
+    if (mCompress)
+    {
+        uLongf length = compressBound(content.size());
+        std::vector<Bytef> buffer(length);
+        if (compress2(buffer.data(), &length, (const Bytef*)content.data(), content.size(),
+                      Z_BEST_COMPRESSION) != Z_OK) return -1;
+        std::ostringstream header;
+        header << content.size() << "\n";
+        data = header.str() + std::string((const char*)buffer.data(), length);
+    }
+    if (writeFile(contentFileName(contentHash), data) != 0) return -2;
+    std::ostringstream reference;
+    reference << wstring2string(url) << "\n" << contentHash << "\n" << (int64_t)std::time(NULL) << "\n";
+    if (writeFile(referenceFileName(url), reference.str()) != 0) return -3;
+    return 0;
+}
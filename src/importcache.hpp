@@ -0,0 +1,125 @@
+#ifndef IMPORTCACHE_HPP
+#define IMPORTCACHE_HPP
+
+#include <string>
+#include <map>
+#include <functional>
+#include <cstdint>
+
+#include <cellml-api-cxx-support.hpp>
+#include <IfaceCellML_APISPEC.hxx>
+
+/**
+ * Loads the documents used to instantiate CellML imports, keeping each document in memory so that a document
+ * imported through several paths is only fetched once. When given a cache directory, documents are also kept on
+ * disk so that they do not need to be fetched again by later runs.
+ *
+ * The cache directory holds one reference file per normalised import URL, giving the SHA-256 digest of the
+ * document's content, and one file per distinct document content named by that digest, holding the raw (optionally
+ * zlib compressed) bytes of the document. The reference file also records when the document was fetched.
+ *
+ * A remote document older than the maximum age is fetched again (the cached copy is only used if that fails),
+ * whether it is kept on disk or in memory, so a long running process sees changed documents too. Documents are
+ * always reused within one run (see startRun), however old they are. Local (file:) documents are always read
+ * directly and never cached on disk, and are read again if the file changes.
+ */
+class ImportCache
+{
+public:
+    /**
+     * @param bootstrap The CellML bootstrap used to resolve and fetch documents.
+     */
+    explicit ImportCache(iface::cellml_api::CellMLBootstrap* bootstrap);
+
+    /**
+     * Keep fetched documents in the given directory, creating the directory if needed.
+     * @param directory The cache directory.
+     * @param compress If true, new cache entries are stored zlib compressed.
+     * @return zero on success.
+     */
+    int setCacheDirectory(const std::string& directory, bool compress);
+
+    /**
+     * Set how long fetched documents can be used before they are fetched again.
+     * @param seconds The maximum age of a cached document, zero to always fetch documents again, negative for
+     * cached documents to never expire. Defaults to DEFAULT_MAX_AGE.
+     */
+    void setMaxAge(int64_t seconds)
+    {
+        mMaxAge = seconds;
+    }
+
+    enum { DEFAULT_MAX_AGE = 24 * 60 * 60 };
+
+    /**
+     * Start flattening a new model. The documents fetched from now on are reused until the next call, however old
+     * they get, so a document imported through several paths is only fetched once per model.
+     */
+    void startRun()
+    {
+        ++mRun;
+    }
+
+    /**
+     * Use the given function to fetch documents, rather than the CellML API.
+     * @param resolver Given the absolute URL of a document, sets its UTF-8 content and returns true if found.
+     */
+    void setResolver(const std::function<bool(const std::string&, std::string&)>& resolver)
+    {
+        mResolver = resolver;
+    }
+
+    /**
+     * Instantiate the given import from its (possibly cached) document, if it hasn't been instantiated already.
+     * @param import The import to instantiate.
+     * @return zero on success.
+     */
+    int instantiate(iface::cellml_api::CellMLImport* import);
+
+    /**
+     * Instantiate all the imports in the given model, and all the imports in the imported models.
+     * @param model The model whose imports should be instantiated.
+     * @return zero on success.
+     */
+    int instantiateAll(iface::cellml_api::Model* model);
+
+    /**
+     * Get the content of the document at the given URL, using the cache where possible.
+     * @param url The absolute URL of the document.
+     * @param content Will be set to the UTF-8 content of the document.
+     * @return zero on success.
+     */
+    int getDocument(const std::wstring& url, std::string& content);
+
+    /**
+     * @return A summary of the cache hits and misses so far.
+     */
+    std::wstring getReport() const;
+
+private:
+    std::string referenceFileName(const std::wstring& url) const;
+    std::string contentFileName(const std::string& contentHash) const;
+    bool isExpired(int64_t fetched) const;
+    int readCachedDocument(const std::wstring& url, std::string& content, int64_t& fetched) const;
+    int writeCachedDocument(const std::wstring& url, const std::string& content) const;
+
+    ObjRef<iface::cellml_api::CellMLBootstrap> mBootstrap;
+    struct Document
+    {
+        std::string content; // UTF-8
+        uint64_t stamp;      // for local documents, the fileStamp of the file the content was read from
+        int64_t fetched;     // for remote documents, when the content was fetched
+        uint64_t run;        // the run the document was last used in
+    };
+    std::map<std::wstring, Document> mDocuments; // keyed by normalised URL
+    std::function<bool(const std::string&, std::string&)> mResolver;
+    std::string mDirectory;
+    bool mCompress;
+    int64_t mMaxAge;
+    uint64_t mRun;
+    int mMemoryHits;
+    int mDiskHits;
+    int mMisses;
+};
+
+#endif // IMPORTCACHE_HPP
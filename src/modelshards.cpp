@@ -0,0 +1,535 @@
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <algorithm>
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "modelshards.hpp"
+#include "uniquenameallocator.hpp"
+#include "xmlutils.hpp"
+#include "utils.hpp"
+
+#define MATHML_NS "http://www.w3.org/1998/Math/MathML"
+#define CMETA_NS "http://www.cellml.org/metadata/1.0#"
+
+// the components of a compacted model, as created by the ModelCompactor
+#define COMPACTED_COMPONENT "compactedModelComponent"
+#define SOURCE_VARIABLES_COMPONENT "sourceModelVariables"
+
+int planShards(const NativeModel& model, int shards, std::vector<std::vector<std::string> >& componentShards)
+{
+    componentShards.clear();
+    if ((shards < 1) || model.models().empty()) return -1;
+    const NativeModel::Model& top = model.models().front();
+    // the top-level components, weighted by the number of variables they bring to the compaction. Import
+    // components have no weight, but link the components connected to them.
+    std::vector<NativeModel::NameId> names;
+    std::vector<int> weights;
+    std::unordered_map<NativeModel::NameId, size_t> nodes;
+    for (NativeModel::Index c = top.components.first; c < top.components.first + top.components.count; ++c)
+    {
+        const NativeModel::Component& component = model.components()[c];
+        nodes[component.name] = names.size();
+        names.push_back(component.name);
+        weights.push_back(component.import == NativeModel::NONE ? component.variables.count : 0);
+    }
+    // the number of variable mappings between each pair of components
+    std::vector<std::map<size_t, int> > edges(names.size());
+    for (NativeModel::Index c = top.connections.first; c < top.connections.first + top.connections.count; ++c)
+    {
+        const NativeModel::Connection& connection = model.connections()[c];
+        auto c1 = nodes.find(connection.component1);
+        auto c2 = nodes.find(connection.component2);
+        if ((c1 == nodes.end()) || (c2 == nodes.end())) continue;
+        edges[c1->second][c2->second] += connection.mappings.count;
+        edges[c2->second][c1->second] += connection.mappings.count;
+    }
+    int total = 0;
+    for (int w: weights) total += w;
+    if (total == 0) return 0;
+    int target = (total + shards - 1) / shards;
+    // walk the graph breadth first, following the busiest connections first, and cut the walk into shards of
+    // roughly equal weight. Each new walk starts from the heaviest component not yet visited.
+    std::vector<bool> visited(names.size(), false);
+    std::vector<size_t> byWeight(names.size());
+    for (size_t i = 0; i < byWeight.size(); ++i) byWeight[i] = i;
+    std::stable_sort(byWeight.begin(), byWeight.end(), [&weights](size_t a, size_t b) {
+        return weights[a] > weights[b];
+    });
+    componentShards.resize(1);
+    int shardWeight = 0;
+    for (size_t start: byWeight)
+    {
+        if (visited[start]) continue;
+        std::deque<size_t> queue(1, start);
+        visited[start] = true;
+        while (! queue.empty())
+        {
+            size_t node = queue.front();
+            queue.pop_front();
+            if (weights[node] > 0)
+            {
+                if ((shardWeight >= target) && ((int)componentShards.size() < shards))
+                {
+                    componentShards.resize(componentShards.size() + 1);
+                    shardWeight = 0;
+                }
+                componentShards.back().push_back(model.name(names[node]));
+                shardWeight += weights[node];
+            }
+            std::vector<std::pair<int, size_t> > next;
+            for (const auto& e: edges[node]) if (! visited[e.first]) next.push_back(std::make_pair(-e.second, e.first));
+            std::sort(next.begin(), next.end());
+            for (const auto& n: next)
+            {
+                visited[n.second] = true;
+                queue.push_back(n.second);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Identify the instance of the given model: the position of each import in the chain of imports leading to it. The
+ * same document imported twice is two different instances.
+ */
+static std::wstring modelInstancePath(iface::cellml_api::Model* model)
+{
+    std::wstring path;
+    ObjRef<iface::cellml_api::Model> current = model;
+    while (true)
+    {
+        ObjRef<iface::cellml_api::CellMLElement> parent = current->parentElement();
+        ObjRef<iface::cellml_api::CellMLImport> import = QueryInterface(parent);
+        if (import == NULL) break;
+        ObjRef<iface::cellml_api::Model> importingModel = import->modelElement();
+        ObjRef<iface::cellml_api::CellMLImportSet> imports = importingModel->imports();
+        ObjRef<iface::cellml_api::CellMLImportIterator> ii = imports->iterateImports();
+        int index = 0;
+        while (true)
+        {
+            ObjRef<iface::cellml_api::CellMLImport> i = ii->nextImport();
+            if ((i == NULL) || (i == import)) break;
+            ++index;
+        }
+        path = L"/" + formatNumber(index) + path;
+        current = importingModel;
+    }
+    return path;
+}
+
+std::wstring shardVariableId(iface::cellml_api::CellMLVariable* sourceVariable)
+{
+    ObjRef<iface::cellml_api::Model> model = sourceVariable->modelElement();
+    std::wstring key = modelInstancePath(model) + L"#" + sourceVariable->componentName() + L"/"
+            + sourceVariable->name();
+    return L"shard_" + string2wstring(hashToString(hashBytes(wstring2string(key))));
+}
+
+static std::string serialiseNode(xmlDocPtr doc, xmlNodePtr node)
+{
+    xmlBufferPtr buffer = xmlBufferCreate();
+    xmlNodeDump(buffer, doc, node, 0, 0);
+    std::string s((const char*)xmlBufferContent(buffer));
+    xmlBufferFree(buffer);
+    return s;
+}
+
+static bool isElement(xmlNodePtr node, const char* name)
+{
+    return (node->type == XML_ELEMENT_NODE) && xmlStrEqual(node->name, BAD_CAST name);
+}
+
+static std::vector<xmlNodePtr> childElements(xmlNodePtr parent, const char* name)
+{
+    std::vector<xmlNodePtr> children;
+    for (xmlNodePtr n = parent->children; n; n = n->next) if (isElement(n, name)) children.push_back(n);
+    return children;
+}
+
+static xmlNodePtr findComponent(xmlNodePtr model, const char* name)
+{
+    for (auto c: childElements(model, "component")) if (getAttribute(c, "name") == name) return c;
+    return NULL;
+}
+
+static std::string renamed(const std::map<std::string, std::string>& names, const std::string& name)
+{
+    auto n = names.find(name);
+    return n == names.end() ? name : n->second;
+}
+
+/**
+ * Adopting a node binds it to the first suitable namespace declaration in scope, which may be a prefixed one. Use
+ * the default namespace instead wherever it will do, so merged elements look like the ones already there.
+ */
+static void preferDefaultNamespace(xmlDocPtr doc, xmlNodePtr node)
+{
+    if (node->type != XML_ELEMENT_NODE) return;
+    xmlNsPtr defaultNs = xmlSearchNs(doc, node, NULL);
+    if (node->ns && defaultNs && xmlStrEqual(node->ns->href, defaultNs->href)) node->ns = defaultNs;
+    for (xmlNodePtr c = node->children; c; c = c->next) preferDefaultNamespace(doc, c);
+}
+
+/**
+ * Move the given node from its document into the given parent, before the given sibling if there is one.
+ */
+static int moveNode(xmlDocPtr sourceDoc, xmlNodePtr node, xmlDocPtr doc, xmlNodePtr parent, xmlNodePtr before)
+{
+    xmlUnlinkNode(node);
+    if (xmlDOMWrapAdoptNode(NULL, sourceDoc, node, doc, parent, 0) != 0)
+    {
+        xmlFreeNode(node);
+        return -1;
+    }
+    if (before) xmlAddPrevSibling(before, node);
+    else xmlAddChild(parent, node);
+    preferDefaultNamespace(doc, node);
+    return 0;
+}
+
+/**
+ * Rename the variables and units used in the given equation.
+ */
+static void renameEquation(xmlNodePtr node, const std::map<std::string, std::string>& variableNames,
+                           const std::map<std::string, std::string>& unitsNames)
+{
+    for (xmlNodePtr n = node; n; n = n->next)
+    {
+        if (n->type != XML_ELEMENT_NODE) continue;
+        if (isElement(n, "ci"))
+        {
+            xmlChar* s = xmlNodeGetContent(n);
+            if (s == NULL) continue;
+            std::string name((char*)s);
+            xmlFree(s);
+            name.erase(0, name.find_first_not_of(" \t\r\n"));
+            name.erase(name.find_last_not_of(" \t\r\n") + 1);
+            auto r = variableNames.find(name);
+            if (r != variableNames.end()) xmlNodeSetContent(n, BAD_CAST r->second.c_str());
+        }
+        else if (isElement(n, "cn"))
+        {
+            for (xmlAttrPtr a = n->properties; a; a = a->next)
+            {
+                if (! xmlStrEqual(a->name, BAD_CAST "units")) continue;
+                std::string units = getAttribute(n, "units", a->ns ? (const char*)a->ns->href : NULL);
+                auto r = unitsNames.find(units);
+                if (r != unitsNames.end()) xmlSetNsProp(n, a->ns, BAD_CAST "units", BAD_CAST r->second.c_str());
+                break;
+            }
+        }
+        else renameEquation(n->children, variableNames, unitsNames);
+    }
+}
+
+/**
+ * The merged model, built up one shard at a time.
+ */
+class ShardMerger
+{
+public:
+    ShardMerger() : mDoc(NULL), mModel(NULL), mCompacted(NULL), mSourceVariables(NULL), mMath(NULL),
+        mConnection(NULL), mCompactedFirst(true)
+    {
+    }
+
+    ~ShardMerger()
+    {
+        if (mDoc) xmlFreeDoc(mDoc);
+    }
+
+    int addShard(const std::string& content, int shard)
+    {
+        xmlDocPtr doc = xmlReadMemory(content.data(), content.size(), NULL, NULL, 0);
+        if (doc == NULL)
+        {
+            std::cerr << "Unable to parse the compacted model of shard " << shard << std::endl;
+            return -1;
+        }
+        xmlNodePtr model = xmlDocGetRootElement(doc);
+        xmlNodePtr compacted = model ? findComponent(model, COMPACTED_COMPONENT) : NULL;
+        xmlNodePtr sourceVariables = model ? findComponent(model, SOURCE_VARIABLES_COMPONENT) : NULL;
+        if ((compacted == NULL) || (sourceVariables == NULL))
+        {
+            std::cerr << "The output of shard " << shard << " is not a compacted model." << std::endl;
+            xmlFreeDoc(doc);
+            return -2;
+        }
+        int returnCode = 0;
+        if (mDoc == NULL) returnCode = setBase(doc, model, compacted, sourceVariables);
+        else
+        {
+            returnCode = merge(doc, model, compacted, sourceVariables);
+            xmlFreeDoc(doc);
+        }
+        if (returnCode != 0) std::cerr << "Unable to merge the compacted model of shard " << shard << std::endl;
+        return returnCode;
+    }
+
+    std::string serialise()
+    {
+        // the shard ids have done their job
+        for (auto v: childElements(mCompacted, "variable"))
+        {
+            xmlAttrPtr id = xmlHasNsProp(v, BAD_CAST "id", BAD_CAST CMETA_NS);
+            if (id) xmlRemoveProp(id);
+        }
+        xmlChar* data;
+        int size = 0;
+        xmlDocDumpMemory(mDoc, &data, &size);
+        std::string s((char*)data, size);
+        xmlFree(data);
+        return s;
+    }
+
+private:
+    int setBase(xmlDocPtr doc, xmlNodePtr model, xmlNodePtr compacted, xmlNodePtr sourceVariables)
+    {
+        mDoc = doc;
+        mModel = model;
+        mCompacted = compacted;
+        mSourceVariables = sourceVariables;
+        for (auto u: childElements(model, "units")) addUnitsName(u);
+        for (auto v: childElements(compacted, "variable")) addCompactedVariableName(v);
+        for (auto v: childElements(sourceVariables, "variable"))
+        {
+            mSourceVariableNames.reserve(string2wstring(getAttribute(v, "name")));
+        }
+        std::vector<xmlNodePtr> math = childElements(compacted, "math");
+        if (! math.empty())
+        {
+            mMath = math.front();
+            for (auto e: childElements(mMath, "apply")) mEquations.insert(serialiseNode(mDoc, e));
+        }
+        for (auto c: childElements(model, "connection")) if (setConnection(c)) break;
+        return 0;
+    }
+
+    int merge(xmlDocPtr doc, xmlNodePtr model, xmlNodePtr compacted, xmlNodePtr sourceVariables)
+    {
+        // units: reuse identical definitions, rename clashing ones
+        std::map<std::string, std::string> unitsNames;
+        std::vector<xmlNodePtr> components = childElements(mModel, "component");
+        xmlNodePtr firstComponent = components.empty() ? NULL : components.front();
+        for (auto u: unitsInDependencyOrder(model))
+        {
+            // the units this definition is built from have been dealt with, so refer to them by their new names
+            for (auto unit: childElements(u, "unit")) renameUnits(unit, unitsNames);
+            std::string name = getAttribute(u, "name");
+            auto existing = mUnitsByDefinition.find(unitsDefinition(doc, u));
+            if (existing != mUnitsByDefinition.end())
+            {
+                if (existing->second != name) unitsNames[name] = existing->second;
+                continue;
+            }
+            std::string unique = wstring2string(mUnitsNames.allocate(string2wstring(name)));
+            if (unique != name)
+            {
+                unitsNames[name] = unique;
+                xmlSetProp(u, BAD_CAST "name", BAD_CAST unique.c_str());
+            }
+            if (moveNode(doc, u, mDoc, mModel, firstComponent) != 0) return -1;
+            addUnitsName(u);
+        }
+        // compacted variables: keep one copy of each source variable
+        std::map<std::string, std::string> variableNames;
+        for (auto v: childElements(compacted, "variable"))
+        {
+            std::string name = getAttribute(v, "name");
+            std::string id = shardId(v);
+            auto existing = mCompactedVariables.find(id);
+            if ((! id.empty()) && (existing != mCompactedVariables.end()))
+            {
+                if (existing->second != name) variableNames[name] = existing->second;
+                continue;
+            }
+            std::string unique = wstring2string(mCompactedVariableNames.allocate(string2wstring(name)));
+            if (unique != name)
+            {
+                variableNames[name] = unique;
+                xmlSetProp(v, BAD_CAST "name", BAD_CAST unique.c_str());
+            }
+            renameUnits(v, unitsNames);
+            if (moveNode(doc, v, mDoc, mCompacted, mMath) != 0) return -2;
+            addCompactedVariableName(v);
+        }
+        // the source model variables of each shard are distinct, as each shard has its own components, but the
+        // names made up for them in different shards may clash
+        std::map<std::string, std::string> sourceNames;
+        for (auto v: childElements(sourceVariables, "variable"))
+        {
+            std::string name = getAttribute(v, "name");
+            std::string unique = wstring2string(mSourceVariableNames.allocate(string2wstring(name)));
+            if (unique != name)
+            {
+                sourceNames[name] = unique;
+                xmlSetProp(v, BAD_CAST "name", BAD_CAST unique.c_str());
+            }
+            renameUnits(v, unitsNames);
+            if (moveNode(doc, v, mDoc, mSourceVariables, NULL) != 0) return -3;
+        }
+        // equations: shared dependencies give identical equations once renamed
+        for (auto math: childElements(compacted, "math"))
+        {
+            for (auto e: childElements(math, "apply"))
+            {
+                renameEquation(e, variableNames, unitsNames);
+                if (! mEquations.insert(serialiseNode(doc, e)).second) continue;
+                if (mMath == NULL)
+                {
+                    mMath = xmlNewChild(mCompacted, NULL, BAD_CAST "math", NULL);
+                    xmlSetNs(mMath, xmlNewNs(mMath, BAD_CAST MATHML_NS, NULL));
+                }
+                if (moveNode(doc, e, mDoc, mMath, NULL) != 0) return -4;
+            }
+        }
+        // variable mappings
+        for (auto c: childElements(model, "connection"))
+        {
+            std::vector<xmlNodePtr> cmap = childElements(c, "map_components");
+            if (cmap.empty()) continue;
+            bool compactedFirst = getAttribute(cmap.front(), "component_1") == COMPACTED_COMPONENT;
+            for (auto m: childElements(c, "map_variables"))
+            {
+                std::string compactedName = getAttribute(m, compactedFirst ? "variable_1" : "variable_2");
+                std::string sourceName = getAttribute(m, compactedFirst ? "variable_2" : "variable_1");
+                compactedName = renamed(variableNames, compactedName);
+                sourceName = renamed(sourceNames, sourceName);
+                if (! mMappings.insert(std::make_pair(compactedName, sourceName)).second) continue;
+                if (mConnection == NULL)
+                {
+                    // the base shard had no mappings
+                    mConnection = xmlNewChild(mModel, mModel->ns, BAD_CAST "connection", NULL);
+                    xmlNodePtr components = xmlNewChild(mConnection, mModel->ns, BAD_CAST "map_components", NULL);
+                    xmlSetProp(components, BAD_CAST "component_1", BAD_CAST COMPACTED_COMPONENT);
+                    xmlSetProp(components, BAD_CAST "component_2", BAD_CAST SOURCE_VARIABLES_COMPONENT);
+                    mCompactedFirst = true;
+                }
+                xmlNodePtr mapping = xmlNewChild(mConnection, mConnection->ns, BAD_CAST "map_variables", NULL);
+                xmlSetProp(mapping, BAD_CAST "variable_1",
+                           BAD_CAST (mCompactedFirst ? compactedName : sourceName).c_str());
+                xmlSetProp(mapping, BAD_CAST "variable_2",
+                           BAD_CAST (mCompactedFirst ? sourceName : compactedName).c_str());
+            }
+        }
+        return 0;
+    }
+
+    static std::string shardId(xmlNodePtr variable)
+    {
+        return getAttribute(variable, "id", CMETA_NS);
+    }
+
+    /**
+     * The units definitions of the given model, each after the definitions in the model that it is built from.
+     */
+    static std::vector<xmlNodePtr> unitsInDependencyOrder(xmlNodePtr model)
+    {
+        std::map<std::string, xmlNodePtr> byName;
+        std::vector<xmlNodePtr> units = childElements(model, "units");
+        for (auto u: units) byName[getAttribute(u, "name")] = u;
+        std::set<xmlNodePtr> visited;
+        std::vector<xmlNodePtr> ordered;
+        for (auto u: units) addUnitsInDependencyOrder(u, byName, visited, ordered);
+        return ordered;
+    }
+
+    static void addUnitsInDependencyOrder(xmlNodePtr units, const std::map<std::string, xmlNodePtr>& byName,
+                                          std::set<xmlNodePtr>& visited, std::vector<xmlNodePtr>& ordered)
+    {
+        // a definition that loops back on itself is invalid anyway, visiting each once is all that matters
+        if (! visited.insert(units).second) return;
+        for (auto unit: childElements(units, "unit"))
+        {
+            auto u = byName.find(getAttribute(unit, "units"));
+            if (u != byName.end()) addUnitsInDependencyOrder(u->second, byName, visited, ordered);
+        }
+        ordered.push_back(units);
+    }
+
+    static std::string unitsDefinition(xmlDocPtr doc, xmlNodePtr units)
+    {
+        // base units are only defined by their name
+        if (getAttribute(units, "base_units") == "yes") return "base:" + getAttribute(units, "name");
+        std::string definition = "derived:";
+        for (auto u: childElements(units, "unit")) definition += serialiseNode(doc, u);
+        return definition;
+    }
+
+    void addUnitsName(xmlNodePtr units)
+    {
+        std::string name = getAttribute(units, "name");
+        mUnitsNames.reserve(string2wstring(name));
+        mUnitsByDefinition.insert(std::make_pair(unitsDefinition(mDoc, units), name));
+    }
+
+    void addCompactedVariableName(xmlNodePtr variable)
+    {
+        std::string name = getAttribute(variable, "name");
+        mCompactedVariableNames.reserve(string2wstring(name));
+        std::string id = shardId(variable);
+        if (! id.empty()) mCompactedVariables[id] = name;
+    }
+
+    /**
+     * Rename the units referred to by the units attribute of the given variable or unit element.
+     */
+    static void renameUnits(xmlNodePtr element, const std::map<std::string, std::string>& unitsNames)
+    {
+        auto r = unitsNames.find(getAttribute(element, "units"));
+        if (r != unitsNames.end()) xmlSetProp(element, BAD_CAST "units", BAD_CAST r->second.c_str());
+    }
+
+    bool setConnection(xmlNodePtr connection)
+    {
+        std::vector<xmlNodePtr> cmap = childElements(connection, "map_components");
+        if (cmap.empty()) return false;
+        std::string c1 = getAttribute(cmap.front(), "component_1");
+        std::string c2 = getAttribute(cmap.front(), "component_2");
+        if (!(((c1 == COMPACTED_COMPONENT) && (c2 == SOURCE_VARIABLES_COMPONENT)) ||
+              ((c2 == COMPACTED_COMPONENT) && (c1 == SOURCE_VARIABLES_COMPONENT)))) return false;
+        mConnection = connection;
+        mCompactedFirst = (c1 == COMPACTED_COMPONENT);
+        for (auto m: childElements(connection, "map_variables"))
+        {
+            std::string v1 = getAttribute(m, "variable_1");
+            std::string v2 = getAttribute(m, "variable_2");
+            mMappings.insert(mCompactedFirst ? std::make_pair(v1, v2) : std::make_pair(v2, v1));
+        }
+        return true;
+    }
+
+    xmlDocPtr mDoc;
+    xmlNodePtr mModel;
+    xmlNodePtr mCompacted;
+    xmlNodePtr mSourceVariables;
+    xmlNodePtr mMath;
+    xmlNodePtr mConnection;
+    bool mCompactedFirst;
+    UniqueNameAllocator mUnitsNames;
+    std::map<std::string, std::string> mUnitsByDefinition;
+    UniqueNameAllocator mCompactedVariableNames;
+    std::map<std::string, std::string> mCompactedVariables; // shard id -> name
+    UniqueNameAllocator mSourceVariableNames;
+    std::set<std::string> mEquations;
+    std::set<std::pair<std::string, std::string> > mMappings; // compacted variable, source model variable
+};
+
+int mergeShards(const std::vector<std::string>& shardOutputs, std::string& output)
+{
+    initialiseLibXml();
+    if (shardOutputs.empty()) return -1;
+    ShardMerger merger;
+    for (size_t i = 0; i < shardOutputs.size(); ++i)
+    {
+        if (merger.addShard(shardOutputs[i], i) != 0) return -2;
+    }
+    output = merger.serialise();
+    return 0;
+}
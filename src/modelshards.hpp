@@ -0,0 +1,50 @@
+#ifndef MODELSHARDS_HPP
+#define MODELSHARDS_HPP
+
+#include <string>
+#include <vector>
+
+#include <cellml-api-cxx-support.hpp>
+#include <IfaceCellML_APISPEC.hxx>
+
+#include "nativemodel.hpp"
+
+/**
+ * Very large models can be compacted in shards: the top-level components of the model are split into groups,
+ * each group is compacted on its own (typically in its own process), and the compacted shards are merged back into
+ * a single compacted model.
+ */
+
+/**
+ * Split the top-level components of the given model into shards of roughly equal size. Components linked by
+ * connections, directly or through an import component, are kept in the same shard where possible so that the
+ * variables they depend on are only compacted once. Only the model itself is needed, its imports don't need to
+ * be instantiated.
+ * @param model The model to split, the first model of the given NativeModel.
+ * @param shards The number of shards wanted.
+ * @param componentShards Will be set to the names of the components in each shard. There may be fewer shards than
+ * asked for, but none of them will be empty.
+ * @return zero on success.
+ */
+int planShards(const NativeModel& model, int shards, std::vector<std::vector<std::string> >& componentShards);
+
+/**
+ * The cmeta:id given to a compacted variable in a shard, identifying its source variable so that the copies of a
+ * source variable compacted in several shards can be merged.
+ * @param sourceVariable The source variable of the compacted variable.
+ * @return The cmeta:id for the compacted variable.
+ */
+std::wstring shardVariableId(iface::cellml_api::CellMLVariable* sourceVariable);
+
+/**
+ * Merge compacted shards into a single compacted model. The first shard is used as the base, and the units,
+ * variables, equations and variable mappings of the other shards are added to it. Compacted variables with the
+ * same source variable (see shardVariableId) are only kept once, as are units with the same definition and
+ * identical equations. Names which clash are made unique. The shard cmeta:ids are removed from the merged model.
+ * @param shardOutputs The UTF-8 compacted model of each shard.
+ * @param output Will be set to the UTF-8 merged model.
+ * @return zero on success.
+ */
+int mergeShards(const std::vector<std::string>& shardOutputs, std::string& output);
+
+#endif // MODELSHARDS_HPP
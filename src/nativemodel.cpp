@@ -0,0 +1,173 @@
+#include <iostream>
+
+#include <libxml/parser.h>
+#include <libxml/uri.h>
+
+#include "nativemodel.hpp"
+#include "importcache.hpp"
+#include "xmlutils.hpp"
+#include "utils.hpp"
+
+#define CELLML_1_0_NS "http://www.cellml.org/cellml/1.0#"
+#define CELLML_1_1_NS "http://www.cellml.org/cellml/1.1#"
+#define XLINK_NS "http://www.w3.org/1999/xlink"
+
+static bool isElement(xmlNodePtr node, const char* ns, const char* name)
+{
+    return (node->type == XML_ELEMENT_NODE) && node->ns && xmlStrEqual(node->ns->href, BAD_CAST ns) &&
+            xmlStrEqual(node->name, BAD_CAST name);
+}
+
+static bool isCellmlElement(xmlNodePtr node, const char* name)
+{
+    return isElement(node, CELLML_1_0_NS, name) || isElement(node, CELLML_1_1_NS, name);
+}
+
+static std::vector<xmlNodePtr> cellmlChildren(xmlNodePtr parent, const char* name)
+{
+    std::vector<xmlNodePtr> children;
+    for (xmlNodePtr n = parent->children; n; n = n->next) if (isCellmlElement(n, name)) children.push_back(n);
+    return children;
+}
+
+NativeModel::NativeModel()
+{
+    clear();
+}
+
+void NativeModel::clear()
+{
+    mNames.assign(1, std::string()); // NO_NAME
+    mNameIds.clear();
+    mNameIds[std::string()] = NO_NAME;
+    mModels.clear();
+    mImports.clear();
+    mComponents.clear();
+    mVariables.clear();
+    mConnections.clear();
+    mMappings.clear();
+}
+
+NativeModel::NameId NativeModel::intern(const xmlChar* name)
+{
+    if (name == NULL) return NO_NAME;
+    auto id = mNameIds.insert(std::make_pair(std::string((const char*)name), (NameId)mNames.size()));
+    if (id.second) mNames.push_back(id.first->first);
+    return id.first->second;
+}
+
+int NativeModel::load(ImportCache& imports, const std::string& modelText, const std::string& baseUri)
+{
+    initialiseLibXml();
+    clear();
+    std::string content = modelText;
+    if (content.empty() && (imports.getDocument(string2wstring(baseUri), content) != 0)) return -1;
+    return loadModel(content, baseUri);
+}
+
+int NativeModel::loadModel(const std::string& content, const std::string& uri)
+{
+    xmlDocPtr doc = xmlReadMemory(content.data(), (int)content.size(), uri.c_str(), NULL, XML_PARSE_NONET);
+    if (doc == NULL)
+    {
+        std::wcerr << L"ERROR: unable to parse the model: " << string2wstring(uri) << std::endl;
+        return -3;
+    }
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    if ((root == NULL) || !isCellmlElement(root, "model"))
+    {
+        std::wcerr << L"ERROR: not a CellML model: " << string2wstring(uri) << std::endl;
+        xmlFreeDoc(doc);
+        return -4;
+    }
+
+    Index m = mModels.size();
+    Model model;
+    model.name = intern(BAD_CAST getAttribute(root, "name").c_str());
+    model.uri = uri;
+    std::vector<xmlNodePtr> importElements = cellmlChildren(root, "import");
+
+    // each array gets a contiguous run of entries for this model, so fill them in one after the other
+    model.imports.first = mImports.size();
+    for (auto i: importElements)
+    {
+        Import imp;
+        imp.model = m;
+        std::string href = getAttribute(i, "href", XLINK_NS);
+        xmlChar* url = xmlBuildURI(BAD_CAST href.c_str(), BAD_CAST uri.c_str());
+        imp.url = url ? (char*)url : href;
+        xmlFree(url);
+        mImports.push_back(imp);
+    }
+    model.imports.count = importElements.size();
+
+    model.components.first = mComponents.size();
+    for (size_t i = 0; i < importElements.size(); ++i)
+    {
+        for (auto c: cellmlChildren(importElements[i], "component"))
+        {
+            Component component;
+            component.name = intern(BAD_CAST getAttribute(c, "name").c_str());
+            component.model = m;
+            component.import = model.imports.first + i;
+            component.componentRef = intern(BAD_CAST getAttribute(c, "component_ref").c_str());
+            component.variables.first = component.variables.count = 0;
+            mComponents.push_back(component);
+        }
+    }
+    std::vector<xmlNodePtr> componentElements = cellmlChildren(root, "component");
+    std::vector<Index> localComponents;
+    for (auto c: componentElements)
+    {
+        Component component;
+        component.name = intern(BAD_CAST getAttribute(c, "name").c_str());
+        component.model = m;
+        component.import = NONE;
+        component.componentRef = NO_NAME;
+        localComponents.push_back(mComponents.size());
+        mComponents.push_back(component);
+    }
+    model.components.count = mComponents.size() - model.components.first;
+
+    // the content of the local components
+    for (size_t i = 0; i < componentElements.size(); ++i)
+    {
+        xmlNodePtr c = componentElements[i];
+        Index ci = localComponents[i];
+        mComponents[ci].variables.first = mVariables.size();
+        for (auto v: cellmlChildren(c, "variable"))
+        {
+            Variable variable;
+            variable.name = intern(BAD_CAST getAttribute(v, "name").c_str());
+            variable.component = ci;
+            mVariables.push_back(variable);
+        }
+        mComponents[ci].variables.count = mVariables.size() - mComponents[ci].variables.first;
+    }
+
+    model.connections.first = mConnections.size();
+    for (auto c: cellmlChildren(root, "connection"))
+    {
+        std::vector<xmlNodePtr> cmap = cellmlChildren(c, "map_components");
+        if (cmap.empty()) continue;
+        Connection connection;
+        connection.model = m;
+        connection.component1 = intern(BAD_CAST getAttribute(cmap.front(), "component_1").c_str());
+        connection.component2 = intern(BAD_CAST getAttribute(cmap.front(), "component_2").c_str());
+        connection.mappings.first = mMappings.size();
+        for (auto mv: cellmlChildren(c, "map_variables"))
+        {
+            VariableMapping mapping;
+            mapping.variable1 = intern(BAD_CAST getAttribute(mv, "variable_1").c_str());
+            mapping.variable2 = intern(BAD_CAST getAttribute(mv, "variable_2").c_str());
+            mMappings.push_back(mapping);
+        }
+        connection.mappings.count = mMappings.size() - connection.mappings.first;
+        mConnections.push_back(connection);
+    }
+    model.connections.count = mConnections.size() - model.connections.first;
+    mModels.push_back(model);
+    // everything needed has been copied out of the document
+    xmlFreeDoc(doc);
+    return 0;
+}
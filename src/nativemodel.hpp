@@ -0,0 +1,129 @@
+#ifndef NATIVEMODEL_HPP
+#define NATIVEMODEL_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include <libxml/tree.h>
+
+class ImportCache;
+
+/**
+ * The structure of a CellML 1.0/1.1 model loaded directly with libxml2, for work which doesn't need the CellML API
+ * (see planShards). Only the model itself is loaded, its imports aren't instantiated. The imports, components,
+ * variables, connections and variable mappings are stored in flat arrays, which refer to each other by index. Names
+ * are interned: each distinct name is stored once, in UTF-8, and referred to by its NameId, so comparing names is
+ * comparing integers. Units and math aren't loaded.
+ */
+class NativeModel
+{
+public:
+    typedef uint32_t NameId;
+    typedef uint32_t Index;
+
+    /**
+     * The index used for a missing element, and the NameId of the empty name.
+     */
+    enum { NONE = 0xffffffff, NO_NAME = 0 };
+
+    /**
+     * A run of consecutive entries in one of the arrays.
+     */
+    struct Range
+    {
+        Index first;
+        Index count;
+    };
+
+    struct Model
+    {
+        NameId name;
+        std::string uri;    ///< the absolute URI of the document
+        Range components;   ///< import components, then local components
+        Range connections;
+        Range imports;
+    };
+
+    struct Import
+    {
+        Index model;         ///< the importing model
+        std::string url;     ///< the absolute URL of the imported document
+    };
+
+    struct Component
+    {
+        NameId name;
+        Index model;
+        Index import;        ///< for an import component, the import; otherwise NONE
+        NameId componentRef; ///< for an import component, the name of the component in the imported model
+        Range variables;     ///< empty for an import component
+    };
+
+    struct Variable
+    {
+        NameId name;
+        Index component;
+    };
+
+    struct Connection
+    {
+        Index model;
+        NameId component1;
+        NameId component2;
+        Range mappings;
+    };
+
+    struct VariableMapping
+    {
+        NameId variable1;
+        NameId variable2;
+    };
+
+    NativeModel();
+
+    NativeModel(const NativeModel&) = delete;
+    NativeModel& operator=(const NativeModel&) = delete;
+
+    /**
+     * Load the given model, replacing anything loaded before.
+     * @param imports Used to fetch the model, if modelText is empty.
+     * @param modelText The UTF-8 model. If empty, the model is fetched from baseUri.
+     * @param baseUri The URI of the model, used to resolve the URLs of its imports.
+     * @return zero on success.
+     */
+    int load(ImportCache& imports, const std::string& modelText, const std::string& baseUri);
+
+    const std::vector<Model>& models() const { return mModels; }
+    const std::vector<Import>& imports() const { return mImports; }
+    const std::vector<Component>& components() const { return mComponents; }
+    const std::vector<Variable>& variables() const { return mVariables; }
+    const std::vector<Connection>& connections() const { return mConnections; }
+    const std::vector<VariableMapping>& mappings() const { return mMappings; }
+
+    /**
+     * @param id An interned name.
+     * @return The UTF-8 name.
+     */
+    const std::string& name(NameId id) const
+    {
+        return mNames[id];
+    }
+
+private:
+    void clear();
+    NameId intern(const xmlChar* name);
+    int loadModel(const std::string& content, const std::string& uri);
+
+    std::vector<std::string> mNames;
+    std::unordered_map<std::string, NameId> mNameIds;
+    std::vector<Model> mModels;
+    std::vector<Import> mImports;
+    std::vector<Component> mComponents;
+    std::vector<Variable> mVariables;
+    std::vector<Connection> mConnections;
+    std::vector<VariableMapping> mMappings;
+};
+
+#endif // NATIVEMODEL_HPP
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <vector>
+#include <cstdlib>
+
+#include "outputcache.hpp"
+#include "xmlutils.hpp"
+#include "utils.hpp"
+
+#ifndef FLATTEN_CELLML_VERSION
+#  define FLATTEN_CELLML_VERSION "unknown"
+#endif
+
+OutputCache::OutputCache()
+{
+}
+
+int OutputCache::setCacheDirectory(const std::string& directory)
+{
+    if (makeDirectory(directory) != 0)
+    {
+        std::cerr << "Unable to create the output cache directory: " << directory << std::endl;
+        return -1;
+    }
+    mDirectory = directory;
+    return 0;
+}
+
+int OutputCache::computeKey(const std::string& modelUrl, const std::string& settings)
+{
+    mKey.clear();
+    mEntryName.clear();
+    std::string key = std::string(FLATTEN_CELLML_VERSION) + "\n" + settings + "\n";
+    // walk the import tree in document order, so the same set of documents always gives the same key
+    std::set<std::string> visited;
+    std::vector<std::string> toVisit(1, modelUrl);
+    while (! toVisit.empty())
+    {
+        std::string url = toVisit.back();
+        toVisit.pop_back();
+        if (! visited.insert(url).second) continue;
+        std::string fileName, content;
+        if ((urlToFileName(url, fileName) != 0) || (readFile(fileName, content) != 0))
+        {
+            std::cerr << "Unable to read the document for the output cache: " << url << std::endl;
+            return -1;
+        }
+        key += sha256(content) + " " + url + "\n";
+        XmlUtils xml;
+        if (xml.parseDocument(content, url) != 0) return -2;
+        std::vector<std::string> imports = xml.getImportUrls();
+        toVisit.insert(toVisit.end(), imports.rbegin(), imports.rend());
+    }
+    mKey = key;
+    mEntryName = sha256(key);
+    return 0;
+}
+
+/**
+ * Read a field stored as its size on one line followed by its bytes.
+ * @param entry The cache entry.
+ * @param position The position of the field, moved past it.
+ * @param field Will be set to the field.
+ * @return zero on success.
+ */
+static int readField(const std::string& entry, size_t& position, std::string& field)
+{
+    size_t headerEnd = entry.find('\n', position);
+    if (headerEnd == std::string::npos) return -1;
+    size_t size = std::strtoul(entry.substr(position, headerEnd - position).c_str(), NULL, 10);
+    if (size > (entry.size() - headerEnd - 1)) return -2;
+    field = entry.substr(headerEnd + 1, size);
+    position = headerEnd + 1 + size;
+    return 0;
+}
+
+int OutputCache::lookup(std::string& output, std::string& report) const
+{
+    if (mDirectory.empty() || mKey.empty()) return -1;
+    std::string entry;
+    if (readFile(mDirectory + "/" + mEntryName + ".out", entry) != 0) return -2;
+    // the key and the output are each given as their size on one line followed by their bytes, then the report
+    size_t position = 0;
+    std::string key;
+    if ((readField(entry, position, key) != 0) || (readField(entry, position, output) != 0)) return -3;
+    if (key != mKey)
+    {
+        output.clear();
+        return -4;
+    }
+    report = entry.substr(position);
+    return 0;
+}
+
+int OutputCache::store(const std::string& output, const std::string& report) const
+{
+    if (mDirectory.empty() || mKey.empty()) return -1;
+    std::ostringstream entry;
+    entry << mKey.size() << "\n" << mKey << output.size() << "\n" << output << report;
+    if (writeFile(mDirectory + "/" + mEntryName + ".out", entry.str()) != 0)
+    {
+        std::cerr << "Unable to store the flattened model in the output cache." << std::endl;
+        return -2;
+    }
+    return 0;
+}
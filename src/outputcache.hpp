@@ -0,0 +1,57 @@
+#ifndef OUTPUTCACHE_HPP
+#define OUTPUTCACHE_HPP
+
+#include <string>
+
+/**
+ * A cache of flattened models, kept in a local directory. Entries are keyed on the version of this tool, the
+ * flattening settings and the URL and SHA-256 digest of the source model document and of all the documents it
+ * (transitively) imports. Each entry stores its key, which is checked on lookup. Computing the key only needs
+ * libxml2, so a cached model can be used without loading the CellML API. Only models whose documents are all local
+ * files can be cached.
+ */
+class OutputCache
+{
+public:
+    OutputCache();
+
+    /**
+     * Keep flattened models in the given directory, creating the directory if needed.
+     * @param directory The cache directory.
+     * @return zero on success.
+     */
+    int setCacheDirectory(const std::string& directory);
+
+    /**
+     * Compute the cache key for flattening the given model with the given settings.
+     * @param modelUrl The URL (or file name) of the source model.
+     * @param settings The flattening mode, along with every option which changes the flattened model.
+     * @return zero on success, non-zero if some document could not be read, in which case the cache can't be
+     * used for this model.
+     */
+    int computeKey(const std::string& modelUrl, const std::string& settings);
+
+    /**
+     * Look for the flattened model in the cache.
+     * @param output Will be set to the cached flattened model.
+     * @param report Will be set to the cached flattening report.
+     * @return zero if the model was found in the cache.
+     */
+    int lookup(std::string& output, std::string& report) const;
+
+    /**
+     * Store the flattened model in the cache.
+     * @param output The UTF-8 flattened model.
+     * @param report The UTF-8 flattening report.
+     * @return zero on success.
+     */
+    int store(const std::string& output, const std::string& report) const;
+
+private:
+    std::string mDirectory;
+    // what the entry depends on, and the name of the entry (its digest)
+    std::string mKey;
+    std::string mEntryName;
+};
+
+#endif // OUTPUTCACHE_HPP
@@ -0,0 +1,150 @@
+#include <iostream>
+
+#include <libxml/xmlreader.h>
+#include <libxml/xmlwriter.h>
+
+#include "streamconverter.hpp"
+#include "xmlutils.hpp"
+#include "utils.hpp"
+
+#define CELLML_1_0_NS "http://www.cellml.org/cellml/1.0#"
+#define CELLML_1_1_NS "http://www.cellml.org/cellml/1.1#"
+
+static void ignoreErrors(void*, const char*, xmlParserSeverities, xmlTextReaderLocatorPtr)
+{
+    // the full conversion reports the problems with the model
+}
+
+static bool equal(const xmlChar* a, const char* b)
+{
+    return (a != NULL) && xmlStrEqual(a, BAD_CAST b);
+}
+
+/**
+ * Copies the nodes read from a model to a writer, rewriting the CellML 1.1 namespace, and gives up on the first
+ * thing which needs the full conversion.
+ */
+class StreamConverter
+{
+public:
+    StreamConverter(xmlTextReaderPtr reader) : mReader(reader), mBuffer(xmlBufferCreate()), mWriter(NULL)
+    {
+        if (mBuffer) mWriter = xmlNewTextWriterMemory(mBuffer, 0);
+        if (mReader) xmlTextReaderSetErrorHandler(mReader, ignoreErrors, NULL);
+    }
+
+    ~StreamConverter()
+    {
+        if (mWriter) xmlFreeTextWriter(mWriter);
+        if (mBuffer) xmlBufferFree(mBuffer);
+        if (mReader) xmlFreeTextReader(mReader);
+    }
+
+    StreamConverter(const StreamConverter&) = delete;
+    StreamConverter& operator=(const StreamConverter&) = delete;
+
+    int convert(std::string& output)
+    {
+        if ((mReader == NULL) || (mWriter == NULL)) return -1;
+        if (xmlTextWriterStartDocument(mWriter, NULL, "UTF-8", NULL) < 0) return -2;
+        int ret;
+        while ((ret = xmlTextReaderRead(mReader)) == 1)
+        {
+            int rc = copyNode();
+            if (rc != 0) return rc;
+        }
+        if (ret != 0) return -3; // not well formed
+        if (xmlTextWriterEndDocument(mWriter) < 0) return -2;
+        xmlTextWriterFlush(mWriter);
+        output.assign((const char*)xmlBufferContent(mBuffer), xmlBufferLength(mBuffer));
+        return 0;
+    }
+
+private:
+    int copyNode()
+    {
+        const xmlChar* value = xmlTextReaderConstValue(mReader);
+        int rc = 0;
+        switch (xmlTextReaderNodeType(mReader))
+        {
+        case XML_READER_TYPE_ELEMENT:
+            return copyElement();
+        case XML_READER_TYPE_END_ELEMENT:
+            rc = xmlTextWriterEndElement(mWriter);
+            break;
+        case XML_READER_TYPE_TEXT:
+        case XML_READER_TYPE_WHITESPACE:
+        case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+            rc = xmlTextWriterWriteString(mWriter, value);
+            break;
+        case XML_READER_TYPE_CDATA:
+            rc = xmlTextWriterWriteCDATA(mWriter, value);
+            break;
+        case XML_READER_TYPE_COMMENT:
+            rc = xmlTextWriterWriteComment(mWriter, value);
+            break;
+        case XML_READER_TYPE_PROCESSING_INSTRUCTION:
+            rc = xmlTextWriterWritePI(mWriter, xmlTextReaderConstName(mReader), value);
+            break;
+        default:
+            // document types, entity references, ...: leave them to the full conversion
+            return 1;
+        }
+        return rc < 0 ? -2 : 0;
+    }
+
+    int copyElement()
+    {
+        const xmlChar* ns = xmlTextReaderConstNamespaceUri(mReader);
+        const xmlChar* localName = xmlTextReaderConstLocalName(mReader);
+        bool cellml = equal(ns, CELLML_1_0_NS) || equal(ns, CELLML_1_1_NS);
+        if ((xmlTextReaderDepth(mReader) == 0) && !(cellml && equal(localName, "model"))) return 2; // not a model
+        if (cellml && equal(localName, "import")) return 3;
+        bool variable = cellml && equal(localName, "variable");
+        bool empty = xmlTextReaderIsEmptyElement(mReader) == 1;
+
+        if (xmlTextWriterStartElement(mWriter, xmlTextReaderConstName(mReader)) < 0) return -2;
+        while (xmlTextReaderMoveToNextAttribute(mReader) == 1)
+        {
+            const xmlChar* name = xmlTextReaderConstName(mReader);
+            const xmlChar* value = xmlTextReaderConstValue(mReader);
+            if (xmlTextReaderIsNamespaceDecl(mReader) == 1)
+            {
+                if (equal(value, CELLML_1_1_NS)) value = BAD_CAST CELLML_1_0_NS;
+            }
+            else if (variable && equal(name, "initial_value") &&
+                     !isNumber(string2wstring((const char*)value)))
+            {
+                return 4; // initialised from another variable, which CellML 1.0 doesn't allow
+            }
+            if (xmlTextWriterWriteAttribute(mWriter, name, value) < 0) return -2;
+        }
+        xmlTextReaderMoveToElement(mReader);
+        if (empty && (xmlTextWriterEndElement(mWriter) < 0)) return -2;
+        return 0;
+    }
+
+    xmlTextReaderPtr mReader;
+    xmlBufferPtr mBuffer;
+    xmlTextWriterPtr mWriter;
+};
+
+int streamConvertModel(const std::string& modelText, const std::string& baseUri, std::string& output)
+{
+    output.clear();
+    initialiseLibXml();
+    xmlTextReaderPtr reader;
+    if (modelText.empty())
+    {
+        std::string fileName;
+        if (urlToFileName(baseUri, fileName) != 0) return -1;
+        reader = xmlReaderForFile(fileName.c_str(), NULL, XML_PARSE_NONET);
+    }
+    else reader = xmlReaderForMemory(modelText.data(), (int)modelText.size(), baseUri.c_str(), NULL,
+                                     XML_PARSE_NONET);
+    StreamConverter converter(reader);
+    std::string converted;
+    int rc = converter.convert(converted);
+    if (rc == 0) output.swap(converted);
+    return rc;
+}
@@ -0,0 +1,20 @@
+#ifndef STREAMCONVERTER_HPP
+#define STREAMCONVERTER_HPP
+
+#include <string>
+
+/**
+ * Convert a model which needs no flattening into CellML 1.0 in a single streaming pass, without building a
+ * CellML API model. This applies to CellML 1.0 models, and to CellML 1.1 models with no imports and only numeric
+ * initial values, for which the conversion is just a change of namespace. The CellML 1.1 namespace declarations
+ * are rewritten to CellML 1.0 and everything else (including metadata, comments and processing instructions) is
+ * passed through unchanged.
+ * @param modelText The model to convert. If empty, the model is read from baseUri, which must then be a local file.
+ * @param baseUri The URI of the model.
+ * @param output Will be set to the converted model.
+ * @return zero if the model was converted. Non-zero if the model needs the full conversion (or can't be read, which
+ * the full conversion will report), in which case output is left empty.
+ */
+int streamConvertModel(const std::string& modelText, const std::string& baseUri, std::string& output);
+
+#endif // STREAMCONVERTER_HPP
@@ -0,0 +1,49 @@
+#include "threadpool.hpp"
+
+ThreadPool::ThreadPool(int threads) : mThreads(threads > 0 ? threads : 0), mStopping(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+        // nobody is waiting for the tasks that haven't started, or they would have run them already
+        mQueue.clear();
+    }
+    mWakeUp.notify_all();
+    for (auto& worker: mWorkers) worker.join();
+}
+
+int ThreadPool::defaultThreads()
+{
+    int cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+}
+
+void ThreadPool::enqueue(const std::function<void()>& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(task);
+        while ((int)mWorkers.size() < mThreads) mWorkers.push_back(std::thread(&ThreadPool::runTasks, this));
+    }
+    mWakeUp.notify_one();
+}
+
+void ThreadPool::runTasks()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWakeUp.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+            if (mStopping) return;
+            task = mQueue.front();
+            mQueue.pop_front();
+        }
+        task();
+    }
+}
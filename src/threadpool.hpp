@@ -0,0 +1,118 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <type_traits>
+
+/**
+ * The result of a task submitted to a ThreadPool. Asking for the result of a task which no pool thread has
+ * started yet runs the task on the asking thread, so waiting for a result never waits behind the queue.
+ */
+template<typename T>
+class PoolResult
+{
+public:
+    PoolResult()
+    {
+    }
+
+    /**
+     * @return true if this refers to a submitted task.
+     */
+    bool valid() const
+    {
+        return mState != nullptr;
+    }
+
+    /**
+     * Wait for the task to finish, running it here if it hasn't been started, and return its result.
+     * @return The result of the task.
+     */
+    const T& get() const
+    {
+        mState->run();
+        return mState->result.get();
+    }
+
+private:
+    friend class ThreadPool;
+    struct State
+    {
+        std::atomic<bool> started;
+        std::packaged_task<T()> task;
+        std::shared_future<T> result;
+        void run()
+        {
+            if (! started.exchange(true)) task();
+        }
+    };
+    std::shared_ptr<State> mState;
+};
+
+/**
+ * A fixed set of threads running tasks from a shared queue. The threads are only started when the first task is
+ * submitted, so a pool that is never used costs nothing (and doesn't get in the way of forking). Tasks must not use
+ * the CellML API, which may only be used from the thread that created the model.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @param threads The number of threads in the pool. With no threads, each task is run by the thread asking for
+     * its result.
+     */
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * @return The number of threads to use by default: one less than the number of cores, leaving a core for the
+     * thread submitting the tasks.
+     */
+    static int defaultThreads();
+
+    /**
+     * Queue the given task to be run by the next free thread.
+     * @param task The task to run, it must be safe to run on any thread.
+     * @return The (future) result of the task.
+     */
+    template<typename F>
+    PoolResult<typename std::result_of<F()>::type> submit(F task)
+    {
+        typedef typename std::result_of<F()>::type Result;
+        PoolResult<Result> result;
+        result.mState = std::make_shared<typename PoolResult<Result>::State>();
+        result.mState->started = false;
+        result.mState->task = std::packaged_task<Result()>(task);
+        result.mState->result = result.mState->task.get_future().share();
+        if (mThreads > 0)
+        {
+            auto state = result.mState;
+            enqueue([state]() { state->run(); });
+        }
+        return result;
+    }
+
+private:
+    void enqueue(const std::function<void()>& task);
+    void runTasks();
+
+    int mThreads;
+    std::vector<std::thread> mWorkers;
+    std::deque<std::function<void()> > mQueue;
+    std::mutex mMutex;
+    std::condition_variable mWakeUp;
+    bool mStopping;
+};
+
+#endif // THREADPOOL_HPP
@@ -0,0 +1,30 @@
+#include "uniquenameallocator.hpp"
+#include "utils.hpp"
+
+void UniqueNameAllocator::reserve(const std::wstring& name)
+{
+    mNames.insert(name);
+}
+
+bool UniqueNameAllocator::contains(const std::wstring& name) const
+{
+    return mNames.count(name) == 1;
+}
+
+std::wstring UniqueNameAllocator::allocate(const std::wstring& base)
+{
+    if (mNames.insert(base).second) return base;
+    // carry on from the last suffix given to this base, so each candidate is only tried once
+    uint32_t& suffix = mNextSuffix.insert(std::make_pair(base, uint32_t(1))).first->second;
+    while (true)
+    {
+        std::wstring name = base + L"_" + formatNumber(suffix++);
+        if (mNames.insert(name).second) return name;
+    }
+}
+
+void UniqueNameAllocator::clear()
+{
+    mNames.clear();
+    mNextSuffix.clear();
+}
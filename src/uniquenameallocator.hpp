@@ -0,0 +1,47 @@
+#ifndef UNIQUENAMEALLOCATOR_HPP
+#define UNIQUENAMEALLOCATOR_HPP
+
+#include <string>
+#include <cstdint>
+#include <unordered_set>
+#include <unordered_map>
+
+/**
+ * Hands out names which are unique within one namespace (e.g. the components of a model). A name which is already
+ * taken is made unique by appending "_n", where n counts up from 1 separately for each base name, so the names
+ * given out only depend on the order in which they were asked for.
+ */
+class UniqueNameAllocator
+{
+public:
+    /**
+     * Mark the given name as taken, without checking whether it already was.
+     * @param name The name to reserve.
+     */
+    void reserve(const std::wstring& name);
+
+    /**
+     * @param name The name to check.
+     * @return true if the given name is taken.
+     */
+    bool contains(const std::wstring& name) const;
+
+    /**
+     * Take and return a unique name based on the given name.
+     * @param base The preferred name.
+     * @return <base> if it isn't taken yet, otherwise <base>_n for the lowest n not tried before for this base.
+     */
+    std::wstring allocate(const std::wstring& base);
+
+    /**
+     * Forget all the names taken.
+     */
+    void clear();
+
+private:
+    std::unordered_set<std::wstring> mNames;
+    // the next suffix to try for each base name which has been asked for more than once.
+    std::unordered_map<std::wstring, uint32_t> mNextSuffix;
+};
+
+#endif // UNIQUENAMEALLOCATOR_HPP
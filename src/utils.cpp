@@ -1,9 +1,28 @@
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cstdlib>
 #include <locale>
 #include <codecvt>
 #include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#  include <direct.h>
+#  include <process.h>
+#  include <atomic>
+#  include <thread>
+#else
+#  include <unistd.h>
+#endif
 
 std::string wstring2string(const std::wstring &str)
 {
@@ -44,9 +63,46 @@ formatNumber(const uint32_t value)
 std::wstring
 formatNumber(const double value)
 {
-  wchar_t valueString[100];
-  swprintf(valueString,100,L"%lf",value);
-  return std::wstring(valueString);
+  // same format as %lf, but independent of the current locale so that the output is always valid MathML
+  std::wostringstream oss;
+  oss.imbue(std::locale::classic());
+  oss << std::fixed << std::setprecision(6) << value;
+  return oss.str();
+}
+
+static bool isSpace(wchar_t c)
+{
+    return (c == L' ') || (c == L'\t') || (c == L'\n') || (c == L'\r');
+}
+
+static bool isDigit(wchar_t c)
+{
+    return (c >= L'0') && (c <= L'9');
+}
+
+bool isNumber(const std::wstring& text)
+{
+    std::size_t i = 0, n = text.size();
+    while ((i < n) && isSpace(text[i])) ++i;
+    if ((i < n) && ((text[i] == L'+') || (text[i] == L'-'))) ++i;
+    std::size_t digits = 0;
+    while ((i < n) && isDigit(text[i])) ++i, ++digits;
+    if ((i < n) && (text[i] == L'.'))
+    {
+        ++i;
+        while ((i < n) && isDigit(text[i])) ++i, ++digits;
+    }
+    if (digits == 0) return false;
+    if ((i < n) && ((text[i] == L'e') || (text[i] == L'E')))
+    {
+        ++i;
+        if ((i < n) && ((text[i] == L'+') || (text[i] == L'-'))) ++i;
+        std::size_t exponentDigits = 0;
+        while ((i < n) && isDigit(text[i])) ++i, ++exponentDigits;
+        if (exponentDigits == 0) return false;
+    }
+    while ((i < n) && isSpace(text[i])) ++i;
+    return i == n;
 }
 
 std::wstring replaceAll(const std::wstring& src, wchar_t original, wchar_t replacement)
@@ -66,13 +122,7 @@ std::wstring replaceAll(const std::wstring& src, wchar_t original, wchar_t repla
 std::wstring removeAll(const std::wstring& src, wchar_t original)
 {
     std::wstring copy = src;
-    std::size_t pos = 0;
-    while (1)
-    {
-        pos = copy.find(original, pos);
-        if (pos == std::wstring::npos) break;
-        copy.erase(pos, 1);
-    }
+    copy.erase(std::remove(copy.begin(), copy.end(), original), copy.end());
     return copy;
 }
 
@@ -92,3 +142,183 @@ std::wstring replaceAll(const std::wstring& src, const std::wstring& original,
     }
     return copy;
 }
+
+uint64_t hashBytes(const std::string& bytes, uint64_t seed)
+{
+    uint64_t hash = seed;
+    for (unsigned char c: bytes)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string hashToString(uint64_t hash)
+{
+    char hashString[17];
+    snprintf(hashString, sizeof(hashString), "%016llx", (unsigned long long)hash);
+    return std::string(hashString);
+}
+
+std::string sha256(const std::string& bytes)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    auto rotate = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    // the message is padded with 0x80, zeros and its length in bits to a multiple of 64 bytes
+    std::string message = bytes;
+    uint64_t bits = (uint64_t)bytes.size() * 8;
+    message += (char)0x80;
+    while ((message.size() % 64) != 56) message += (char)0;
+    for (int i = 7; i >= 0; --i) message += (char)((bits >> (i * 8)) & 0xff);
+    for (size_t chunk = 0; chunk < message.size(); chunk += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char* p = (const unsigned char*)message.data() + chunk + i * 4;
+            w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = hh + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+    char digest[65];
+    for (int i = 0; i < 8; ++i) snprintf(digest + i * 8, 9, "%08x", h[i]);
+    return std::string(digest, 64);
+}
+
+int readFile(const std::string& fileName, std::string& content)
+{
+    std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (! in) return -1;
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    content = buffer.str();
+    return 0;
+}
+
+int writeFile(const std::string& fileName, const std::string& content)
+{
+    // write to a temporary file and move it into place, so that other processes never see a partial entry. The
+    // temporary file is unique to this write, so concurrent writers of the same file can't spoil each other's.
+#ifdef _WIN32
+    static std::atomic<unsigned> counter(0);
+    std::string tmpName = fileName + ".tmp." + std::to_string(_getpid()) + "."
+            + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." + std::to_string(++counter);
+    {
+        std::ofstream out(tmpName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+        if (out.fail())
+        {
+            out.close();
+            std::remove(tmpName.c_str());
+            return -1;
+        }
+    }
+#else
+    std::vector<char> tmpTemplate(fileName.begin(), fileName.end());
+    const char suffix[] = ".tmp.XXXXXX";
+    tmpTemplate.insert(tmpTemplate.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(tmpTemplate.data());
+    if (fd < 0) return -1;
+    std::string tmpName(tmpTemplate.data());
+    // mkstemp only gives the owner access, cache entries are as readable as any other file
+    bool failed = (fchmod(fd, 0644) != 0);
+    for (size_t written = 0; !failed && (written < content.size()); )
+    {
+        ssize_t n = write(fd, content.data() + written, content.size() - written);
+        if (n < 0)
+        {
+            if (errno != EINTR) failed = true;
+        }
+        else written += n;
+    }
+    if ((close(fd) != 0) || failed)
+    {
+        std::remove(tmpName.c_str());
+        return -1;
+    }
+#endif
+    if (std::rename(tmpName.c_str(), fileName.c_str()) != 0)
+    {
+        std::remove(tmpName.c_str());
+        return -2;
+    }
+    return 0;
+}
+
+int makeDirectory(const std::string& directory)
+{
+#ifdef _WIN32
+    int status = _mkdir(directory.c_str());
+#else
+    int status = mkdir(directory.c_str(), 0777);
+#endif
+    if ((status != 0) && (errno != EEXIST)) return -1;
+    return 0;
+}
+
+int urlToFileName(const std::string& url, std::string& fileName)
+{
+    std::string path = url.substr(0, url.find('#'));
+    if (path.compare(0, 7, "file://") == 0) path = path.substr(7);
+    else if (path.compare(0, 5, "file:") == 0) path = path.substr(5);
+    else if (path.find("://") != std::string::npos) return -1;
+    // undo any percent encoding
+    fileName.clear();
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        if ((path[i] == '%') && (i + 2 < path.size()) && isxdigit(path[i+1]) && isxdigit(path[i+2]))
+        {
+            fileName += (char)strtol(path.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else fileName += path[i];
+    }
+    return 0;
+}
+
+uint64_t fileStamp(const std::string& fileName)
+{
+    struct stat info;
+    if (stat(fileName.c_str(), &info) != 0) return 0;
+    return ((uint64_t)info.st_mtime << 32) ^ (uint64_t)info.st_size;
+}
@@ -1,6 +1,9 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <string>
+#include <cstdint>
+
 std::string wstring2string(const std::wstring &str);
 std::wstring string2wstring(const std::string& str);
 
@@ -8,6 +11,14 @@ std::wstring formatNumber(const int value);
 std::wstring formatNumber(const uint32_t value);
 std::wstring formatNumber(const double value);
 
+/**
+ * Check whether the given text is a real number in the syntax CellML uses (an optional sign, digits with an optional
+ * decimal point, and an optional exponent), ignoring surrounding whitespace. Independent of the current locale.
+ * @param text The text to check.
+ * @return true if the whole text is a number.
+ */
+bool isNumber(const std::wstring& text);
+
 /**
  * Replace all occurances of <original> in the <src> string with <replacement>.
  * @param src The source string.
@@ -35,4 +46,66 @@ std::wstring replaceAll(const std::wstring &src, const std::wstring& original,
  */
 std::wstring removeAll(const std::wstring& src, wchar_t original);
 
+/**
+ * Read the entire content of the given file.
+ * @param fileName The name of the file to read.
+ * @param content Will be set to the bytes of the file.
+ * @return zero on success.
+ */
+int readFile(const std::string& fileName, std::string& content);
+
+/**
+ * Write the given content to a file. The content is written to a uniquely named temporary file which is then
+ * moved into place, so that other processes never see a partially written file, even when several of them write
+ * the same file at once.
+ * @param fileName The name of the file to write.
+ * @param content The bytes to write.
+ * @return zero on success.
+ */
+int writeFile(const std::string& fileName, const std::string& content);
+
+/**
+ * Convert a URL to the name of the local file it refers to.
+ * @param url The URL, either a file: URL or a plain file name.
+ * @param fileName Will be set to the name of the file.
+ * @return zero on success, non-zero if the URL doesn't refer to a local file.
+ */
+int urlToFileName(const std::string& url, std::string& fileName);
+
+/**
+ * Get the modification time and size of the given file, to check whether it has changed.
+ * @param fileName The file of interest.
+ * @return A stamp which changes when the file changes, or zero if the file can't be found.
+ */
+uint64_t fileStamp(const std::string& fileName);
+
+/**
+ * Create the given directory, if it doesn't already exist.
+ * @param directory The directory to create.
+ * @return zero on success.
+ */
+int makeDirectory(const std::string& directory);
+
+/**
+ * Compute the 64-bit FNV-1a hash of the given bytes.
+ * @param bytes The bytes to hash.
+ * @param seed The hash to continue from, allowing several strings to be hashed together.
+ * @return The hash of the bytes.
+ */
+uint64_t hashBytes(const std::string& bytes, uint64_t seed = 14695981039346656037ULL);
+
+/**
+ * Format a hash as a fixed width hexadecimal string, suitable for use in file names.
+ * @param hash The hash to format.
+ * @return The 16 character hexadecimal representation of the hash.
+ */
+std::string hashToString(uint64_t hash);
+
+/**
+ * Compute the SHA-256 digest of the given bytes, for when a hash collision must not go unnoticed.
+ * @param bytes The bytes to hash.
+ * @return The 64 character hexadecimal digest.
+ */
+std::string sha256(const std::string& bytes);
+
 #endif // UTILS_HPP
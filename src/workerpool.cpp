@@ -0,0 +1,275 @@
+#include <iostream>
+#include <deque>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <sys/wait.h>
+#endif
+
+#include "workerpool.hpp"
+
+#ifndef _WIN32
+
+/// The fixed size part of a result message, followed by the content and report bytes.
+struct ResultHeader
+{
+    int32_t returnCode;
+    int32_t fromCache;
+    double seconds;
+    uint64_t contentSize;
+    uint64_t reportSize;
+};
+
+struct Worker
+{
+    pid_t pid;
+    int jobFd;    // coordinator -> worker: job numbers
+    int resultFd; // worker -> coordinator: results
+    long job;     // the job being run, or -1 if idle
+    int attempt;  // the attempt number of the job being run
+};
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return false; // the worker has gone
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void stopWorker(Worker& worker)
+{
+    if (worker.jobFd >= 0) close(worker.jobFd);
+    if (worker.resultFd >= 0) close(worker.resultFd);
+    worker.jobFd = worker.resultFd = -1;
+    int status;
+    waitpid(worker.pid, &status, 0);
+    worker.pid = -1;
+}
+
+/**
+ * The worker process: run jobs until the coordinator closes the job pipe.
+ */
+static void workerMain(int jobFd, int resultFd, const WorkerFunction& work)
+{
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0)
+    {
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+    uint64_t job;
+    while (readAll(jobFd, &job, sizeof(job)))
+    {
+        WorkerResult result = work(job);
+        ResultHeader header;
+        header.returnCode = result.returnCode;
+        header.fromCache = result.fromCache ? 1 : 0;
+        header.seconds = result.seconds;
+        header.contentSize = result.content.size();
+        header.reportSize = result.report.size();
+        if (! (writeAll(resultFd, &header, sizeof(header)) &&
+               writeAll(resultFd, result.content.data(), result.content.size()) &&
+               writeAll(resultFd, result.report.data(), result.report.size()))) break;
+    }
+    std::wcout.flush();
+    std::wcerr.flush();
+    _exit(0);
+}
+
+static int startWorker(Worker& worker, std::vector<Worker>& workers, const WorkerFunction& work)
+{
+    int jobPipe[2], resultPipe[2];
+    if (pipe(jobPipe) != 0) return -1;
+    if (pipe(resultPipe) != 0)
+    {
+        close(jobPipe[0]);
+        close(jobPipe[1]);
+        return -1;
+    }
+    // make sure nothing buffered gets written twice
+    std::cout.flush();
+    std::wcout.flush();
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(jobPipe[0]);
+        close(jobPipe[1]);
+        close(resultPipe[0]);
+        close(resultPipe[1]);
+        return -2;
+    }
+    if (pid == 0)
+    {
+        // the other workers must only see their pipes close when the coordinator closes them
+        for (const auto& w: workers)
+        {
+            if (w.jobFd >= 0) close(w.jobFd);
+            if (w.resultFd >= 0) close(w.resultFd);
+        }
+        close(jobPipe[1]);
+        close(resultPipe[0]);
+        signal(SIGPIPE, SIG_DFL);
+        workerMain(jobPipe[0], resultPipe[1], work);
+    }
+    close(jobPipe[0]);
+    close(resultPipe[1]);
+    worker.pid = pid;
+    worker.jobFd = jobPipe[1];
+    worker.resultFd = resultPipe[0];
+    worker.job = -1;
+    worker.attempt = 0;
+    return 0;
+}
+
+int runWorkerPool(int nWorkers, const std::vector<size_t>& jobOrder, const WorkerFunction& work,
+                  const ResultFunction& onResult)
+{
+    // a dead worker should show up as a failed write, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+    std::deque<std::pair<size_t, int> > queue; // job, attempt
+    for (size_t job: jobOrder) queue.push_back(std::make_pair(job, 1));
+    if (nWorkers > (int)queue.size()) nWorkers = queue.size();
+    std::vector<Worker> workers(nWorkers);
+    for (auto& w: workers)
+    {
+        w.pid = -1;
+        w.jobFd = w.resultFd = -1;
+        w.job = -1;
+    }
+    for (auto& w: workers)
+    {
+        if (startWorker(w, workers, work) != 0)
+        {
+            std::cerr << "Unable to start the worker processes." << std::endl;
+            for (auto& started: workers) if (started.pid > 0) stopWorker(started);
+            return -1;
+        }
+    }
+    size_t outstanding = queue.size();
+    while (outstanding > 0)
+    {
+        // hand out jobs to the idle workers, replacing any that have gone
+        for (auto& w: workers)
+        {
+            if ((w.job >= 0) || queue.empty()) continue;
+            if ((w.pid < 0) && (startWorker(w, workers, work) != 0)) continue;
+            std::pair<size_t, int> next = queue.front();
+            queue.pop_front();
+            uint64_t job = next.first;
+            w.job = next.first;
+            w.attempt = next.second;
+            // a failed write is picked up as a dead worker below
+            writeAll(w.jobFd, &job, sizeof(job));
+        }
+        std::vector<struct pollfd> fds;
+        std::vector<Worker*> busy;
+        for (auto& w: workers)
+        {
+            if (w.job < 0) continue;
+            struct pollfd pfd;
+            pfd.fd = w.resultFd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            busy.push_back(&w);
+        }
+        if (busy.empty())
+        {
+            std::cerr << "No worker processes left to run the remaining jobs." << std::endl;
+            break;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (fds[i].revents == 0) continue;
+            Worker& w = *busy[i];
+            size_t job = w.job;
+            WorkerResult result;
+            ResultHeader header;
+            bool ok = readAll(w.resultFd, &header, sizeof(header));
+            if (ok)
+            {
+                result.returnCode = header.returnCode;
+                result.fromCache = header.fromCache != 0;
+                result.seconds = header.seconds;
+                result.content.resize(header.contentSize);
+                result.report.resize(header.reportSize);
+                ok = readAll(w.resultFd, &result.content[0], header.contentSize) &&
+                        readAll(w.resultFd, &result.report[0], header.reportSize);
+            }
+            w.job = -1;
+            if (ok)
+            {
+                --outstanding;
+                onResult(job, result);
+                continue;
+            }
+            // the worker died running the job
+            std::cerr << "A worker process died (attempt " << w.attempt << " of job " << job << ")." << std::endl;
+            stopWorker(w);
+            if (w.attempt < 2) queue.push_front(std::make_pair(job, w.attempt + 1));
+            else
+            {
+                --outstanding;
+                result.returnCode = -5;
+                result.fromCache = false;
+                result.seconds = 0.0;
+                result.content.clear();
+                result.report = "The worker process died flattening this model.\n";
+                onResult(job, result);
+            }
+        }
+    }
+    for (auto& w: workers) if (w.pid > 0) stopWorker(w);
+    return outstanding > 0 ? -2 : 0;
+}
+
+#else
+
+int runWorkerPool(int, const std::vector<size_t>& jobOrder, const WorkerFunction& work,
+                  const ResultFunction& onResult)
+{
+    for (size_t job: jobOrder) onResult(job, work(job));
+    return 0;
+}
+
+#endif
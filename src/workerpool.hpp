@@ -0,0 +1,40 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+
+/**
+ * The result of a job run by a worker process, streamed back to the coordinator.
+ */
+struct WorkerResult
+{
+    int returnCode;
+    bool fromCache;
+    double seconds;
+    std::string content;
+    std::string report;
+};
+
+typedef std::function<WorkerResult(size_t job)> WorkerFunction;
+typedef std::function<void(size_t job, const WorkerResult& result)> ResultFunction;
+
+/**
+ * Run jobs on a pool of forked worker processes. Jobs are handed out in the given order, each to the next idle
+ * worker, and the results are passed back to the calling (coordinator) process as they complete. If a worker
+ * dies while running a job, the job is retried once on a new worker; if that fails too, the job's result has a
+ * return code of -5. The standard output of the workers is discarded.
+ *
+ * Not available on Windows, where the jobs are run one after the other in the calling process.
+ *
+ * @param workers The number of worker processes to use.
+ * @param jobOrder The jobs to run, in the order they should be handed out.
+ * @param work The function run by the worker processes for each job.
+ * @param onResult The function run by the coordinator with the result of each job.
+ * @return zero on success, non-zero if the pool could not be started.
+ */
+int runWorkerPool(int workers, const std::vector<size_t>& jobOrder, const WorkerFunction& work,
+                  const ResultFunction& onResult);
+
+#endif // WORKERPOOL_HPP
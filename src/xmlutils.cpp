@@ -4,9 +4,13 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <sstream>
+#include <locale>
+#include <mutex>
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
+#include <libxml/uri.h>
 
 #include "xmlutils.hpp"
 #include "utils.hpp"
@@ -14,9 +18,10 @@
 #define MATHML_NS "http://www.w3.org/1998/Math/MathML"
 #define CELLML_1_0_NS "http://www.cellml.org/cellml/1.0#"
 #define CELLML_1_1_NS "http://www.cellml.org/cellml/1.1#"
+#define XLINK_NS "http://www.w3.org/1999/xlink"
 
 
-static xmlNodeSetPtr executeXPath(xmlDocPtr doc, const xmlChar* xpathExpr)
+static xmlNodeSetPtr executeXPath(xmlDocPtr doc, const xmlChar* xpathExpr, xmlNodePtr contextNode = NULL)
 {
     xmlXPathContextPtr xpathCtx;
     xmlXPathObjectPtr xpathObj;
@@ -40,6 +45,7 @@ static xmlNodeSetPtr executeXPath(xmlDocPtr doc, const xmlChar* xpathExpr)
         return NULL;
     }
     xmlXPathRegisterAllFunctions(xpathCtx);
+    if (contextNode) xpathCtx->node = contextNode;
 
     /* Evaluate xpath expression */
     xpathObj = xmlXPathEvalExpression(xpathExpr, xpathCtx);
@@ -65,49 +71,29 @@ static xmlNodeSetPtr executeXPath(xmlDocPtr doc, const xmlChar* xpathExpr)
     return results;
 }
 
-static std::wstring nodeToString(xmlNodePtr node)
+void initialiseLibXml()
 {
-    std::wstring nodeString;
-    // Need to make sure we have the namespace declarations included in the string - this seems
-    // to work?!
-    xmlDocPtr newDoc = xmlNewDoc(BAD_CAST "1.0");
-    xmlNodePtr newNode = xmlDocCopyNode(node, newDoc, 1);
-    xmlBufferPtr buf = xmlBufferCreate();
-    if (xmlNodeDump(buf, newDoc, newNode, 0, 1) > 0)
-    {
-        std::string text = std::string((char*)xmlBufferContent(buf));
-        nodeString = string2wstring(text);
-        //std::wcout << L"Found text: " << eq << std::endl;
-    }
-    else
-    {
-        std::cerr << "ERROR: unable to get node contents?" << std::endl;
-    }
-    return nodeString;
-}
-
-class LibXMLWrapper
-{
-public:
-    LibXMLWrapper()
-    {
-        std::cout << "initialise libxml\n";
+    static std::once_flag initialised;
+    std::call_once(initialised, []() {
         /* Init libxml */
         xmlInitParser();
         LIBXML_TEST_VERSION
-    }
-    ~LibXMLWrapper()
-    {
-        std::cout << "terminate libxml\n";
-        /* Shutdown libxml */
-        xmlCleanupParser();
-    }
-};
+    });
+}
 
-static LibXMLWrapper dummyWrapper;
+std::string getAttribute(void* element, const char* name, const char* ns)
+{
+    xmlNodePtr node = static_cast<xmlNodePtr>(element);
+    std::string value;
+    xmlChar* s = ns ? xmlGetNsProp(node, BAD_CAST name, BAD_CAST ns) : xmlGetNoNsProp(node, BAD_CAST name);
+    if (s) value = (char*)s;
+    xmlFree(s);
+    return value;
+}
 
-XmlUtils::XmlUtils() : mCurrentDoc(0)
+XmlUtils::XmlUtils() : mCurrentDoc(0), mCurrentNode(0)
 {
+    initialiseLibXml();
 }
 
 XmlUtils::~XmlUtils()
@@ -123,6 +109,8 @@ int XmlUtils::parseString(const std::wstring &data)
     if (mCurrentDoc)
     {
         xmlFreeDoc(static_cast<xmlDocPtr>(mCurrentDoc));
+        mCurrentDoc = 0;
+        mCurrentNode = 0;
     }
     std::string s = wstring2string(data);
     xmlDocPtr doc = xmlParseMemory(s.c_str(), s.size());
@@ -132,93 +120,108 @@ int XmlUtils::parseString(const std::wstring &data)
         return -1;
     }
     mCurrentDoc = static_cast<void*>(doc);
+    mCurrentNode = 0;
+    mCiNodes.clear();
     return 0;
 }
 
-std::wstring XmlUtils::serialise(int format)
+int XmlUtils::parseDocument(const std::string &content, const std::string &url)
 {
-    if (mCurrentDoc == 0)
+    if (mCurrentDoc)
     {
-        std::cerr << L"Trying to serialise nothing?\n";
-        return L"";
+        xmlFreeDoc(static_cast<xmlDocPtr>(mCurrentDoc));
+        mCurrentDoc = 0;
+        mCurrentNode = 0;
     }
+    xmlDocPtr doc = xmlReadMemory(content.data(), content.size(), url.c_str(), NULL, 0);
+    if (doc == NULL)
+    {
+        std::cerr << "Error parsing the document: " << url << std::endl;
+        return -1;
+    }
+    mCurrentDoc = static_cast<void*>(doc);
+    mCurrentNode = 0;
+    mCiNodes.clear();
+    return 0;
+}
+
+std::vector<std::string> XmlUtils::getImportUrls()
+{
+    std::vector<std::string> urls;
     xmlDocPtr doc = static_cast<xmlDocPtr>(mCurrentDoc);
-    xmlChar* data;
-    int size = -1;
-    xmlDocDumpFormatMemory(doc, &data, &size, format);
-    std::string xmlString((char*)data);
-    std::wstring xs = string2wstring(xmlString);
-    xmlFree(data);
-    return xs;
+    xmlNodeSetPtr results = executeXPath(doc, BAD_CAST "//cellml11:import");
+    if (results == NULL) return urls;
+    for (int i = 0; i < xmlXPathNodeSetGetLength(results); ++i)
+    {
+        xmlNodePtr import = xmlXPathNodeSetItem(results, i);
+        xmlChar* href = xmlGetNsProp(import, BAD_CAST "href", BAD_CAST XLINK_NS);
+        if (href == NULL) continue;
+        xmlChar* base = xmlNodeGetBase(doc, import);
+        xmlChar* url = xmlBuildURI(href, base);
+        if (url) urls.push_back(std::string((char*)url));
+        xmlFree(url);
+        xmlFree(base);
+        xmlFree(href);
+    }
+    xmlXPathFreeNodeSet(results);
+    return urls;
 }
 
-std::wstring XmlUtils::extractSingleNode(const std::string &xpath)
+bool XmlUtils::selectSingleNode(const std::string &xpath)
 {
-    std::wstring eq;
+    bool found = false;
     xmlDocPtr doc = static_cast<xmlDocPtr>(mCurrentDoc);
     xmlNodeSetPtr results = executeXPath(doc, BAD_CAST xpath.c_str());
     if (results)
     {
         if (xmlXPathNodeSetGetLength(results) == 1)
         {
-            xmlNodePtr n = xmlXPathNodeSetItem(results, 0);
-            eq = nodeToString(n);
+            mCurrentNode = static_cast<void*>(xmlXPathNodeSetItem(results, 0));
+            mCiNodes.clear();
+            found = true;
         }
         //else std::wcout << L"Not 1 result?" << std::endl;
         xmlXPathFreeNodeSet(results);
     }
-//    else
-//    {
-//        std::wcout << L"No results" << std::endl;
-//        std::cout << "XPath expression: &&" << xpath << "$$" << std::endl;
-//        xmlDocDump(stdout, doc);
-//    }
-    return eq;
+    return found;
 }
 
-std::wstring XmlUtils::matchConstantParameterEquation(const std::wstring &vname)
+bool XmlUtils::matchConstantParameterEquation(const std::wstring &vname)
 {
     std::string xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:ci[normalize-space(text()) = \"";
     xpath += wstring2string(vname);
     xpath += "\"]/following-sibling::mathml:cn/parent::mathml:apply";
-    std::wstring eq = extractSingleNode(xpath);
-    return eq;
+    return selectSingleNode(xpath);
 }
 
-std::wstring XmlUtils::matchSimpleEquality(const std::wstring &vname)
+bool XmlUtils::matchSimpleEquality(const std::wstring &vname)
 {
     std::string xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:ci[normalize-space(text()) = \"";
     xpath += wstring2string(vname);
     xpath += "\"]/following-sibling::mathml:ci/parent::mathml:apply";
-    std::wstring eq = extractSingleNode(xpath);
-    return eq;
+    return selectSingleNode(xpath);
 }
 
-std::wstring XmlUtils::matchAlgebraicLhs(const std::wstring &vname)
+bool XmlUtils::matchAlgebraicLhs(const std::wstring &vname)
 {
     std::string xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:ci[position() = 1 and normalize-space(text()) = \"";
     xpath += wstring2string(vname);
     xpath += "\"]/following-sibling::mathml:apply/parent::mathml:apply";
-    std::wstring eq = extractSingleNode(xpath);
-    if (eq.empty())
-    {
-        // check for a piecewise
-        xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:ci[position() = 1 and normalize-space(text()) = \"";
-        xpath += wstring2string(vname);
-        xpath += "\"]/following-sibling::mathml:piecewise/parent::mathml:apply";
-        eq = extractSingleNode(xpath);
-    }
-    return eq;
+    if (selectSingleNode(xpath)) return true;
+    // check for a piecewise
+    xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:ci[position() = 1 and normalize-space(text()) = \"";
+    xpath += wstring2string(vname);
+    xpath += "\"]/following-sibling::mathml:piecewise/parent::mathml:apply";
+    return selectSingleNode(xpath);
 }
 
-std::wstring XmlUtils::matchDifferential(const std::wstring &vname)
+bool XmlUtils::matchDifferential(const std::wstring &vname)
 {
     std::string xpath = "/mathml:math/mathml:apply/mathml:eq/following-sibling::mathml:apply[1]/mathml:diff/"
             "following-sibling::mathml:ci[normalize-space(text()) = \"";
     xpath += wstring2string(vname);
     xpath += "\"]/parent::mathml:apply/parent::mathml:apply";
-    std::wstring eq = extractSingleNode(xpath);
-    return eq;
+    return selectSingleNode(xpath);
 }
 
 bool XmlUtils::matchVariableOfIntegration(const std::wstring &vname)
@@ -227,24 +230,24 @@ bool XmlUtils::matchVariableOfIntegration(const std::wstring &vname)
             "following-sibling::mathml:bvar/mathml:ci[normalize-space(text()) = \"";
     xpath += wstring2string(vname);
     xpath += "\"]/parent::mathml:bvar/parent::mathml:apply/parent::mathml:apply";
-    std::wstring eq = extractSingleNode(xpath);
-    if (eq.empty()) return false;
-    return true;
+    xmlNodeSetPtr results = executeXPath(static_cast<xmlDocPtr>(mCurrentDoc), BAD_CAST xpath.c_str());
+    if (results == NULL) return false;
+    bool found = (xmlXPathNodeSetGetLength(results) == 1);
+    xmlXPathFreeNodeSet(results);
+    return found;
 }
 
 int XmlUtils::numericalAssignmentGetValue(double *value, std::wstring &unitsName)
 {
     int returnCode = 0;
-    std::string xpath = "/mathml:apply/mathml:cn";
-    std::cout << "XPath expression: &&" << xpath << "$$" << std::endl;
+    std::string xpath = "mathml:cn";
     returnCode = getDoubleContent(xpath.c_str(), value);
     if (returnCode != 0) return -2;
-    std::cout << "got a double value: " << *value << std::endl;
-    xpath = "/mathml:apply/mathml:cn/@cellml11:units";
+    xpath = "mathml:cn/@cellml11:units";
     unitsName = string2wstring(getTextContent(xpath.c_str()));
     if (unitsName.empty())
     {
-        xpath = "/mathml:apply/mathml:cn/@cellml10:units";
+        xpath = "mathml:cn/@cellml10:units";
         unitsName = string2wstring(getTextContent(xpath.c_str()));
         if (unitsName.empty())
         {
@@ -252,7 +255,6 @@ int XmlUtils::numericalAssignmentGetValue(double *value, std::wstring &unitsName
             return -1;
         }
     }
-    std::wcout << L"Found units: " << unitsName << std::endl;
     return returnCode;
 }
 
@@ -260,7 +262,7 @@ std::string XmlUtils::getTextContent(const char* xpathExpr)
 {
     std::string text;
     xmlDocPtr doc = static_cast<xmlDocPtr>(mCurrentDoc);
-    xmlNodeSetPtr results = executeXPath(doc, BAD_CAST xpathExpr);
+    xmlNodeSetPtr results = executeXPath(doc, BAD_CAST xpathExpr, static_cast<xmlNodePtr>(mCurrentNode));
     if (results)
     {
         if (xmlXPathNodeSetGetLength(results) == 1)
@@ -287,7 +289,11 @@ int XmlUtils::getDoubleContent(const char* xpathExpr, double* value)
     std::string textContent = getTextContent(xpathExpr);
     if (! textContent.empty())
     {
-        if (sscanf(textContent.c_str(), "%lf", value) == 1) returnCode = 0;
+        // always read numbers the MathML way, whatever the locale
+        std::istringstream iss(textContent);
+        iss.imbue(std::locale::classic());
+        iss >> *value;
+        if (! iss.fail()) returnCode = 0;
         else std::cerr << "getDoubleContent: found a value for xpath expression, but its not a number: \""
                        << textContent << "\"" << std::endl;
     }
@@ -297,57 +303,158 @@ int XmlUtils::getDoubleContent(const char* xpathExpr, double* value)
 std::pair<std::wstring, std::wstring> XmlUtils::simpleEqualityGetVariableNames()
 {
     std::pair<std::wstring, std::wstring> p;
-    std::string ci = getTextContent("/mathml:apply/mathml:ci[1]");
+    std::string ci = getTextContent("mathml:ci[1]");
     if (! ci.empty()) p.first = string2wstring(ci);
-    ci = getTextContent("/mathml:apply/mathml:ci[2]");
+    ci = getTextContent("mathml:ci[2]");
     if (! ci.empty()) p.second = string2wstring(ci);
     return p;
 }
 
+/**
+ * Get the name of the variable referenced by the given ci element, ignoring any spaces.
+ */
+static std::wstring ciName(xmlNodePtr ci)
+{
+    xmlChar* s = xmlNodeGetContent(ci);
+    std::string name((char*)s);
+    xmlFree(s);
+    name.erase(std::remove(name.begin(), name.end(), ' '), name.end());
+    return string2wstring(name);
+}
+
 std::vector<std::wstring> XmlUtils::getCiList()
 {
     std::vector<std::wstring> names;
-    xmlDocPtr doc = static_cast<xmlDocPtr>(mCurrentDoc);
-    xmlNodeSetPtr results = executeXPath(doc, BAD_CAST "//mathml:ci");
-    if (results)
+    mCiNodes.clear();
+    xmlNodePtr top = static_cast<xmlNodePtr>(mCurrentNode);
+    if (top == NULL) top = xmlDocGetRootElement(static_cast<xmlDocPtr>(mCurrentDoc));
+    // walk the subtree once, ci elements don't have element children so there is no need to look inside them.
+    xmlNodePtr node = top;
+    while (node)
     {
-        int i, n = xmlXPathNodeSetGetLength(results);
-        for (i=0; i < n; ++i)
+        bool isCi = (node->type == XML_ELEMENT_NODE) && xmlStrEqual(node->name, BAD_CAST "ci") && node->ns
+                && xmlStrEqual(node->ns->href, BAD_CAST MATHML_NS);
+        if (isCi)
         {
-            xmlNodePtr n = xmlXPathNodeSetItem(results, i);
-            xmlChar* s = xmlNodeGetContent(n);
-            std::wstring name = string2wstring((char*)s);
-            name = removeAll(name, L' ');
-            //std::wcout << L"ci result: '" << name << L"'" << std::endl;
-            xmlFree(s);
-            if (std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+            std::wstring name = ciName(node);
+            std::vector<void*>& nodes = mCiNodes[name];
+            if (nodes.empty()) names.push_back(name);
+            nodes.push_back(static_cast<void*>(node));
         }
-        xmlXPathFreeNodeSet(results);
+        else if (node->children && (node->type == XML_ELEMENT_NODE))
+        {
+            node = node->children;
+            continue;
+        }
+        while (node && (node != top) && (node->next == NULL)) node = node->parent;
+        if ((node == NULL) || (node == top)) break;
+        node = node->next;
     }
     return names;
 }
 
-std::wstring XmlUtils::updateCiElements(const std::map<std::wstring, std::wstring> &nameMapping)
+int XmlUtils::updateCiElements(const std::unordered_map<std::wstring, std::wstring> &nameMapping)
+{
+    if (mCiNodes.empty()) getCiList();
+    for (const auto& m: nameMapping)
+    {
+        auto ci = mCiNodes.find(m.first);
+        if (ci == mCiNodes.end()) continue;
+        std::string newName = wstring2string(m.second);
+        for (auto n: ci->second) xmlNodeSetContent(static_cast<xmlNodePtr>(n), BAD_CAST newName.c_str());
+    }
+    return 0;
+}
+
+void* XmlUtils::mathElement()
+{
+    if (mCurrentDoc == 0)
+    {
+        xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+        xmlNodePtr math = xmlNewNode(NULL, BAD_CAST "math");
+        xmlSetNs(math, xmlNewNs(math, BAD_CAST MATHML_NS, NULL));
+        xmlDocSetRootElement(doc, math);
+        mCurrentDoc = static_cast<void*>(doc);
+    }
+    return static_cast<void*>(xmlDocGetRootElement(static_cast<xmlDocPtr>(mCurrentDoc)));
+}
+
+/**
+ * Add the given node to the math element. New equations go in front of the existing ones, which is the order
+ * the compacted math has always been generated in.
+ */
+static void insertEquation(xmlNodePtr math, xmlNodePtr equation)
+{
+    if (math->children) xmlAddPrevSibling(math->children, equation);
+    else xmlAddChild(math, equation);
+}
+
+int XmlUtils::copyCurrentNode(XmlUtils &target)
+{
+    xmlNodePtr node = static_cast<xmlNodePtr>(mCurrentNode);
+    if ((node == NULL) || (&target == this)) return -1;
+    if (target.mCurrentDoc) xmlFreeDoc(static_cast<xmlDocPtr>(target.mCurrentDoc));
+    target.mCurrentDoc = 0;
+    target.mCurrentNode = 0;
+    target.mCiNodes.clear();
+    xmlDocPtr sourceDoc = static_cast<xmlDocPtr>(mCurrentDoc);
+    xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+    // a shallow copy of the root keeps its attributes and namespace declarations
+    xmlNodePtr root = xmlDocCopyNode(xmlDocGetRootElement(sourceDoc), doc, 2);
+    xmlDocSetRootElement(doc, root);
+    xmlNodePtr copy = NULL;
+    if ((root == NULL) || (xmlDOMWrapCloneNode(NULL, sourceDoc, node, &copy, doc, root, 1, 0) != 0) || !copy)
+    {
+        xmlFreeDoc(doc);
+        return -2;
+    }
+    xmlAddChild(root, copy);
+    target.mCurrentDoc = static_cast<void*>(doc);
+    target.mCurrentNode = static_cast<void*>(copy);
+    return 0;
+}
+
+int XmlUtils::addEquation(XmlUtils &source)
 {
+    xmlNodePtr equation = static_cast<xmlNodePtr>(source.mCurrentNode);
+    if (equation == NULL)
+    {
+        std::cerr << "XmlUtils::addEquation: no equation selected in the source document." << std::endl;
+        return -1;
+    }
+    xmlDocPtr sourceDoc = static_cast<xmlDocPtr>(source.mCurrentDoc);
+    xmlNodePtr math = static_cast<xmlNodePtr>(mathElement());
     xmlDocPtr doc = static_cast<xmlDocPtr>(mCurrentDoc);
-    xmlNodeSetPtr results = executeXPath(doc, BAD_CAST "//mathml:ci");
-    if (results)
+    xmlUnlinkNode(equation);
+    source.mCurrentNode = 0;
+    source.mCiNodes.clear();
+    // adopting the node takes care of the namespaces and dictionary owned strings of the source document.
+    if (xmlDOMWrapAdoptNode(NULL, sourceDoc, equation, doc, math, 0) != 0)
     {
-        int i, n = xmlXPathNodeSetGetLength(results);
-        for (i=0; i < n; ++i)
-        {
-            xmlNodePtr n = xmlXPathNodeSetItem(results, i);
-            xmlChar* s = xmlNodeGetContent(n);
-            std::wstring name = string2wstring((char*)s);
-            name = removeAll(name, L' ');
-            xmlFree(s);
-            if (nameMapping.count(name))
-            {
-                std::string newName = wstring2string(nameMapping.at(name));
-                xmlNodeSetContent(n, BAD_CAST newName.c_str());
-            }
-        }
-        xmlXPathFreeNodeSet(results);
+        std::cerr << "XmlUtils::addEquation: unable to adopt the equation into the math document." << std::endl;
+        xmlFreeNode(equation);
+        return -2;
     }
-    return nodeToString(xmlDocGetRootElement(doc));
+    insertEquation(math, equation);
+    return 0;
+}
+
+int XmlUtils::addConstantParameterEquation(const std::wstring &vname, double value, const std::wstring &unitsName)
+{
+    xmlNodePtr math = static_cast<xmlNodePtr>(mathElement());
+    xmlNsPtr cellmlNs = xmlSearchNsByHref(math->doc, math, BAD_CAST CELLML_1_0_NS);
+    if (cellmlNs == NULL) cellmlNs = xmlNewNs(math, BAD_CAST CELLML_1_0_NS, BAD_CAST "cellml");
+    xmlNodePtr apply = xmlNewNode(math->ns, BAD_CAST "apply");
+    xmlNewChild(apply, math->ns, BAD_CAST "eq", NULL);
+    xmlNewTextChild(apply, math->ns, BAD_CAST "ci", BAD_CAST wstring2string(vname).c_str());
+    xmlNodePtr cn = xmlNewTextChild(apply, math->ns, BAD_CAST "cn", BAD_CAST wstring2string(formatNumber(value)).c_str());
+    xmlNewNsProp(cn, cellmlNs, BAD_CAST "units", BAD_CAST wstring2string(unitsName).c_str());
+    insertEquation(math, apply);
+    return 0;
+}
+
+void* XmlUtils::rootElement()
+{
+    if (mCurrentDoc == 0) return NULL;
+    return static_cast<void*>(xmlDocGetRootElement(static_cast<xmlDocPtr>(mCurrentDoc)));
 }
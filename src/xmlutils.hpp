@@ -4,6 +4,24 @@
 #include <utility>
 #include <string>
 #include <vector>
+#include <map>
+#include <unordered_map>
+
+/**
+ * Initialise libxml the first time it is needed, from whichever thread gets there first. libxml is never
+ * cleaned up, as other threads (or the application using the library) may still be using it. Creating an XmlUtils
+ * takes care of this, code using libxml directly should call it first.
+ */
+void initialiseLibXml();
+
+/**
+ * Get the value of an attribute of the given element.
+ * @param element The element (an xmlNodePtr).
+ * @param name The local name of the attribute.
+ * @param ns The namespace of the attribute, or NULL for an attribute without a namespace.
+ * @return The UTF-8 value of the attribute, or an empty string if the element doesn't have the attribute.
+ */
+std::string getAttribute(void* element, const char* name, const char* ns = NULL);
 
 class XmlUtils
 {
@@ -11,44 +29,60 @@ public:
     XmlUtils();
     ~XmlUtils();
 
+    XmlUtils(const XmlUtils&) = delete;
+    XmlUtils& operator=(const XmlUtils&) = delete;
+
     int parseString(const std::wstring &data);
-    std::wstring serialise(int format = 1);
+
+    /**
+     * Parse the given document, keeping the URL it was loaded from so that relative references can be resolved.
+     * @param content The UTF-8 content of the document.
+     * @param url The URL of the document.
+     * @return zero on success.
+     */
+    int parseDocument(const std::string& content, const std::string& url);
+
+    /**
+     * The current document is expected to be a CellML 1.1 model. Find the documents that it imports.
+     * @return The absolute URLs of the imported documents, in document order.
+     */
+    std::vector<std::string> getImportUrls();
 
     /**
      * Checks the current XML document to see if a constant parameter equation can be found for the given
      * variable name. e.g., vname = 1.23 [ms]
      * @param vname The variable name to search for.
-     * @return The MathML string containing the matching simple assignment equation, if one is found.
-     * Otherwise the empty string is returned.
+     * @return true if a matching simple assignment equation is found, in which case it becomes the current
+     * node. Otherwise false is returned.
      */
-    std::wstring matchConstantParameterEquation(const std::wstring& vname);
+    bool matchConstantParameterEquation(const std::wstring& vname);
 
     /**
      * Checks the current XML document to see if a simple variable equality equation can be found for the
      * given variable name. e.g., vname = otherVariable
      * @param vname The variable name to search for.
-     * @return The MathML string containing the matching simple equality equation, if one is found. Otherwise
-     * the empty string will be returned.
+     * @return true if a matching simple equality equation is found, in which case it becomes the current
+     * node. Otherwise false is returned.
      */
-    std::wstring matchSimpleEquality(const std::wstring& vname);
+    bool matchSimpleEquality(const std::wstring& vname);
 
     /**
      * Checks the current XML document to see if the named variable can be found in a simple LHS assignment
      * of an algebraic expression. e.g., vname = a * x + b
      * @param vname The name of the variable to search for.
-     * @return The MathML string containing the matching equation, if one is found. Otherwise the empty string
-     * is returned.
+     * @return true if a matching equation is found, in which case it becomes the current node. Otherwise
+     * false is returned.
      */
-    std::wstring matchAlgebraicLhs(const std::wstring& vname);
+    bool matchAlgebraicLhs(const std::wstring& vname);
 
     /**
      * Checks the current XML document to see if the named variable can be found in a differential equation LHS.
      * e.g., d(vname)/d(time) = ...
      * @param vname The name of the variable to search for.
-     * @return The MathML string containing the matching equation, if one is found. Otherwise the empty string
-     * is returned.
+     * @return true if a matching equation is found, in which case it becomes the current node. Otherwise
+     * false is returned.
      */
-    std::wstring matchDifferential(const std::wstring& vname);
+    bool matchDifferential(const std::wstring& vname);
 
     /**
      * Returns true if the given variable matches the pattern for a variable of integration.
@@ -58,7 +92,7 @@ public:
     bool matchVariableOfIntegration(const std::wstring &vname);
 
     /**
-     * The current document is expected to be a simple MathML numerical assignment, and this function will return
+     * The current node is expected to be a simple MathML numerical assignment, and this function will return
      * the numerical value being assigned and the units specified in the math.
      * @param value The numerical value being assigned.
      * @param unitsName The name of the units specified on the numerical value (an error if no units present).
@@ -67,39 +101,84 @@ public:
     int numericalAssignmentGetValue(double* value, std::wstring& unitsName);
 
     /**
-     * The current document is expected to be a simple MathML variable equality, and this function will return the
+     * The current node is expected to be a simple MathML variable equality, and this function will return the
      * two variable names.
      * @return The pair of variable names in the equality relationship.
      */
     std::pair<std::wstring, std::wstring> simpleEqualityGetVariableNames();
 
     /**
-     * Find all the CellML variable names used in the current MathML document.
-     * @return A list of all the variable names found in the current document. Each name will only appear once.
+     * Find all the CellML variable names used in the current node. The ci elements found are remembered so that
+     * they can be renamed by updateCiElements without searching for them again.
+     * @return A list of all the variable names found in the current node, in document order. Each name will only
+     * appear once.
      */
     std::vector<std::wstring> getCiList();
 
     /**
-     * Update all the ci elements in the current MathML document with the given name mappings.
+     * Update all the ci elements in the current node with the given name mappings. The current node is
+     * modified in place.
      * @param nameMapping The mapping from existing name to a new name.
-     * @return The updated MathML document string.
+     * @return zero on success.
+     */
+    int updateCiElements(const std::unordered_map<std::wstring, std::wstring>& nameMapping);
+
+    /**
+     * Copy the current node into a document of its own, holding a copy of the root element (with its attributes
+     * and namespace declarations) whose only child is the copy of the current node. The copy is made tree to tree,
+     * no serialisation is involved.
+     * @param target Will be given the new document, with the copy as its current node. Anything it held is
+     * dropped.
+     * @return zero on success.
+     */
+    int copyCurrentNode(XmlUtils& target);
+
+    /**
+     * Move the current node of the given document into the math element of this document, creating the math
+     * element if this document is empty. The equation is transferred as a tree, no serialisation is involved.
+     * @param source The document whose current node is to be moved. It will no longer have a current node.
+     * @return zero on success.
+     */
+    int addEquation(XmlUtils& source);
+
+    /**
+     * Add a constant parameter equation (vname = value [units]) to the math element of this document,
+     * creating the math element if this document is empty.
+     * @param vname The name of the constant parameter variable.
+     * @param value The value to set in the equation.
+     * @param unitsName The name of the units to give the numerical constant.
+     * @return zero on success.
      */
-    std::wstring updateCiElements(const std::map<std::wstring, std::wstring>& nameMapping);
+    int addConstantParameterEquation(const std::wstring& vname, double value, const std::wstring& unitsName);
+
+    /**
+     * @return The root element of the current document (as an xmlNodePtr), or NULL if there is no document.
+     */
+    void* rootElement();
 
 private:
     void* mCurrentDoc;
+    void* mCurrentNode;
+    // the ci elements (xmlNodePtr) in the current node, keyed by the variable name they reference.
+    std::unordered_map<std::wstring, std::vector<void*> > mCiNodes;
 
     std::string getTextContent(const char* xpathExpr);
     int getDoubleContent(const char* xpathExpr, double* value);
 
     /**
-     * Look for a single node in the current XML doc which matches the given xpathExpr. If one is found, serialise it
-     * and return the serialisation.
+     * Look for a single node in the current XML doc which matches the given xpathExpr. If one is found, make it
+     * the current node.
      * @param xpathExpr The XPath expression to execute on the current document.
-     * @return If executing the XPath expression on the current document results in a single result node, serialise it
-     * to a string and return it. Otherwise, return the empty string.
+     * @return true if executing the XPath expression on the current document results in a single result node.
+     * Otherwise, return false and leave the current node unchanged.
+     */
+    bool selectSingleNode(const std::string& xpathExpr);
+
+    /**
+     * Make sure this document has a math element to add equations to.
+     * @return The math element (as an xmlNodePtr).
      */
-    std::wstring extractSingleNode(const std::string& xpathExpr);
+    void* mathElement();
 };
 
 #endif // XMLUTILS_HPP
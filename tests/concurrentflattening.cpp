@@ -0,0 +1,132 @@
+/**
+ * Flatten a set of models concurrently, each thread with its own Flattener, and check that every output is
+ * byte for byte the same as the output of flattening the same model serially.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "flattencellml.hpp"
+
+static const int MODELS = 8;
+static const int THREADS = 4;
+
+static const char* LIBRARY_MODEL =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<model xmlns=\"http://www.cellml.org/cellml/1.1#\" name=\"library\">\n"
+    "  <component name=\"decay\">\n"
+    "    <variable name=\"k\" units=\"dimensionless\" public_interface=\"in\"/>\n"
+    "    <variable name=\"x0\" units=\"dimensionless\" public_interface=\"in\"/>\n"
+    "    <variable name=\"x\" units=\"dimensionless\" public_interface=\"out\"/>\n"
+    "    <math xmlns=\"http://www.w3.org/1998/Math/MathML\">\n"
+    "      <apply><eq/><ci>x</ci>\n"
+    "        <apply><times/><ci>x0</ci><apply><exp/><apply><minus/><ci>k</ci></apply></apply></apply>\n"
+    "      </apply>\n"
+    "    </math>\n"
+    "  </component>\n"
+    "</model>\n";
+
+/**
+ * @param n The model number, which sets its parameter values.
+ * @return A CellML 1.1 model importing the library model.
+ */
+static std::string topModel(int n)
+{
+    std::string value = std::to_string(n);
+    return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<model xmlns=\"http://www.cellml.org/cellml/1.1#\" xmlns:xlink=\"http://www.w3.org/1999/xlink\""
+           " name=\"model_" + value + "\">\n"
+           "  <import xlink:href=\"library.cellml\">\n"
+           "    <component name=\"decay\" component_ref=\"decay\"/>\n"
+           "  </import>\n"
+           "  <component name=\"parameters\">\n"
+           "    <variable name=\"k\" units=\"dimensionless\" initial_value=\"" + value + ".5\""
+           " public_interface=\"out\"/>\n"
+           "    <variable name=\"x0\" units=\"dimensionless\" initial_value=\"" + value + "\""
+           " public_interface=\"out\"/>\n"
+           "  </component>\n"
+           "  <component name=\"observer\">\n"
+           "    <variable name=\"x\" units=\"dimensionless\" public_interface=\"in\"/>\n"
+           "  </component>\n"
+           "  <connection>\n"
+           "    <map_components component_1=\"parameters\" component_2=\"decay\"/>\n"
+           "    <map_variables variable_1=\"k\" variable_2=\"k\"/>\n"
+           "    <map_variables variable_1=\"x0\" variable_2=\"x0\"/>\n"
+           "  </connection>\n"
+           "  <connection>\n"
+           "    <map_components component_1=\"observer\" component_2=\"decay\"/>\n"
+           "    <map_variables variable_1=\"x\" variable_2=\"x\"/>\n"
+           "  </connection>\n"
+           "</model>\n";
+}
+
+static bool resolveImport(const std::string& url, std::string& content)
+{
+    if (url != "http://example.org/models/library.cellml") return false;
+    content = LIBRARY_MODEL;
+    return true;
+}
+
+/**
+ * The output of flattening one model in one of the modes.
+ */
+struct Result
+{
+    int returnCode = -1;
+    std::string output;
+};
+
+/**
+ * Flatten every model, in both modes, for which (model number % stride) == offset.
+ * @param results The results, indexed by model number * 2 + mode.
+ */
+static void flattenModels(int offset, int stride, std::vector<Result>& results)
+{
+    flattencellml::Flattener flattener(resolveImport);
+    // also exercise the thread pool used for the math
+    flattener.setThreads(2);
+    for (int n = offset; n < MODELS; n += stride)
+    {
+        std::string baseUri = "http://example.org/models/model_" + std::to_string(n) + ".cellml";
+        for (int m = 0; m < 2; ++m)
+        {
+            flattencellml::Mode mode = m ? flattencellml::Mode::Variables : flattencellml::Mode::Model;
+            flattencellml::Report report;
+            Result& result = results[n * 2 + m];
+            result.returnCode = flattener.flatten(mode, topModel(n), baseUri, result.output, report);
+        }
+    }
+}
+
+int main()
+{
+    std::vector<Result> serial(MODELS * 2), concurrent(MODELS * 2);
+    flattenModels(0, 1, serial);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t)
+    {
+        threads.push_back(std::thread(flattenModels, t, THREADS, std::ref(concurrent)));
+    }
+    for (auto& thread: threads) thread.join();
+
+    int failures = 0;
+    for (int i = 0; i < MODELS * 2; ++i)
+    {
+        const char* mode = (i % 2) ? "variables" : "model";
+        if (serial[i].returnCode != 0)
+        {
+            std::cerr << "Model " << i / 2 << " (" << mode << " mode) failed to flatten serially: "
+                      << serial[i].returnCode << std::endl;
+            ++failures;
+        }
+        else if ((concurrent[i].returnCode != serial[i].returnCode) || (concurrent[i].output != serial[i].output))
+        {
+            std::cerr << "Model " << i / 2 << " (" << mode << " mode) flattened differently on a thread."
+                      << std::endl;
+            ++failures;
+        }
+    }
+    if (failures == 0) std::cerr << "All " << MODELS * 2 << " concurrent flattenings match." << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+/**
+ * Check the SHA-256 implementation used by the output and import caches against known answers, including inputs
+ * either side of each padding boundary: 55 bytes is the longest message whose length fits in its last block,
+ * 56 bytes needs an extra block for the length, and 64 bytes fills a block exactly.
+ */
+#include <iostream>
+#include <string>
+
+#include "utils.hpp"
+
+struct KnownAnswer
+{
+    std::string message;
+    const char* description;
+    const char* digest;
+};
+
+int main()
+{
+    const KnownAnswer answers[] = {
+        { "", "the empty message", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { "abc", "\"abc\"", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "the 448 bit message",
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { std::string(55, 'a'), "55 bytes", "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318" },
+        { std::string(56, 'a'), "56 bytes", "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a" },
+        { std::string(57, 'a'), "57 bytes", "f13b2d724659eb3bf47f2dd6af1accc87b81f09f59f2b75e5c0bed6589dfe8c6" },
+        { std::string(63, 'a'), "63 bytes", "7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34" },
+        { std::string(64, 'a'), "64 bytes", "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb" },
+        { std::string(65, 'a'), "65 bytes", "635361c48bb9eab14198e76ea8ab7f1a41685d6ad62aa9146d301d4f17eb0ae0" },
+        { std::string(1000000, 'a'), "one million bytes",
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+    int failures = 0;
+    for (const auto& answer: answers)
+    {
+        std::string digest = sha256(answer.message);
+        if (digest != answer.digest)
+        {
+            std::cerr << "SHA-256 of " << answer.description << " is " << digest << ", expected " << answer.digest
+                      << std::endl;
+            ++failures;
+        }
+    }
+    if (failures == 0) std::cerr << "All SHA-256 known answers match." << std::endl;
+    return failures == 0 ? 0 : 1;
+}